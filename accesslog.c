@@ -0,0 +1,330 @@
+#include "accesslog.h"
+#include "atomics.h"
+#include "common.h"
+#include "mutex.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+
+#define ACCESS_LOG_SIZE \
+	(sizeof (xms_access_header) + \
+	 ACCESS_LOG_RECORDS * sizeof (xms_access_record))
+
+#define RECORD_AT(f, i) \
+	((xms_access_record *) ((f)->map + sizeof (xms_access_header)) + (i))
+
+
+/*
+ * A mapped log file. Writers take slots by incrementing `next', the one
+ * who gets the first slot past the end rotates the file. There are only
+ * two of them, so a writer which has loaded a stale pointer never touches
+ * freed memory: it sees that the file is not current anymore and retries.
+ */
+typedef struct _access_file {
+	int fd;
+	unsigned char *map;
+
+	/* the next free slot, may go past ACCESS_LOG_RECORDS */
+	uint64_t next;
+
+	/* writers between taking a slot and completing the record */
+	unsigned int writers;
+} access_file;
+
+
+static struct {
+	char *path;
+	char *rotated;
+	access_file files[2];
+	access_file *current;
+	SIMPLE_MUTEX *mutex;
+} alog;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static bool
+header_valid (const xms_access_header *hdr)
+{
+	return memcmp (hdr->magic, ACCESS_LOG_MAGIC, sizeof (hdr->magic)) == 0
+		&& hdr->version == ACCESS_LOG_VERSION
+		&& hdr->record_size == sizeof (xms_access_record)
+		&& hdr->capacity == ACCESS_LOG_RECORDS;
+}
+
+
+/* an amount of records of a file left by a previous run */
+static uint64_t
+count_records (access_file *f, off_t size)
+{
+	uint64_t count;
+
+	count = (size - sizeof (xms_access_header)) / sizeof (xms_access_record);
+
+	if (count > ACCESS_LOG_RECORDS)
+		count = ACCESS_LOG_RECORDS;
+
+	/* a preallocated tail after a crash */
+	while (count > 0 && !(RECORD_AT (f, count - 1)->flags &
+		ACCESS_RECORD_VALID))
+	{
+		count--;
+	}
+
+	return count;
+}
+
+
+static bool
+file_open (access_file *f, bool append)
+{
+	xms_access_header hdr;
+	struct stat st;
+	void *map;
+	bool valid = false;
+
+
+	f->fd = open (alog.path, O_RDWR | O_CREAT, 0644);
+
+	if (f->fd == -1 || fstat (f->fd, &st) != 0) {
+		error ("access log: open `%s': %s\n", alog.path, strerror (errno));
+		goto failed;
+	}
+
+	if (append && (size_t) st.st_size >= sizeof (hdr) &&
+		pread (f->fd, &hdr, sizeof (hdr), 0) == sizeof (hdr))
+	{
+		valid = header_valid (&hdr) &&
+			(size_t) st.st_size <= ACCESS_LOG_SIZE;
+	}
+
+	/* a foreign or an incompatible file is moved aside */
+	if (!valid && st.st_size > 0) {
+		(void) close (f->fd);
+
+		if (rename (alog.path, alog.rotated) != 0)
+			warn ("access log: rename `%s': %s\n",
+				alog.path, strerror (errno));
+
+		f->fd = open (alog.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		st.st_size = 0;
+
+		if (f->fd == -1) {
+			error ("access log: create `%s': %s\n",
+				alog.path, strerror (errno));
+			goto failed;
+		}
+	}
+
+	if (ftruncate (f->fd, ACCESS_LOG_SIZE) != 0) {
+		error ("access log: ftruncate `%s': %s\n",
+			alog.path, strerror (errno));
+		goto failed;
+	}
+
+	map = mmap (NULL, ACCESS_LOG_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, f->fd, 0);
+
+	if (map == MAP_FAILED) {
+		error ("access log: mmap `%s': %s\n", alog.path, strerror (errno));
+		goto failed;
+	}
+
+	/* `writers' is left as is: a stale writer may be backing off */
+	f->map = map;
+
+	if (valid)
+		f->next = count_records (f, st.st_size);
+	else {
+		memset (&hdr, 0, sizeof (hdr));
+		memcpy (hdr.magic, ACCESS_LOG_MAGIC, sizeof (hdr.magic));
+		hdr.version = ACCESS_LOG_VERSION;
+		hdr.record_size = sizeof (xms_access_record);
+		hdr.capacity = ACCESS_LOG_RECORDS;
+		memcpy (f->map, &hdr, sizeof (hdr));
+		f->next = 0;
+	}
+
+	return true;
+
+failed:
+	if (f->fd != -1)
+		(void) close (f->fd);
+	f->fd = -1;
+	return false;
+}
+
+
+/* no writers must be left, drops the preallocated tail */
+static void
+file_close (access_file *f)
+{
+	uint64_t count = f->next;
+
+	if (count > ACCESS_LOG_RECORDS)
+		count = ACCESS_LOG_RECORDS;
+
+	(void) munmap (f->map, ACCESS_LOG_SIZE);
+	f->map = NULL;
+
+	(void) ftruncate (f->fd, sizeof (xms_access_header) +
+		count * sizeof (xms_access_record));
+	(void) close (f->fd);
+	f->fd = -1;
+}
+
+
+/* unpublishes `f' and waits for writers which have taken a slot */
+static void
+file_retire (access_file *f, access_file *next)
+{
+	/* pairs with the check in access_log_write () */
+	__atomic_store_n (&alog.current, next, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n (&f->writers, __ATOMIC_SEQ_CST) > 0)
+		sched_yield ();
+
+	file_close (f);
+}
+
+
+static void
+rotate (access_file *full)
+{
+	access_file *next;
+
+
+	simple_mutex_lock (alog.mutex);
+
+	/*
+	 * Somebody has already done it. Files are reused, so the same
+	 * file may be current again, but it has not been filled yet.
+	 */
+	if (xms_atomic_load (&alog.current) != full ||
+		xms_atomic_load (&full->next) < ACCESS_LOG_RECORDS)
+	{
+		simple_mutex_unlock (alog.mutex);
+		return;
+	}
+
+	next = (full == &alog.files[0]) ? &alog.files[1] : &alog.files[0];
+
+	if (rename (alog.path, alog.rotated) != 0)
+		warn ("access log: rename `%s': %s\n", alog.path, strerror (errno));
+
+	if (!file_open (next, false)) {
+		error ("access log: disabled\n");
+		next = NULL;
+	}
+
+	file_retire (full, next);
+
+	simple_mutex_unlock (alog.mutex);
+}
+
+
+extern void
+init_access_log (const char *path)
+{
+	size_t len = strlen (path);
+
+
+	alog.path = strdup (path);
+	alog.rotated = malloc (len + 3);
+
+	if (alog.path == NULL || alog.rotated == NULL)
+		die ("failed to initialize access log\n");
+
+	snprintf (alog.rotated, len + 3, "%s.1", path);
+
+	alog.mutex = simple_mutex_create ();
+	simple_mutex_init (alog.mutex);
+
+	if (!file_open (&alog.files[0], true))
+		die ("failed to open access log `%s'\n", path);
+
+	xms_atomic_store (&alog.current, &alog.files[0]);
+
+	info ("* Access log `%s', %llu records found\n", path,
+		(unsigned long long) alog.files[0].next);
+}
+
+
+extern void
+free_access_log (void)
+{
+	access_file *f;
+
+
+	if (alog.path == NULL)
+		return;
+
+	simple_mutex_lock (alog.mutex);
+
+	f = xms_atomic_load (&alog.current);
+
+	if (f != NULL)
+		file_retire (f, NULL);
+
+	simple_mutex_unlock (alog.mutex);
+
+	simple_mutex_destroy (alog.mutex);
+	free (alog.mutex);
+	free (alog.path);
+	free (alog.rotated);
+	alog.path = NULL;
+}
+
+
+extern bool
+access_log_enabled (void)
+{
+	return xms_atomic_load (&alog.current) != NULL;
+}
+
+
+extern void
+access_log_write (const xms_access_record *rec)
+{
+	access_file *f;
+	xms_access_record *dst;
+	uint64_t slot;
+
+
+	for (;;) {
+		f = xms_atomic_load (&alog.current);
+
+		if (f == NULL)
+			return;
+
+		__atomic_add_fetch (&f->writers, 1, __ATOMIC_SEQ_CST);
+
+		/* the file has been retired (or even reused) meanwhile */
+		if (f != __atomic_load_n (&alog.current, __ATOMIC_SEQ_CST)) {
+			xms_atomic_dec (&f->writers);
+			continue;
+		}
+
+		slot = __atomic_fetch_add (&f->next, 1, __ATOMIC_ACQ_REL);
+
+		if (slot < ACCESS_LOG_RECORDS) {
+			dst = RECORD_AT (f, slot);
+			memcpy (dst, rec, offsetof (xms_access_record, flags));
+			xms_atomic_store (&dst->flags, ACCESS_RECORD_VALID);
+			xms_atomic_dec (&f->writers);
+			return;
+		}
+
+		xms_atomic_dec (&f->writers);
+		rotate (f);
+	}
+}
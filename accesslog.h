@@ -0,0 +1,111 @@
+#ifndef XMS_ACCESSLOG_H
+#define XMS_ACCESSLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The access log is a header followed by fixed-width records, one per
+ * request. All numbers are stored in the host byte order, see
+ * tools/xms-logdump.c for a decoder.
+ */
+
+#define ACCESS_LOG_MAGIC	"XMSALOG"
+#define ACCESS_LOG_VERSION	2
+
+/* records per file, a full file is rotated to `<path>.1' */
+#ifndef ACCESS_LOG_RECORDS
+#define ACCESS_LOG_RECORDS (64 * 1024)
+#endif
+
+/* the record is complete, see xms_access_record.flags */
+#define ACCESS_RECORD_VALID	0x1
+
+/* a request method */
+enum access_method {
+	ACCESS_METHOD_OTHER	= 0,
+	ACCESS_METHOD_GET,
+	ACCESS_METHOD_POST
+};
+
+/* a requested resource, i.e. a URL id */
+enum access_url {
+	ACCESS_URL_OTHER	= 0,
+	ACCESS_URL_INDEX,	/* the default page */
+	ACCESS_URL_UPLOAD,	/* POST */
+	ACCESS_URL_FILE,	/* /get.jpg */
+	ACCESS_URL_FRAME,	/* /frame/<seq>.jpg */
+	ACCESS_URL_FRAMES,	/* /frames */
+	ACCESS_URL_PLAYBACK,	/* /playback */
+	ACCESS_URL_STREAM,	/* /stream */
+	ACCESS_URL_MEMORY,	/* /memory */
+	ACCESS_URL_METRICS	/* /metrics */
+};
+
+/* durations of an upload, in order */
+enum access_stage {
+	ACCESS_STAGE_WAIT	= 0,	/* parked until the slot is free */
+	ACCESS_STAGE_RECEIVE,
+	ACCESS_STAGE_SUBMIT,		/* queued to the pipeline */
+	ACCESS_STAGES
+};
+
+typedef struct _xms_access_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	uint8_t reserved[40];
+} xms_access_header;
+
+typedef struct _xms_access_record {
+	/* the request start, microseconds since the Epoch */
+	uint64_t timestamp;
+
+	/* request & response body sizes, 0 if unknown (e.g. a stream) */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+
+	/* ACCESS_URL_FRAME: a frame sequence number */
+	uint64_t frame_seq;
+
+	/* IPv4 (the first 4 bytes) or IPv6 peer address */
+	uint8_t addr[16];
+
+	/* microseconds */
+	uint32_t duration;
+	uint32_t stage[ACCESS_STAGES];
+
+	uint16_t port;
+	uint16_t status;
+
+	/* 4, 6 or 0 if unknown */
+	uint8_t family;
+
+	/* enum access_method, enum access_url */
+	uint8_t method;
+	uint8_t url;
+
+	/* enum MHD_RequestTerminationCode */
+	uint8_t termination;
+
+	/* ACCESS_RECORD_VALID, written the last */
+	uint32_t flags;
+} xms_access_record;
+
+
+extern void
+init_access_log (const char *path);
+
+extern void
+free_access_log (void);
+
+extern bool
+access_log_enabled (void);
+
+/* copies a record to the log, lock-free unless the file is rotated */
+extern void
+access_log_write (const xms_access_record *rec);
+
+#endif /* XMS_ACCESSLOG_H */
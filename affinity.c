@@ -0,0 +1,176 @@
+#if defined(__linux__)
+#define _GNU_SOURCE	/* CPU_SET, pthread_setaffinity_np */
+#endif
+#include "affinity.h"
+#include "common.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+
+static const char *role_names[AFFINITY_ROLES] = {
+	"mhd",
+	"conv",
+	"log"
+};
+
+#if defined(__linux__)
+static cpu_set_t role_sets[AFFINITY_ROLES];
+
+/* the initial affinity, it is restored for roles which are not pinned */
+static cpu_set_t default_set;
+#endif
+static unsigned int role_cpus[AFFINITY_ROLES];
+static bool configured;
+
+/* a thread has already been pinned by affinity_pin_once () */
+static pthread_key_t pinned_key;
+static pthread_once_t pinned_once = PTHREAD_ONCE_INIT;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static void
+create_pinned_key (void)
+{
+	if (pthread_key_create (&pinned_key, NULL) != 0)
+		die ("failed to create a thread key\n");
+}
+
+
+#if defined(__linux__)
+/* "0-3,8,10-11" */
+static bool
+parse_cpulist (const char *list, cpu_set_t *set)
+{
+	unsigned long first, last, cpu;
+	char *end;
+
+
+	CPU_ZERO (set);
+
+	do {
+		errno = 0;
+		first = strtoul (list, &end, 10);
+
+		if (errno != 0 || end == list)
+			return false;
+
+		last = first;
+
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul (list, &end, 10);
+
+			if (errno != 0 || end == list || last < first)
+				return false;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return false;
+
+		for (cpu = first; cpu <= last; cpu++)
+			CPU_SET (cpu, set);
+
+		list = end + 1;
+	} while (*end == ',');
+
+	return *end == '\0';
+}
+#endif
+
+
+extern bool
+affinity_parse (const char *spec)
+{
+#if defined(__linux__)
+	const char *eq = strchr (spec, '=');
+	cpu_set_t set;
+	int i;
+
+
+	if (eq == NULL)
+		return false;
+
+	for (i = 0; i < AFFINITY_ROLES; i++) {
+		if (strlen (role_names[i]) == (size_t) (eq - spec) &&
+			strncmp (spec, role_names[i], eq - spec) == 0)
+		{
+			break;
+		}
+	}
+
+	if (i == AFFINITY_ROLES || !parse_cpulist (eq + 1, &set))
+		return false;
+
+	if (!configured) {
+		if (sched_getaffinity (0, sizeof (default_set), &default_set))
+			return false;
+		configured = true;
+	}
+
+	role_sets[i] = set;
+	role_cpus[i] = CPU_COUNT (&set);
+
+	return true;
+#else
+	(void) spec;
+	return false;
+#endif
+}
+
+
+extern unsigned int
+affinity_cpus (enum affinity_role role)
+{
+	return role_cpus[role];
+}
+
+
+extern bool
+affinity_pin (enum affinity_role role)
+{
+#if defined(__linux__)
+	const cpu_set_t *set;
+	int rc;
+
+	if (!configured)
+		return true;
+
+	/* a thread may switch roles, e.g. to convert a frame */
+	set = (role_cpus[role] > 0) ? &role_sets[role] : &default_set;
+	rc = pthread_setaffinity_np (pthread_self (), sizeof (*set), set);
+
+	if (rc != 0) {
+		warn ("affinity: failed to pin a %s thread: %s\n",
+			role_names[role], strerror (rc));
+		return false;
+	}
+
+	return true;
+#else
+	(void) role;
+	return true;
+#endif
+}
+
+
+extern void
+affinity_pin_once (enum affinity_role role)
+{
+	if (role_cpus[role] == 0)
+		return;
+
+	(void) pthread_once (&pinned_once, create_pinned_key);
+
+	if (pthread_getspecific (pinned_key) == NULL) {
+		(void) affinity_pin (role);
+		(void) pthread_setspecific (pinned_key, &role_cpus[role]);
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef XMS_AFFINITY_H
+#define XMS_AFFINITY_H
+
+#include <stdbool.h>
+
+/* threads are pinned to CPU sets by their roles */
+enum affinity_role {
+	AFFINITY_MHD = 0,	/* MHD network threads */
+	AFFINITY_CONVERT,	/* conversion, incl. ImageMagick's threads */
+	AFFINITY_LOG,		/* the logger's writer thread */
+	AFFINITY_ROLES
+};
+
+
+/* parses "ROLE=CPULIST", e.g. "mhd=0-3" or "conv=4-7,12" */
+extern bool
+affinity_parse (const char *spec);
+
+/* an amount of CPUs the role is pinned to, 0 if it is not pinned */
+extern unsigned int
+affinity_cpus (enum affinity_role role);
+
+/*
+ * Pins the calling thread. If the role is not pinned, but other roles
+ * are, the initial affinity of the process is restored.
+ */
+extern bool
+affinity_pin (enum affinity_role role);
+
+/* the same, but only on the first call within a thread */
+extern void
+affinity_pin_once (enum affinity_role role);
+
+#endif /* XMS_AFFINITY_H */
@@ -0,0 +1,239 @@
+#include "arena.h"
+#include "common.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/* the alignment of allocations */
+#define ARENA_ALIGN 16
+/* max. free slabs cached by a thread */
+#define ARENA_CACHE_SLABS 16
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+
+typedef struct _arena_slab {
+	struct _arena_slab *next;
+
+	/* usable bytes after the header, ARENA_SLAB_SIZE for cached slabs */
+	size_t size;
+	size_t used;
+} arena_slab;
+
+/* the header is padded, so the data is aligned too */
+#define SLAB_HEADER ARENA_ROUND (sizeof (arena_slab))
+#define SLAB_DATA(slab) ((unsigned char *) (slab) + SLAB_HEADER)
+
+struct _xms_arena {
+	/* the current slab first */
+	arena_slab *slabs;
+};
+
+/* free slabs of a thread */
+typedef struct _slab_cache {
+	arena_slab *slabs;
+	unsigned int count;
+} slab_cache;
+
+static pthread_key_t cache_key;
+static bool key_created;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static void
+cache_free (void *ptr)
+{
+	slab_cache *cache = ptr;
+	arena_slab *slab;
+
+
+	while ((slab = cache->slabs) != NULL) {
+		cache->slabs = slab->next;
+		free (slab);
+	}
+
+	free (cache);
+}
+
+
+static slab_cache *
+get_cache (void)
+{
+	slab_cache *cache = pthread_getspecific (cache_key);
+
+
+	if (cache != NULL || !key_created)
+		return cache;
+
+	cache = calloc (1, sizeof (*cache));
+
+	if (cache != NULL && pthread_setspecific (cache_key, cache) != 0) {
+		free (cache);
+		cache = NULL;
+	}
+
+	return cache;
+}
+
+
+static arena_slab *
+slab_get (size_t size)
+{
+	slab_cache *cache;
+	arena_slab *slab;
+
+
+	if (size <= ARENA_SLAB_SIZE) {
+		size = ARENA_SLAB_SIZE;
+		cache = get_cache ();
+
+		if (cache != NULL && cache->slabs != NULL) {
+			slab = cache->slabs;
+			cache->slabs = slab->next;
+			cache->count--;
+			slab->used = 0;
+
+			return slab;
+		}
+	}
+
+	slab = malloc (SLAB_HEADER + size);
+
+	if (slab == NULL)
+		return NULL;
+
+	slab->size = size;
+	slab->used = 0;
+
+	return slab;
+}
+
+
+static void
+slab_put (arena_slab *slab)
+{
+	slab_cache *cache = NULL;
+
+
+	/* only regular slabs are cached */
+	if (slab->size == ARENA_SLAB_SIZE)
+		cache = get_cache ();
+
+	if (cache == NULL || cache->count >= ARENA_CACHE_SLABS) {
+		free (slab);
+		return;
+	}
+
+	slab->next = cache->slabs;
+	cache->slabs = slab;
+	cache->count++;
+}
+
+
+extern void
+init_arenas (void)
+{
+	if (pthread_key_create (&cache_key, cache_free) != 0)
+		die ("failed to initialize arenas\n");
+
+	key_created = true;
+}
+
+
+extern void
+free_arenas (void)
+{
+	slab_cache *cache;
+
+
+	if (!key_created)
+		return;
+
+	/* the destructor is not called for the main thread */
+	cache = pthread_getspecific (cache_key);
+
+	if (cache != NULL) {
+		(void) pthread_setspecific (cache_key, NULL);
+		cache_free (cache);
+	}
+
+	(void) pthread_key_delete (cache_key);
+	key_created = false;
+}
+
+
+extern xms_arena *
+arena_new (void)
+{
+	arena_slab *slab = slab_get (ARENA_SLAB_SIZE);
+	xms_arena *arena;
+
+
+	if (slab == NULL)
+		return NULL;
+
+	slab->next = NULL;
+	slab->used = ARENA_ROUND (sizeof (*arena));
+
+	arena = (xms_arena *) SLAB_DATA (slab);
+	arena->slabs = slab;
+
+	return arena;
+}
+
+
+extern void *
+arena_alloc (xms_arena *arena, size_t size)
+{
+	arena_slab *slab = arena->slabs;
+	void *ptr;
+
+
+	size = ARENA_ROUND (size);
+
+	if (slab->size - slab->used < size) {
+		slab = slab_get (size);
+
+		if (slab == NULL)
+			return NULL;
+
+		/*
+		 * a large slab goes behind the current one,
+		 * the rest of the current one is still usable
+		 */
+		if (slab->size > ARENA_SLAB_SIZE) {
+			slab->next = arena->slabs->next;
+			arena->slabs->next = slab;
+		}
+		else {
+			slab->next = arena->slabs;
+			arena->slabs = slab;
+		}
+	}
+
+	ptr = SLAB_DATA (slab) + slab->used;
+	slab->used += size;
+
+	return ptr;
+}
+
+
+extern void
+arena_release (xms_arena *arena)
+{
+	arena_slab *slab, *next;
+
+
+	if (arena == NULL)
+		return;
+
+	/* the arena lives in one of the slabs, `next' is read first */
+	for (slab = arena->slabs; slab != NULL; slab = next) {
+		next = slab->next;
+		slab_put (slab);
+	}
+}
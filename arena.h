@@ -0,0 +1,38 @@
+#ifndef XMS_ARENA_H
+#define XMS_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Request-scoped memory. An arena is a chain of slabs, allocations are
+ * never freed one by one, the whole arena is released by arena_release ()
+ * when the request has completed. Released slabs are cached per thread,
+ * so a steady stream of requests does not reach malloc () at all.
+ */
+
+/* the size of a slab, larger allocations get a slab of their own */
+#define ARENA_SLAB_SIZE (4 * 1024)
+
+typedef struct _xms_arena xms_arena;
+
+
+extern void
+init_arenas (void);
+
+/* releases slabs cached by the calling thread */
+extern void
+free_arenas (void);
+
+/* NULL on failure, the arena itself lives in its first slab */
+extern xms_arena *
+arena_new (void);
+
+/* suitably aligned for any type, NULL on failure */
+extern void *
+arena_alloc (xms_arena *arena, size_t size);
+
+/* the arena & every allocation from it are gone */
+extern void
+arena_release (xms_arena *arena);
+
+#endif /* XMS_ARENA_H */
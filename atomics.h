@@ -0,0 +1,16 @@
+#ifndef XMS_ATOMICS_H
+#define XMS_ATOMICS_H
+
+/*
+ * Thin wrappers around GCC/Clang __atomic builtins: we are C99,
+ * so <stdatomic.h> is not an option.
+ */
+
+#define xms_atomic_load(p)	__atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define xms_atomic_store(p, v)	__atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define xms_atomic_inc(p)	__atomic_add_fetch ((p), 1, __ATOMIC_ACQ_REL)
+#define xms_atomic_dec(p)	__atomic_sub_fetch ((p), 1, __ATOMIC_ACQ_REL)
+#define xms_atomic_add(p, v)	__atomic_add_fetch ((p), (v), __ATOMIC_ACQ_REL)
+#define xms_atomic_sub(p, v)	__atomic_sub_fetch ((p), (v), __ATOMIC_ACQ_REL)
+
+#endif /* XMS_ATOMICS_H */
@@ -0,0 +1,953 @@
+/*
+ * A loopback load generator for x11mirror-server: uploaders POST
+ * synthesized XWD frames at a target rate, viewers fetch /get.jpg as
+ * fast as they can and a watcher polls /frames to tell when each
+ * upload has been published. Start the server first:
+ *
+ *   ./x11mirror-server -p 8888 &
+ *   bench/xms-bench -p 8888 -P $! -s 1920x1080 -r 30 -n 2 -v 8
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "xwd.h"
+
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8888
+#define DEFAULT_WIDTH 1280
+#define DEFAULT_HEIGHT 720
+#define DEFAULT_DEPTH 24
+#define DEFAULT_RATE 10.0
+#define DEFAULT_CLIENTS 1
+#define DEFAULT_VIEWERS 4
+#define DEFAULT_DURATION 10
+
+/* /frames is polled this often (usec) */
+#define WATCH_INTERVAL 1000
+
+/* a published frame is not expected later than this (sec) */
+#define WATCH_GRACE 5
+
+/* response headers must fit in */
+#define HEADER_SIZE (8 * 1024)
+
+#define BOUNDARY "xms-bench-boundary"
+
+typedef struct _bench_options {
+	const char *host;
+	unsigned int port;
+	const char *unix_path;
+	unsigned int width;
+	unsigned int height;
+	unsigned int depth;
+	enum xwd_pattern pattern;
+	double rate;
+	unsigned int clients;
+	unsigned int viewers;
+	unsigned int duration;
+	pid_t pid;
+} bench_options;
+
+/* a keep-alive connection */
+typedef struct _bench_conn {
+	int fd;
+	char head[HEADER_SIZE];
+} bench_conn;
+
+/* a response body, kept only if asked for */
+typedef struct _bench_body {
+	char *data;
+	size_t size;
+	size_t alloc;
+} bench_body;
+
+/* an accepted upload, in the order of the server's sequence numbers */
+typedef struct _bench_upload {
+	uint64_t sent;
+	uint64_t visible;
+} bench_upload;
+
+static bench_options ops;
+
+static struct {
+	pthread_mutex_t mutex;
+
+	/* accepted uploads, see record_upload () */
+	bench_upload *uploads;
+	size_t accepted;
+	size_t alloc;
+
+	/* frames published since the start, see watcher_main () */
+	size_t published;
+
+	uint64_t sent;
+	uint64_t rejected;
+	uint64_t failed;
+	uint64_t late;
+	uint64_t upload_bytes;
+	size_t frame_size;
+
+	uint64_t gets;
+	uint64_t get_bytes;
+	uint64_t get_errors;
+
+	uint64_t start;
+	uint64_t end;
+	bool uploading;
+	bool stop;
+} bench = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, false, false };
+
+/* every uploaded frame differs, otherwise the server drops it */
+static uint64_t frame_counter;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static uint64_t
+monotonic_usec (void)
+{
+	struct timespec tp;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &tp);
+
+	return (uint64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+
+static void
+sleep_until (uint64_t when)
+{
+	uint64_t now = monotonic_usec ();
+	struct timespec ts;
+
+	if (when <= now)
+		return;
+
+	ts.tv_sec = (when - now) / 1000000;
+	ts.tv_nsec = (when - now) % 1000000 * 1000;
+
+	while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+
+static bool
+stopped (void)
+{
+	return __atomic_load_n (&bench.stop, __ATOMIC_ACQUIRE);
+}
+
+
+static void
+stamp_xwd (unsigned char *xwd)
+{
+	uint64_t n = __atomic_add_fetch (&frame_counter, 1, __ATOMIC_RELAXED);
+
+	memcpy (xwd + xwd_pixels (xwd), &n, sizeof (n));
+}
+
+
+static int
+conn_open (bench_conn *c)
+{
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	int fd, one = 1;
+
+
+	if (ops.unix_path != NULL) {
+		memset (&un, 0, sizeof (un));
+		un.sun_family = AF_UNIX;
+		strncpy (un.sun_path, ops.unix_path, sizeof (un.sun_path) - 1);
+
+		fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+		if (fd != -1 &&
+		    connect (fd, (struct sockaddr *) &un, sizeof (un)) != 0)
+		{
+			(void) close (fd);
+			fd = -1;
+		}
+	}
+	else {
+		memset (&in, 0, sizeof (in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons (ops.port);
+
+		if (inet_pton (AF_INET, ops.host, &in.sin_addr) != 1)
+			return -1;
+
+		fd = socket (AF_INET, SOCK_STREAM, 0);
+
+		if (fd != -1 &&
+		    connect (fd, (struct sockaddr *) &in, sizeof (in)) != 0)
+		{
+			(void) close (fd);
+			fd = -1;
+		}
+
+		/* headers & bodies are sent separately */
+		if (fd != -1)
+			(void) setsockopt (fd, IPPROTO_TCP, TCP_NODELAY,
+				&one, sizeof (one));
+	}
+
+	c->fd = fd;
+
+	return fd;
+}
+
+
+static void
+conn_close (bench_conn *c)
+{
+	if (c->fd != -1)
+		(void) close (c->fd);
+
+	c->fd = -1;
+}
+
+
+static bool
+send_all (int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	ssize_t n;
+
+
+	while (size > 0) {
+		n = send (fd, p, size, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		p += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+
+static bool
+body_append (bench_body *body, const char *data, size_t size)
+{
+	char *p;
+	size_t alloc;
+
+
+	if (body == NULL)
+		return true;
+
+	if (body->size + size + 1 > body->alloc) {
+		alloc = (body->alloc > 0) ? body->alloc : 4096;
+
+		while (body->size + size + 1 > alloc)
+			alloc *= 2;
+
+		p = realloc (body->data, alloc);
+
+		if (p == NULL)
+			return false;
+
+		body->data = p;
+		body->alloc = alloc;
+	}
+
+	memcpy (body->data + body->size, data, size);
+	body->size += size;
+	body->data[body->size] = '\0';
+
+	return true;
+}
+
+
+/*
+ * Reads a response, returns its status or -1. The connection is closed
+ * if the server does not keep it.
+ */
+static int
+read_response (bench_conn *c, bench_body *body, uint64_t *body_size)
+{
+	size_t len = 0, have;
+	char *end = NULL, *line, *next;
+	unsigned long long length = 0;
+	bool has_length = false, keep = true;
+	int status = -1;
+	ssize_t n;
+
+
+	while (end == NULL) {
+		if (len == sizeof (c->head) - 1)
+			return -1;
+
+		n = recv (c->fd, c->head + len, sizeof (c->head) - 1 - len, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return -1;
+
+		len += n;
+		c->head[len] = '\0';
+		end = strstr (c->head, "\r\n\r\n");
+	}
+
+	if (sscanf (c->head, "HTTP/%*d.%*d %d", &status) != 1)
+		return -1;
+
+	for (line = strstr (c->head, "\r\n"); line != NULL && line < end;
+	     line = next)
+	{
+		line += 2;
+		next = strstr (line, "\r\n");
+
+		if (strncasecmp (line, "Content-Length:", 15) == 0) {
+			length = strtoull (line + 15, NULL, 10);
+			has_length = true;
+		}
+		else if (strncasecmp (line, "Connection:", 11) == 0 &&
+		         strstr (line, "close") != NULL && strstr (line, "close") < next)
+		{
+			keep = false;
+		}
+	}
+
+	/* the beginning of the body */
+	end += 4;
+	have = len - (end - c->head);
+
+	if (has_length && have > length)
+		have = length;
+
+	if (!body_append (body, end, have))
+		return -1;
+
+	*body_size = have;
+
+	while (!has_length || *body_size < length) {
+		n = recv (c->fd, c->head, sizeof (c->head), 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0 || (n == 0 && has_length))
+			return -1;
+
+		/* no length: the body ends with the connection */
+		if (n == 0)
+			break;
+
+		if (!body_append (body, c->head, n))
+			return -1;
+
+		*body_size += n;
+	}
+
+	if (!has_length || !keep)
+		conn_close (c);
+
+	return status;
+}
+
+
+/* a request over a kept connection, retried once on a fresh one */
+static int
+http_request (bench_conn *c, const char *head, const void *data, size_t size,
+              bench_body *body, uint64_t *body_size)
+{
+	bool reused;
+	int attempt, status;
+
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		reused = (c->fd != -1);
+
+		if (!reused && conn_open (c) == -1)
+			return -1;
+
+		if (body != NULL)
+			body->size = 0;
+
+		if (send_all (c->fd, head, strlen (head)) &&
+		    (size == 0 || send_all (c->fd, data, size)))
+		{
+			status = read_response (c, body, body_size);
+
+			if (status != -1)
+				return status;
+		}
+
+		conn_close (c);
+
+		/* the server may have closed an idle connection */
+		if (!reused)
+			break;
+	}
+
+	return -1;
+}
+
+
+static bool
+record_upload (uint64_t sent)
+{
+	bench_upload *u;
+	size_t alloc;
+
+
+	pthread_mutex_lock (&bench.mutex);
+
+	if (bench.accepted == bench.alloc) {
+		alloc = (bench.alloc > 0) ? bench.alloc * 2 : 1024;
+		u = realloc (bench.uploads, alloc * sizeof (*u));
+
+		if (u == NULL) {
+			pthread_mutex_unlock (&bench.mutex);
+			return false;
+		}
+
+		bench.uploads = u;
+		bench.alloc = alloc;
+	}
+
+	u = &bench.uploads[bench.accepted];
+	u->sent = sent;
+
+	/* published before we have read the response */
+	u->visible = (bench.accepted < bench.published) ? monotonic_usec () : 0;
+
+	bench.accepted++;
+	pthread_mutex_unlock (&bench.mutex);
+
+	return true;
+}
+
+
+static void *
+uploader_main (void *arg)
+{
+	unsigned int id = (uintptr_t) arg;
+	bench_conn c = { -1, { 0 } };
+	unsigned char *xwd;
+	char head[512], prefix[256];
+	const char *suffix = "\r\n--" BOUNDARY "--\r\n";
+	unsigned char *data;
+	size_t xwd_size, size;
+	uint64_t interval, next, sent, unused;
+	int status, len;
+
+
+	xwd = xwd_make (ops.width, ops.height, ops.depth, ops.pattern,
+		&xwd_size);
+
+	if (xwd == NULL) {
+		fprintf (stderr, "uploader %u: out of memory\n", id);
+		return NULL;
+	}
+
+	/* the multipart body is built once, only the frame stamp changes */
+	len = snprintf (prefix, sizeof (prefix),
+		"--" BOUNDARY "\r\n"
+		"Content-Disposition: form-data; name=\"file\"; "
+		"filename=\"frame.xwd\"\r\n"
+		"Content-Type: application/octet-stream\r\n\r\n");
+
+	size = len + xwd_size + strlen (suffix);
+	data = malloc (size);
+
+	if (data == NULL) {
+		fprintf (stderr, "uploader %u: out of memory\n", id);
+		free (xwd);
+		return NULL;
+	}
+
+	memcpy (data, prefix, len);
+	memcpy (data + len, xwd, xwd_size);
+	memcpy (data + len + xwd_size, suffix, strlen (suffix));
+	free (xwd);
+	xwd = data + len;
+	bench.frame_size = xwd_size;
+
+	snprintf (head, sizeof (head),
+		"POST / HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"Content-Type: multipart/form-data; boundary=" BOUNDARY "\r\n"
+		"Content-Length: %zu\r\n\r\n",
+		ops.host, size);
+
+	/* each client takes its share of the rate, the starts are spread */
+	interval = (uint64_t) (1000000.0 * ops.clients / ops.rate);
+	next = bench.start + interval * id / ops.clients;
+
+	while (!stopped () && next < bench.end) {
+		sleep_until (next);
+
+		sent = monotonic_usec ();
+
+		/* behind the schedule, the rate is not made up for */
+		if (sent > next + interval) {
+			__atomic_add_fetch (&bench.late, 1, __ATOMIC_RELAXED);
+			next = sent;
+		}
+
+		next += interval;
+		stamp_xwd (xwd);
+
+		__atomic_add_fetch (&bench.sent, 1, __ATOMIC_RELAXED);
+		status = http_request (&c, head, data, size, NULL, &unused);
+
+		if (status == 200) {
+			__atomic_add_fetch (&bench.upload_bytes, xwd_size,
+				__ATOMIC_RELAXED);
+			if (!record_upload (sent))
+				__atomic_add_fetch (&bench.failed, 1,
+					__ATOMIC_RELAXED);
+		}
+		else if (status == 503)
+			__atomic_add_fetch (&bench.rejected, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch (&bench.failed, 1, __ATOMIC_RELAXED);
+	}
+
+	conn_close (&c);
+	free (data);
+
+	return NULL;
+}
+
+
+static void *
+viewer_main (void *arg)
+{
+	bench_conn c = { -1, { 0 } };
+	char head[256];
+	uint64_t size;
+	int status;
+
+
+	(void) arg;
+
+	snprintf (head, sizeof (head),
+		"GET /get.jpg HTTP/1.1\r\nHost: %s\r\n\r\n", ops.host);
+
+	while (!stopped ()) {
+		status = http_request (&c, head, NULL, 0, NULL, &size);
+
+		__atomic_add_fetch (&bench.gets, 1, __ATOMIC_RELAXED);
+
+		if (status == 200)
+			__atomic_add_fetch (&bench.get_bytes, size,
+				__ATOMIC_RELAXED);
+		else {
+			__atomic_add_fetch (&bench.get_errors, 1,
+				__ATOMIC_RELAXED);
+
+			/* nothing published yet or no server at all */
+			usleep (WATCH_INTERVAL);
+		}
+	}
+
+	conn_close (&c);
+
+	return NULL;
+}
+
+
+/* the newest sequence number in the /frames index, 0 if none */
+static bool
+newest_seq (bench_conn *c, bench_body *body, uint64_t *seq)
+{
+	char head[256];
+	uint64_t size;
+	char *p, *last = NULL;
+
+
+	snprintf (head, sizeof (head),
+		"GET /frames HTTP/1.1\r\nHost: %s\r\n\r\n", ops.host);
+
+	if (http_request (c, head, NULL, 0, body, &size) != 200 ||
+	    body->data == NULL)
+	{
+		return false;
+	}
+
+	for (p = body->data; (p = strstr (p, "\"seq\":")) != NULL; p += 6)
+		last = p;
+
+	*seq = (last != NULL) ? strtoull (last + 6, NULL, 10) : 0;
+
+	return true;
+}
+
+
+static void *
+watcher_main (void *arg)
+{
+	uint64_t *baseline = arg;
+	bench_conn c = { -1, { 0 } };
+	bench_body body = { NULL, 0, 0 };
+	uint64_t seq, now, start;
+	size_t published, i;
+
+
+	for (;;) {
+		now = monotonic_usec ();
+		start = now;
+
+		/* uploads are over and everything accepted is visible */
+		if (!__atomic_load_n (&bench.uploading, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_lock (&bench.mutex);
+			published = bench.published;
+			i = bench.accepted;
+			pthread_mutex_unlock (&bench.mutex);
+
+			if (published >= i ||
+			    now > bench.end + WATCH_GRACE * 1000000)
+				break;
+		}
+
+		if (newest_seq (&c, &body, &seq) && seq > *baseline) {
+			pthread_mutex_lock (&bench.mutex);
+
+			/* uploads may have been accepted during the request */
+			now = monotonic_usec ();
+			published = seq - *baseline;
+
+			for (i = bench.published;
+			     i < published && i < bench.accepted; i++)
+			{
+				if (bench.uploads[i].visible == 0)
+					bench.uploads[i].visible = now;
+			}
+
+			if (published > bench.published)
+				bench.published = published;
+
+			pthread_mutex_unlock (&bench.mutex);
+		}
+
+		sleep_until (start + WATCH_INTERVAL);
+	}
+
+	conn_close (&c);
+	free (body.data);
+
+	return NULL;
+}
+
+
+/* utime + stime of a process, in seconds */
+static bool
+process_cpu (pid_t pid, double *sec)
+{
+	char path[64], stat[1024], *p;
+	unsigned long utime, stime;
+	FILE *fh;
+	size_t n;
+
+
+	snprintf (path, sizeof (path), "/proc/%ld/stat", (long) pid);
+
+	if ((fh = fopen (path, "r")) == NULL)
+		return false;
+
+	n = fread (stat, 1, sizeof (stat) - 1, fh);
+	(void) fclose (fh);
+	stat[n] = '\0';
+
+	/* the command may contain spaces & parentheses */
+	if ((p = strrchr (stat, ')')) == NULL ||
+	    sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime) != 2)
+	{
+		return false;
+	}
+
+	*sec = (double) (utime + stime) / sysconf (_SC_CLK_TCK);
+
+	return true;
+}
+
+
+static double
+self_cpu (void)
+{
+	struct rusage ru;
+
+	(void) getrusage (RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* the nearest-rank percentile */
+static double
+percentile_msec (const uint64_t *sorted, size_t n, double p)
+{
+	size_t rank = (size_t) (p * n + 0.999999);
+
+	if (rank == 0)
+		rank = 1;
+
+	return sorted[rank - 1] / 1000.0;
+}
+
+
+static void
+report (double elapsed, double server_cpu, double bench_cpu)
+{
+	uint64_t *latency;
+	size_t n = 0, i;
+	double mib = 1024.0 * 1024.0;
+
+
+	latency = malloc ((bench.accepted + 1) * sizeof (*latency));
+
+	for (i = 0; latency != NULL && i < bench.accepted; i++)
+		if (bench.uploads[i].visible != 0)
+			latency[n++] = bench.uploads[i].visible -
+				bench.uploads[i].sent;
+
+	printf ("frames          %ux%u, depth %u, %s, %zu bytes\n",
+		ops.width, ops.height, ops.depth,
+		xwd_pattern_name (ops.pattern), bench.frame_size);
+	printf ("duration        %.1f s\n", elapsed);
+	printf ("uploads         %llu sent (%llu late), %zu accepted "
+		"(%.1f/s, %.1f MiB/s), %llu rejected, %llu failed\n",
+		(unsigned long long) bench.sent,
+		(unsigned long long) bench.late,
+		bench.accepted, bench.accepted / elapsed,
+		bench.upload_bytes / mib / elapsed,
+		(unsigned long long) bench.rejected,
+		(unsigned long long) bench.failed);
+	printf ("published       %zu frames (%.1f/s)\n",
+		bench.published, bench.published / elapsed);
+
+	if (n > 0) {
+		qsort (latency, n, sizeof (*latency), compare_u64);
+		printf ("upload->visible p50 %.2f ms, p99 %.2f ms, "
+			"p99.9 %.2f ms, max %.2f ms (%zu frames)\n",
+			percentile_msec (latency, n, 0.5),
+			percentile_msec (latency, n, 0.99),
+			percentile_msec (latency, n, 0.999),
+			latency[n - 1] / 1000.0, n);
+	}
+	else
+		printf ("upload->visible no frames\n");
+
+	printf ("viewers         %u, %llu GET /get.jpg (%.1f/s, %.1f MiB/s), "
+		"%llu errors\n",
+		ops.viewers, (unsigned long long) bench.gets,
+		bench.gets / elapsed, bench.get_bytes / mib / elapsed,
+		(unsigned long long) bench.get_errors);
+
+	if (bench.published > 0) {
+		if (server_cpu >= 0)
+			printf ("server CPU      %.2f ms per frame\n",
+				server_cpu * 1000.0 / bench.published);
+		printf ("bench CPU       %.2f ms per frame\n",
+			bench_cpu * 1000.0 / bench.published);
+	}
+
+	free (latency);
+}
+
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+		"Usage: %s [options]\n"
+		"  -H ADDR     server IPv4 address, default " DEFAULT_HOST "\n"
+		"  -p PORT     server port, default %u\n"
+		"  -U PATH     connect to a Unix domain socket instead\n"
+		"  -s WxH      frame size, default %ux%u\n"
+		"  -d DEPTH    frame depth: 8, 16, 24 or 32, default %u\n"
+		"  -c PATTERN  frame content: gradient or desktop\n"
+		"  -r FPS      total upload rate, default %.0f\n"
+		"  -n CLIENTS  uploaders, default %u\n"
+		"  -v VIEWERS  /get.jpg readers, default %u\n"
+		"  -t SECONDS  duration, default %u\n"
+		"  -P PID      the server process, to report its CPU time\n",
+		name, DEFAULT_PORT, DEFAULT_WIDTH, DEFAULT_HEIGHT,
+		DEFAULT_DEPTH, DEFAULT_RATE, DEFAULT_CLIENTS,
+		DEFAULT_VIEWERS, DEFAULT_DURATION);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	pthread_t *threads, watcher;
+	bench_conn c = { -1, { 0 } };
+	bench_body body = { NULL, 0, 0 };
+	uint64_t baseline = 0, finished;
+	double server_start = 0, server_end = 0, bench_start;
+	bool server_cpu;
+	unsigned int i, total;
+	int opt;
+
+
+	ops.host = DEFAULT_HOST;
+	ops.port = DEFAULT_PORT;
+	ops.unix_path = NULL;
+	ops.width = DEFAULT_WIDTH;
+	ops.height = DEFAULT_HEIGHT;
+	ops.depth = DEFAULT_DEPTH;
+	ops.pattern = XWD_GRADIENT;
+	ops.rate = DEFAULT_RATE;
+	ops.clients = DEFAULT_CLIENTS;
+	ops.viewers = DEFAULT_VIEWERS;
+	ops.duration = DEFAULT_DURATION;
+	ops.pid = 0;
+
+	while ((opt = getopt (argc, argv, "H:p:U:s:d:c:r:n:v:t:P:h")) != -1) {
+		switch (opt) {
+		case 'H':
+			ops.host = optarg;
+			break;
+		case 'p':
+			ops.port = strtoul (optarg, NULL, 10);
+			break;
+		case 'U':
+			ops.unix_path = optarg;
+			break;
+		case 's':
+			if (sscanf (optarg, "%ux%u", &ops.width, &ops.height) != 2)
+				ops.width = 0;
+			break;
+		case 'd':
+			ops.depth = strtoul (optarg, NULL, 10);
+			break;
+		case 'c':
+			if (strcmp (optarg, "desktop") == 0)
+				ops.pattern = XWD_DESKTOP;
+			else if (strcmp (optarg, "gradient") != 0)
+				ops.width = 0;
+			break;
+		case 'r':
+			ops.rate = strtod (optarg, NULL);
+			break;
+		case 'n':
+			ops.clients = strtoul (optarg, NULL, 10);
+			break;
+		case 'v':
+			ops.viewers = strtoul (optarg, NULL, 10);
+			break;
+		case 't':
+			ops.duration = strtoul (optarg, NULL, 10);
+			break;
+		case 'P':
+			ops.pid = strtol (optarg, NULL, 10);
+			break;
+		default:
+			usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc || ops.port == 0 || ops.port > 65535 ||
+	    ops.width == 0 || ops.height == 0 || ops.clients == 0 ||
+	    ops.duration == 0 || !(ops.rate > 0) ||
+	    (ops.depth != 8 && ops.depth != 16 && ops.depth != 24 &&
+	     ops.depth != 32))
+	{
+		usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	(void) signal (SIGPIPE, SIG_IGN);
+
+	/* frames published before us do not count */
+	if (!newest_seq (&c, &body, &baseline)) {
+		fprintf (stderr, "%s: no response to GET /frames\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	conn_close (&c);
+	free (body.data);
+
+	total = ops.clients + ops.viewers;
+	threads = calloc (total, sizeof (*threads));
+
+	if (threads == NULL)
+		return EXIT_FAILURE;
+
+	server_cpu = (ops.pid > 0 && process_cpu (ops.pid, &server_start));
+	bench_start = self_cpu ();
+
+	bench.start = monotonic_usec ();
+	bench.end = bench.start + (uint64_t) ops.duration * 1000000;
+	bench.uploading = true;
+
+	for (i = 0; i < total; i++)
+		if (pthread_create (&threads[i], NULL,
+			(i < ops.clients) ? uploader_main : viewer_main,
+			(void *) (uintptr_t) i) != 0)
+		{
+			fprintf (stderr, "%s: failed to start threads\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	if (pthread_create (&watcher, NULL, watcher_main, &baseline) != 0) {
+		fprintf (stderr, "%s: failed to start threads\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < ops.clients; i++)
+		(void) pthread_join (threads[i], NULL);
+
+	__atomic_store_n (&bench.uploading, false, __ATOMIC_RELEASE);
+	finished = monotonic_usec ();
+
+	/* viewers keep the load until the last frame is visible */
+	(void) pthread_join (watcher, NULL);
+	__atomic_store_n (&bench.stop, true, __ATOMIC_RELEASE);
+
+	for (i = ops.clients; i < total; i++)
+		(void) pthread_join (threads[i], NULL);
+
+	if (server_cpu)
+		server_cpu = process_cpu (ops.pid, &server_end);
+
+	report ((finished - bench.start) / 1e6,
+		server_cpu ? server_end - server_start : -1,
+		self_cpu () - bench_start);
+
+	free (threads);
+	free (bench.uploads);
+
+	return EXIT_SUCCESS;
+}
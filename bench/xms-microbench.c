@@ -0,0 +1,609 @@
+/*
+ * Microbenchmarks of the conversion building blocks (imagemagick.c):
+ * XWD header parse, decoding per visual type, colour conversion,
+ * hashing, scaling and JPEG encoding at several quality levels. Every
+ * kernel runs on synthesized frames and on recorded ones (XWD files,
+ * e.g. made by `xwd -root'), the results are written as JSON:
+ *
+ *   bench/xms-microbench -s 1920x1080 -o before.json screen.xwd
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if (defined IM_VERSION) && IM_VERSION >= 7
+	#include <MagickWand/MagickWand.h>
+#else
+	#include <wand/MagickWand.h>
+#endif
+#include "imagemagick.h"
+#include "vlogger.h"
+#include "xwd.h"
+
+
+#define DEFAULT_WIDTH 1280
+#define DEFAULT_HEIGHT 720
+#define DEFAULT_MIN_TIME 0.5
+#define DEFAULT_MIN_ITERATIONS 5
+
+/* samples kept per kernel, the run stops there too */
+#define MAX_ITERATIONS 10000
+
+/* depths of synthesized frames, see xwd_make () */
+static const unsigned int depths[] = { 8, 16, 24, 32 };
+
+/* the decoded frame the rest of kernels run on */
+#define KERNEL_DEPTH 24
+
+/* a frame & what the kernels need of it */
+typedef struct _micro_input {
+	/* synthesized: a pattern name, recorded: a file name */
+	const char *content;
+	bool recorded;
+	unsigned int depth;
+
+	unsigned char *xwd;
+	size_t xwd_size;
+
+	/* decoded by imagemagick.c & by a wand of our own */
+	xms_image *image;
+	MagickWand *wand;
+	size_t width;
+	size_t height;
+
+	/* encoded by image_encode (), see kernel_variant () */
+	unsigned char *jpeg;
+	size_t jpeg_size;
+
+	/* image_export_rgb () output */
+	unsigned char *rgb;
+} micro_input;
+
+/* returns false if the kernel has failed */
+typedef bool (*kernel_cb) (micro_input *in, unsigned int arg);
+
+typedef struct _micro_kernel {
+	const char *name;
+	kernel_cb run;
+	unsigned int arg;
+
+	/* runs on every synthesized depth, otherwise on KERNEL_DEPTH only */
+	bool per_depth;
+} micro_kernel;
+
+static bool kernel_ping (micro_input *in, unsigned int arg);
+static bool kernel_decode (micro_input *in, unsigned int arg);
+static bool kernel_export_rgb (micro_input *in, unsigned int arg);
+static bool kernel_signature (micro_input *in, unsigned int arg);
+static bool kernel_encode (micro_input *in, unsigned int arg);
+static bool kernel_encode_quality (micro_input *in, unsigned int arg);
+static bool kernel_resize (micro_input *in, unsigned int arg);
+static bool kernel_variant (micro_input *in, unsigned int arg);
+
+static const micro_kernel kernels[] = {
+	{ "xwd_header",		kernel_ping,		0,	true },
+	{ "decode",		kernel_decode,		0,	true },
+	{ "export_rgb",		kernel_export_rgb,	0,	false },
+	{ "signature",		kernel_signature,	0,	false },
+	{ "encode",		kernel_encode,		0,	false },
+	{ "encode_q90",		kernel_encode_quality,	90,	false },
+	{ "encode_q75",		kernel_encode_quality,	75,	false },
+	{ "encode_q60",		kernel_encode_quality,	60,	false },
+	{ "encode_q40",		kernel_encode_quality,	40,	false },
+	{ "resize_75",		kernel_resize,		75,	false },
+	{ "resize_50",		kernel_resize,		50,	false },
+	/* quality tiers of /stream, see frames.c */
+	{ "variant_1",		kernel_variant,		1,	false },
+	{ "variant_2",		kernel_variant,		2,	false }
+};
+
+static struct {
+	double min_time;
+	unsigned int min_iterations;
+
+	/* a scratch wand of kernel_ping () */
+	MagickWand *ping;
+
+	/* per iteration (nsec) */
+	uint64_t samples[MAX_ITERATIONS];
+
+	/* the first result is written without a comma */
+	unsigned int results;
+} micro;
+
+
+/* ------------------------------------------------------------------ */
+
+
+/* imagemagick.c logs through vlogger.c, here it goes to stderr */
+extern int
+vlogger_log (int level, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	(void) level;
+
+	va_start (ap, fmt);
+	n = vfprintf (stderr, fmt, ap);
+	va_end (ap);
+
+	return n;
+}
+
+
+static uint64_t
+monotonic_nsec (void)
+{
+	struct timespec tp;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &tp);
+
+	return (uint64_t) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+
+static bool
+kernel_ping (micro_input *in, unsigned int arg)
+{
+	bool ok;
+
+	(void) arg;
+
+	ClearMagickWand (micro.ping);
+
+	/* XWD has no magic bytes, see image_decode () */
+	ok = MagickSetFormat (micro.ping, "XWD") == MagickTrue &&
+		MagickPingImageBlob (micro.ping, in->xwd, in->xwd_size)
+			== MagickTrue;
+
+	return ok;
+}
+
+
+static bool
+kernel_decode (micro_input *in, unsigned int arg)
+{
+	xms_image *image = image_decode (in->xwd, in->xwd_size);
+
+	(void) arg;
+
+	if (image == NULL)
+		return false;
+
+	image_destroy (image);
+
+	return true;
+}
+
+
+static bool
+kernel_export_rgb (micro_input *in, unsigned int arg)
+{
+	(void) arg;
+
+	return image_export_rgb (in->image, in->rgb);
+}
+
+
+static bool
+kernel_signature (micro_input *in, unsigned int arg)
+{
+	char *signature = image_signature (in->image);
+
+	(void) arg;
+
+	if (signature == NULL)
+		return false;
+
+	convert_free (signature);
+
+	return true;
+}
+
+
+static bool
+kernel_encode (micro_input *in, unsigned int arg)
+{
+	unsigned char *out;
+	size_t size;
+
+	(void) arg;
+
+	if (!image_encode (in->image, &out, &size))
+		return false;
+
+	convert_free (out);
+
+	return true;
+}
+
+
+static bool
+kernel_encode_quality (micro_input *in, unsigned int arg)
+{
+	unsigned char *out;
+	size_t size;
+
+	if (MagickSetImageCompressionQuality (in->wand, arg) == MagickFalse)
+		return false;
+
+	out = MagickGetImageBlob (in->wand, &size);
+
+	if (out == NULL)
+		return false;
+
+	MagickRelinquishMemory (out);
+
+	return true;
+}
+
+
+/* a copy is resized, the cost of copying is included */
+static bool
+kernel_resize (micro_input *in, unsigned int arg)
+{
+	MagickWand *copy = CloneMagickWand (in->wand);
+	size_t width = in->width * arg / 100;
+	size_t height = in->height * arg / 100;
+	bool ok;
+
+
+	if (copy == NULL)
+		return false;
+
+#if IM_VERSION >= 7
+	ok = MagickResizeImage (copy, width, height, TriangleFilter)
+#else
+	ok = MagickResizeImage (copy, width, height, TriangleFilter, 1.0)
+#endif
+		== MagickTrue;
+
+	DestroyMagickWand (copy);
+
+	return ok;
+}
+
+
+/* a lower quality tier of /stream: JPEG in, scaled JPEG out */
+static bool
+kernel_variant (micro_input *in, unsigned int arg)
+{
+	static const struct {
+		unsigned int quality;
+		unsigned int scale;
+	} tiers[] = {
+		{  0, 100 },
+		{ 60,  75 },
+		{ 40,  50 }
+	};
+	unsigned char *out;
+	size_t size;
+
+
+	if (!convert_scaled (in->jpeg, in->jpeg_size,
+		tiers[arg].quality, tiers[arg].scale, &out, &size))
+	{
+		return false;
+	}
+
+	convert_free (out);
+
+	return true;
+}
+
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+static void
+json_string (FILE *fh, const char *s)
+{
+	fputc ('"', fh);
+
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf (fh, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf (fh, "\\u%04x", (unsigned char) *s);
+		else
+			fputc (*s, fh);
+	}
+
+	fputc ('"', fh);
+}
+
+
+static void
+run_kernel (FILE *fh, const micro_kernel *k, micro_input *in)
+{
+	uint64_t start, end, total = 0, deadline;
+	unsigned int n = 0;
+	double pixels;
+
+
+	/* warm up: caches, the wand pool & lazy initialization */
+	if (!k->run (in, k->arg)) {
+		fprintf (stderr, "%s: %s (depth %u) has failed\n",
+			k->name, in->content, in->depth);
+		return;
+	}
+
+	deadline = monotonic_nsec () + (uint64_t) (micro.min_time * 1e9);
+
+	do {
+		start = monotonic_nsec ();
+
+		if (!k->run (in, k->arg)) {
+			fprintf (stderr, "%s: %s (depth %u) has failed\n",
+				k->name, in->content, in->depth);
+			return;
+		}
+
+		end = monotonic_nsec ();
+
+		micro.samples[n++] = end - start;
+		total += end - start;
+	} while (n < MAX_ITERATIONS &&
+	         (n < micro.min_iterations || end < deadline));
+
+	qsort (micro.samples, n, sizeof (micro.samples[0]), compare_u64);
+	pixels = (double) in->width * in->height;
+
+	fprintf (fh, "%s\n    {\"kernel\": ", (micro.results++ > 0) ? "," : "");
+	json_string (fh, k->name);
+	fprintf (fh, ", \"content\": ");
+	json_string (fh, in->content);
+	fprintf (fh, ", \"recorded\": %s, \"depth\": %u, "
+		"\"width\": %zu, \"height\": %zu, \"input_bytes\": %zu, "
+		"\"iterations\": %u, \"min_ns\": %llu, \"median_ns\": %llu, "
+		"\"p90_ns\": %llu, \"mean_ns\": %llu, "
+		"\"mpixels_per_sec\": %.2f}",
+		in->recorded ? "true" : "false", in->depth,
+		in->width, in->height, in->xwd_size, n,
+		(unsigned long long) micro.samples[0],
+		(unsigned long long) micro.samples[n / 2],
+		(unsigned long long) micro.samples[n * 9 / 10],
+		(unsigned long long) (total / n),
+		pixels * 1000.0 / micro.samples[n / 2]);
+	fflush (fh);
+}
+
+
+static void
+free_input (micro_input *in)
+{
+	image_destroy (in->image);
+
+	if (in->wand != NULL)
+		DestroyMagickWand (in->wand);
+
+	if (in->jpeg != NULL)
+		convert_free (in->jpeg);
+
+	free (in->rgb);
+	free (in->xwd);
+}
+
+
+/* decodes the frame, kernels after `decode' need it */
+static bool
+prepare_input (micro_input *in)
+{
+	in->image = image_decode (in->xwd, in->xwd_size);
+
+	if (in->image == NULL)
+		return false;
+
+	image_size (in->image, &in->width, &in->height);
+
+	in->wand = NewMagickWand ();
+
+	if (in->wand == NULL ||
+	    MagickSetFormat (in->wand, "XWD") == MagickFalse ||
+	    MagickReadImageBlob (in->wand, in->xwd, in->xwd_size) == MagickFalse ||
+	    MagickSetImageFormat (in->wand, "JPEG") == MagickFalse)
+	{
+		return false;
+	}
+
+	in->rgb = malloc (in->width * in->height * 3);
+
+	return in->rgb != NULL &&
+		image_encode (in->image, &in->jpeg, &in->jpeg_size);
+}
+
+
+static void
+run_input (FILE *fh, micro_input *in, bool decoded)
+{
+	unsigned int i;
+
+
+	if (decoded && !prepare_input (in)) {
+		fprintf (stderr, "%s: failed to decode\n", in->content);
+		return;
+	}
+
+	for (i = 0; i < sizeof (kernels) / sizeof (kernels[0]); i++)
+		if (decoded || kernels[i].per_depth)
+			run_kernel (fh, &kernels[i], in);
+}
+
+
+static unsigned char *
+read_file (const char *path, size_t *size)
+{
+	unsigned char *data = NULL, *p;
+	size_t alloc = 0, n;
+	FILE *fh;
+
+
+	if ((fh = fopen (path, "rb")) == NULL)
+		return NULL;
+
+	*size = 0;
+
+	do {
+		if (*size == alloc) {
+			alloc = (alloc > 0) ? alloc * 2 : 1024 * 1024;
+			p = realloc (data, alloc);
+
+			if (p == NULL) {
+				free (data);
+				(void) fclose (fh);
+				return NULL;
+			}
+
+			data = p;
+		}
+
+		n = fread (data + *size, 1, alloc - *size, fh);
+		*size += n;
+	} while (n > 0);
+
+	(void) fclose (fh);
+
+	return data;
+}
+
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+		"Usage: %s [options] [FILE.xwd ...]\n"
+		"  -s WxH      synthesized frame size, default %ux%u\n"
+		"  -t SECONDS  min. time per kernel, default %.1f\n"
+		"  -n COUNT    min. iterations per kernel, default %u\n"
+		"  -j THREADS  max. ImageMagick threads, default all\n"
+		"  -o FILE     write JSON to FILE, default stdout\n",
+		name, DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_MIN_TIME,
+		DEFAULT_MIN_ITERATIONS);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	unsigned int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT;
+	unsigned int threads = 0, d;
+	const char *output = NULL;
+	enum xwd_pattern pattern;
+	micro_input in;
+	size_t version;
+	FILE *fh = stdout;
+	int opt, i;
+
+
+	micro.min_time = DEFAULT_MIN_TIME;
+	micro.min_iterations = DEFAULT_MIN_ITERATIONS;
+
+	while ((opt = getopt (argc, argv, "s:t:n:j:o:h")) != -1) {
+		switch (opt) {
+		case 's':
+			if (sscanf (optarg, "%ux%u", &width, &height) != 2)
+				width = 0;
+			break;
+		case 't':
+			micro.min_time = strtod (optarg, NULL);
+			break;
+		case 'n':
+			micro.min_iterations = strtoul (optarg, NULL, 10);
+			break;
+		case 'j':
+			threads = strtoul (optarg, NULL, 10);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (width == 0 || height == 0 || micro.min_time < 0 ||
+	    micro.min_iterations == 0 || micro.min_iterations > MAX_ITERATIONS)
+	{
+		usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (output != NULL && (fh = fopen (output, "w")) == NULL) {
+		fprintf (stderr, "%s: %s\n", output, strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	init_imagemagick (threads);
+	micro.ping = NewMagickWand ();
+
+	fprintf (fh, "{\n  \"imagemagick\": ");
+	json_string (fh, MagickGetVersion (&version));
+	fprintf (fh, ",\n  \"min_time\": %.3f,\n  \"results\": [",
+		micro.min_time);
+
+	for (pattern = XWD_GRADIENT; pattern <= XWD_DESKTOP; pattern++) {
+		for (d = 0; d < sizeof (depths) / sizeof (depths[0]); d++) {
+			memset (&in, 0, sizeof (in));
+			in.content = xwd_pattern_name (pattern);
+			in.depth = depths[d];
+			in.width = width;
+			in.height = height;
+			in.xwd = xwd_make (width, height, in.depth, pattern,
+				&in.xwd_size);
+
+			if (in.xwd == NULL) {
+				fprintf (stderr, "out of memory\n");
+				break;
+			}
+
+			run_input (fh, &in, in.depth == KERNEL_DEPTH);
+			free_input (&in);
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		memset (&in, 0, sizeof (in));
+		in.content = argv[i];
+		in.recorded = true;
+		in.xwd = read_file (argv[i], &in.xwd_size);
+
+		if (in.xwd == NULL || in.xwd_size < 100) {
+			fprintf (stderr, "%s: not an XWD file\n", argv[i]);
+			free (in.xwd);
+			continue;
+		}
+
+		/* pixmap_depth, the 4th CARD32 of the header */
+		in.depth = (unsigned int) in.xwd[12] << 24 |
+			(unsigned int) in.xwd[13] << 16 |
+			(unsigned int) in.xwd[14] << 8 | in.xwd[15];
+
+		run_input (fh, &in, true);
+		free_input (&in);
+	}
+
+	fprintf (fh, "\n  ]\n}\n");
+
+	DestroyMagickWand (micro.ping);
+	free_imagemagick ();
+
+	if (fh != stdout && fclose (fh) != 0) {
+		fprintf (stderr, "%s: %s\n", output, strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
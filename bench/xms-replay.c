@@ -0,0 +1,810 @@
+/*
+ * Replays uploads captured by x11mirror-server (-c FILE) against
+ * a server, at the original timing or as fast as possible:
+ *
+ *   ./x11mirror-server -p 8888 -c uploads.cap
+ *   bench/xms-replay -p 8888 uploads.cap
+ *   bench/xms-replay -p 8888 -f -n 4 uploads.cap
+ *
+ * Every connection sends uploads in the order of their arrival, each
+ * one when it is due. Uploads which have been cut short are skipped.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "capture.h"
+
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8888
+#define DEFAULT_CONNECTIONS 1
+
+/* an upload which starts later than this (usec) is late */
+#define LATE_THRESHOLD 5000
+
+/* a response head, a request head with rewritten headers */
+#define HEADER_SIZE (8 * 1024)
+
+/* headers of a captured request which are not replayed as they are */
+static const char *skipped_headers[] = {
+	"Host:",
+	"Connection:",
+	"Keep-Alive:",
+	"Content-Length:",
+	"Transfer-Encoding:",
+	"Expect:",
+	"X-Capture-Time:"
+};
+
+typedef struct _replay_options {
+	const char *host;
+	unsigned int port;
+	const char *unix_path;
+	unsigned int connections;
+	double speed;
+	bool fast;
+} replay_options;
+
+/* a piece of a body in the mapped capture */
+typedef struct _replay_chunk {
+	const char *data;
+	size_t size;
+} replay_chunk;
+
+typedef struct _replay_upload {
+	uint64_t arrival;
+	const char *head;
+	size_t head_size;
+
+	replay_chunk *chunks;
+	size_t nchunks;
+	size_t body_size;
+
+	/* enum capture_type: CAPTURE_BEGIN until it is complete */
+	uint32_t state;
+
+	/* the result: status (-1 is failed), latency & lateness (usec) */
+	int status;
+	uint64_t latency;
+	uint64_t late;
+} replay_upload;
+
+typedef struct _replay_conn {
+	int fd;
+	char head[HEADER_SIZE];
+} replay_conn;
+
+static replay_options ops;
+
+static struct {
+	/* by id (id - 1), then compacted & sorted by arrival */
+	replay_upload *uploads;
+	size_t count;
+
+	/* the next upload to send */
+	size_t next;
+
+	/* the first arrival, the replay start (monotonic) */
+	uint64_t first;
+	uint64_t start;
+} replay;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static uint64_t
+monotonic_usec (void)
+{
+	struct timespec tp;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &tp);
+
+	return (uint64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+
+static uint64_t
+realtime_usec (void)
+{
+	struct timespec tp;
+
+	(void) clock_gettime (CLOCK_REALTIME, &tp);
+
+	return (uint64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+
+static void
+sleep_until (uint64_t when)
+{
+	uint64_t now = monotonic_usec ();
+	struct timespec ts;
+
+	if (when <= now)
+		return;
+
+	ts.tv_sec = (when - now) / 1000000;
+	ts.tv_nsec = (when - now) % 1000000 * 1000;
+
+	while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+
+static replay_upload *
+upload_by_id (uint64_t id, bool create)
+{
+	replay_upload *uploads;
+	size_t alloc;
+
+
+	if (id == 0)
+		return NULL;
+
+	if (id > replay.count) {
+		if (!create)
+			return NULL;
+
+		for (alloc = (replay.count > 0) ? replay.count : 1024;
+		     alloc < id; alloc *= 2)
+			;
+
+		uploads = realloc (replay.uploads, alloc * sizeof (*uploads));
+
+		if (uploads == NULL)
+			return NULL;
+
+		memset (uploads + replay.count, 0,
+			(alloc - replay.count) * sizeof (*uploads));
+		replay.uploads = uploads;
+		replay.count = alloc;
+	}
+
+	return &replay.uploads[id - 1];
+}
+
+
+static bool
+upload_add_chunk (replay_upload *u, const char *data, size_t size)
+{
+	replay_chunk *chunks;
+
+
+	/* powers of two */
+	if ((u->nchunks & (u->nchunks - 1)) == 0) {
+		chunks = realloc (u->chunks,
+			(u->nchunks ? u->nchunks * 2 : 1) * sizeof (*chunks));
+
+		if (chunks == NULL)
+			return false;
+
+		u->chunks = chunks;
+	}
+
+	u->chunks[u->nchunks].data = data;
+	u->chunks[u->nchunks].size = size;
+	u->nchunks++;
+	u->body_size += size;
+
+	return true;
+}
+
+
+static int
+compare_arrival (const void *a, const void *b)
+{
+	const replay_upload *x = a, *y = b;
+
+	return (x->arrival > y->arrival) - (x->arrival < y->arrival);
+}
+
+
+/* indexes records of a mapped capture, keeps complete uploads only */
+static bool
+load_capture (const char *path, const char *map, size_t size)
+{
+	const xms_capture_header *hdr = (const xms_capture_header *) map;
+	xms_capture_record rec;
+	replay_upload *u;
+	size_t pos, i, n;
+
+
+	if (size < sizeof (*hdr) ||
+	    memcmp (hdr->magic, CAPTURE_MAGIC, sizeof (hdr->magic)) != 0 ||
+	    hdr->version != CAPTURE_VERSION ||
+	    hdr->record_size != sizeof (xms_capture_record))
+	{
+		fprintf (stderr, "%s: not a capture or an incompatible one\n",
+			path);
+		return false;
+	}
+
+	for (pos = sizeof (*hdr); pos + sizeof (rec) <= size; ) {
+		memcpy (&rec, map + pos, sizeof (rec));
+		pos += sizeof (rec);
+
+		/* a torn tail */
+		if (rec.length > size - pos)
+			break;
+
+		u = upload_by_id (rec.id, rec.type == CAPTURE_BEGIN);
+
+		if (u == NULL && rec.type == CAPTURE_BEGIN) {
+			fprintf (stderr, "%s: out of memory\n", path);
+			return false;
+		}
+
+		if (u == NULL)
+			;
+		else if (rec.type == CAPTURE_BEGIN) {
+			u->arrival = rec.timestamp;
+			u->head = map + pos;
+			u->head_size = rec.length;
+			u->state = CAPTURE_BEGIN;
+		}
+		else if (u->state != CAPTURE_BEGIN)
+			;
+		else if (rec.type == CAPTURE_DATA) {
+			if (!upload_add_chunk (u, map + pos, rec.length)) {
+				fprintf (stderr, "%s: out of memory\n", path);
+				return false;
+			}
+		}
+		else if (rec.type == CAPTURE_END || rec.type == CAPTURE_ABORT)
+			u->state = rec.type;
+
+		pos += rec.length;
+	}
+
+	for (i = 0, n = 0; i < replay.count; i++) {
+		if (replay.uploads[i].state == CAPTURE_END)
+			replay.uploads[n++] = replay.uploads[i];
+		else
+			free (replay.uploads[i].chunks);
+	}
+
+	replay.count = n;
+	qsort (replay.uploads, n, sizeof (*replay.uploads), compare_arrival);
+
+	return true;
+}
+
+
+static int
+conn_open (replay_conn *c)
+{
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	int fd, one = 1;
+
+
+	if (ops.unix_path != NULL) {
+		memset (&un, 0, sizeof (un));
+		un.sun_family = AF_UNIX;
+		strncpy (un.sun_path, ops.unix_path, sizeof (un.sun_path) - 1);
+
+		fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+		if (fd != -1 &&
+		    connect (fd, (struct sockaddr *) &un, sizeof (un)) != 0)
+		{
+			(void) close (fd);
+			fd = -1;
+		}
+	}
+	else {
+		memset (&in, 0, sizeof (in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons (ops.port);
+
+		if (inet_pton (AF_INET, ops.host, &in.sin_addr) != 1)
+			return -1;
+
+		fd = socket (AF_INET, SOCK_STREAM, 0);
+
+		if (fd != -1 &&
+		    connect (fd, (struct sockaddr *) &in, sizeof (in)) != 0)
+		{
+			(void) close (fd);
+			fd = -1;
+		}
+
+		/* headers & body chunks are sent separately */
+		if (fd != -1)
+			(void) setsockopt (fd, IPPROTO_TCP, TCP_NODELAY,
+				&one, sizeof (one));
+	}
+
+	c->fd = fd;
+
+	return fd;
+}
+
+
+static void
+conn_close (replay_conn *c)
+{
+	if (c->fd != -1)
+		(void) close (c->fd);
+
+	c->fd = -1;
+}
+
+
+static bool
+send_all (int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	ssize_t n;
+
+
+	while (size > 0) {
+		n = send (fd, p, size, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		p += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+
+/*
+ * Reads a response and skips its body, returns its status or -1.
+ * The connection is closed if the server does not keep it.
+ */
+static int
+read_response (replay_conn *c)
+{
+	size_t len = 0, have;
+	char *end = NULL, *line, *next;
+	unsigned long long length = 0;
+	bool has_length = false, keep = true;
+	int status = -1;
+	ssize_t n;
+
+
+	while (end == NULL) {
+		if (len == sizeof (c->head) - 1)
+			return -1;
+
+		n = recv (c->fd, c->head + len, sizeof (c->head) - 1 - len, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return -1;
+
+		len += n;
+		c->head[len] = '\0';
+		end = strstr (c->head, "\r\n\r\n");
+	}
+
+	if (sscanf (c->head, "HTTP/%*d.%*d %d", &status) != 1)
+		return -1;
+
+	for (line = strstr (c->head, "\r\n"); line != NULL && line < end;
+	     line = next)
+	{
+		line += 2;
+		next = strstr (line, "\r\n");
+
+		if (strncasecmp (line, "Content-Length:", 15) == 0) {
+			length = strtoull (line + 15, NULL, 10);
+			has_length = true;
+		}
+		else if (strncasecmp (line, "Connection:", 11) == 0 &&
+		         strstr (line, "close") != NULL && strstr (line, "close") < next)
+		{
+			keep = false;
+		}
+	}
+
+	have = len - (end + 4 - c->head);
+
+	while (!has_length || have < length) {
+		n = recv (c->fd, c->head, sizeof (c->head), 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0 || (n == 0 && has_length))
+			return -1;
+
+		/* no length: the body ends with the connection */
+		if (n == 0)
+			break;
+
+		have += n;
+	}
+
+	if (!has_length || !keep)
+		conn_close (c);
+
+	return status;
+}
+
+
+static bool
+header_skipped (const char *line)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof (skipped_headers) / sizeof (skipped_headers[0]);
+	     i++)
+	{
+		if (strncasecmp (line, skipped_headers[i],
+			strlen (skipped_headers[i])) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * The captured head with our Host & Content-Length. X-Capture-Time is
+ * shifted by the replay delay, so capture-to-serve latency stays sane.
+ */
+static bool
+build_head (const replay_upload *u, uint64_t now, char *buf, size_t size)
+{
+	const char *line = u->head, *end = u->head + u->head_size, *eol;
+	size_t len = 0, n, target;
+	double capture;
+	int r;
+
+
+	for (; line < end; line = eol + 2) {
+		eol = line;
+
+		while (eol + 1 < end && !(eol[0] == '\r' && eol[1] == '\n'))
+			eol++;
+
+		/* the empty line */
+		if (eol == line || eol + 1 >= end)
+			break;
+
+		n = eol - line;
+
+		if (line == u->head) {
+			/* the method & the URL, the version is ours */
+			for (target = n; target > 0 && line[target - 1] != ' ';
+			     target--)
+				;
+
+			r = snprintf (buf, size, "%.*s HTTP/1.1\r\nHost: %s:%u\r\n",
+				(int) (target > 0 ? target - 1 : n), line,
+				ops.host, ops.port);
+		}
+		else if (strncasecmp (line, "X-Capture-Time:", 15) == 0) {
+			capture = strtod (line + 15, NULL) +
+				((double) now - (double) u->arrival) / 1e6;
+			r = snprintf (buf + len, size - len,
+				"X-Capture-Time: %.6f\r\n", capture);
+		}
+		else if (header_skipped (line))
+			continue;
+		else
+			r = snprintf (buf + len, size - len, "%.*s\r\n",
+				(int) n, line);
+
+		if (r < 0 || (size_t) r >= size - len)
+			return false;
+
+		len += r;
+	}
+
+	r = snprintf (buf + len, size - len, "Content-Length: %zu\r\n\r\n",
+		u->body_size);
+
+	return r > 0 && (size_t) r < size - len;
+}
+
+
+/* returns a status or -1, retried once on a fresh connection */
+static int
+send_upload (replay_conn *c, const replay_upload *u, const char *head)
+{
+	bool reused, sent;
+	int attempt, status;
+	size_t i;
+
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		reused = (c->fd != -1);
+
+		if (!reused && conn_open (c) == -1)
+			return -1;
+
+		sent = send_all (c->fd, head, strlen (head));
+
+		for (i = 0; sent && i < u->nchunks; i++)
+			sent = send_all (c->fd, u->chunks[i].data,
+				u->chunks[i].size);
+
+		if (sent) {
+			status = read_response (c);
+
+			if (status != -1)
+				return status;
+		}
+
+		conn_close (c);
+
+		/* the server may have closed an idle connection */
+		if (!reused)
+			break;
+	}
+
+	return -1;
+}
+
+
+static void *
+connection_main (void *arg)
+{
+	replay_conn c;
+	replay_upload *u;
+	char head[HEADER_SIZE];
+	uint64_t due, start;
+	size_t i;
+
+
+	(void) arg;
+	c.fd = -1;
+
+	while ((i = __atomic_fetch_add (&replay.next, 1, __ATOMIC_ACQ_REL)) <
+	       replay.count)
+	{
+		u = &replay.uploads[i];
+
+		if (!ops.fast) {
+			due = replay.start + (uint64_t)
+				((u->arrival - replay.first) / ops.speed);
+			sleep_until (due);
+		}
+		else
+			due = monotonic_usec ();
+
+		start = monotonic_usec ();
+		u->late = (start > due) ? start - due : 0;
+
+		if (!build_head (u, realtime_usec (), head, sizeof (head))) {
+			u->status = -1;
+			continue;
+		}
+
+		u->status = send_upload (&c, u, head);
+		u->latency = monotonic_usec () - start;
+	}
+
+	conn_close (&c);
+
+	return NULL;
+}
+
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* the nearest-rank percentile */
+static double
+percentile_msec (const uint64_t *sorted, size_t n, double p)
+{
+	size_t rank = (size_t) (p * n + 0.999999);
+
+	if (rank == 0)
+		rank = 1;
+
+	return sorted[rank - 1] / 1000.0;
+}
+
+
+static void
+report (double elapsed)
+{
+	uint64_t *latency, bytes = 0;
+	size_t n = 0, late = 0, failed = 0, classes[6] = { 0 }, i;
+	double original;
+
+
+	latency = malloc ((replay.count + 1) * sizeof (*latency));
+
+	for (i = 0; i < replay.count; i++) {
+		const replay_upload *u = &replay.uploads[i];
+
+		if (u->late > LATE_THRESHOLD)
+			late++;
+
+		if (u->status < 100 || u->status > 599) {
+			failed++;
+			continue;
+		}
+
+		classes[u->status / 100]++;
+		bytes += u->body_size;
+
+		if (latency != NULL)
+			latency[n++] = u->latency;
+	}
+
+	original = (replay.count > 0) ? (replay.uploads[replay.count - 1].arrival -
+		replay.uploads[0].arrival) / 1e6 : 0;
+
+	printf ("captured        %zu uploads over %.1f s\n",
+		replay.count, original);
+	printf ("replayed        %.1f s, %s\n", elapsed,
+		ops.fast ? "as fast as possible" : "at the original timing");
+	printf ("uploads         %zu 2xx, %zu 4xx, %zu 5xx, %zu failed, "
+		"%zu late (%.1f/s, %.1f MiB/s)\n",
+		classes[2], classes[4], classes[5], failed, late,
+		replay.count / elapsed, bytes / 1048576.0 / elapsed);
+
+	if (n > 0) {
+		qsort (latency, n, sizeof (*latency), compare_u64);
+		printf ("upload latency  p50 %.2f ms, p99 %.2f ms, "
+			"p99.9 %.2f ms, max %.2f ms\n",
+			percentile_msec (latency, n, 0.5),
+			percentile_msec (latency, n, 0.99),
+			percentile_msec (latency, n, 0.999),
+			latency[n - 1] / 1000.0);
+	}
+
+	free (latency);
+}
+
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+		"Usage: %s [options] CAPTURE\n"
+		"  -H ADDR     server IPv4 address, default " DEFAULT_HOST "\n"
+		"  -p PORT     server port, default %u\n"
+		"  -U PATH     connect to a Unix domain socket instead\n"
+		"  -n CONNS    connections, default %u\n"
+		"  -x SPEED    a time scale, e.g. 2 is twice as fast, default 1\n"
+		"  -f          as fast as possible\n",
+		name, DEFAULT_PORT, DEFAULT_CONNECTIONS);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	pthread_t *threads;
+	struct stat st;
+	const char *path;
+	void *map;
+	uint64_t start;
+	unsigned int i;
+	int fd, opt;
+
+
+	ops.host = DEFAULT_HOST;
+	ops.port = DEFAULT_PORT;
+	ops.unix_path = NULL;
+	ops.connections = DEFAULT_CONNECTIONS;
+	ops.speed = 1.0;
+	ops.fast = false;
+
+	while ((opt = getopt (argc, argv, "H:p:U:n:x:fh")) != -1) {
+		switch (opt) {
+		case 'H':
+			ops.host = optarg;
+			break;
+		case 'p':
+			ops.port = strtoul (optarg, NULL, 10);
+			break;
+		case 'U':
+			ops.unix_path = optarg;
+			break;
+		case 'n':
+			ops.connections = strtoul (optarg, NULL, 10);
+			break;
+		case 'x':
+			ops.speed = strtod (optarg, NULL);
+			break;
+		case 'f':
+			ops.fast = true;
+			break;
+		default:
+			usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind + 1 != argc || ops.port == 0 || ops.port > 65535 ||
+	    ops.connections == 0 || !(ops.speed > 0))
+	{
+		usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	path = argv[optind];
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1 || fstat (fd, &st) != 0) {
+		fprintf (stderr, "%s: %s\n", path, strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close (fd);
+
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "%s: %s\n", path, strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	if (!load_capture (path, map, st.st_size))
+		return EXIT_FAILURE;
+
+	if (replay.count == 0) {
+		fprintf (stderr, "%s: no complete uploads\n", path);
+		return EXIT_FAILURE;
+	}
+
+	(void) signal (SIGPIPE, SIG_IGN);
+
+	threads = calloc (ops.connections, sizeof (*threads));
+
+	if (threads == NULL)
+		return EXIT_FAILURE;
+
+	replay.first = replay.uploads[0].arrival;
+	replay.start = start = monotonic_usec ();
+
+	for (i = 0; i < ops.connections; i++)
+		if (pthread_create (&threads[i], NULL, connection_main, NULL) != 0) {
+			fprintf (stderr, "%s: failed to start threads\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	for (i = 0; i < ops.connections; i++)
+		(void) pthread_join (threads[i], NULL);
+
+	report ((monotonic_usec () - start) / 1e6);
+
+	for (i = 0; i < replay.count; i++)
+		free (replay.uploads[i].chunks);
+
+	free (replay.uploads);
+	free (threads);
+	(void) munmap (map, st.st_size);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,220 @@
+#include "xwd.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* 25 CARD32 fields (MSB first), the window name & the colormap follow */
+#define XWD_FIELDS 25
+#define XWD_NAME "xms-bench"
+#define XWD_HEADER_SIZE (XWD_FIELDS * 4 + sizeof (XWD_NAME))
+
+/* an XColor entry: pixel, red, green, blue, flags & a pad byte */
+#define XWD_COLOR_SIZE 12
+#define XWD_COLORS 256
+
+
+/* ------------------------------------------------------------------ */
+
+
+static void
+put_card32 (unsigned char *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+
+static uint32_t
+get_card32 (const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+		(uint32_t) p[2] << 8 | p[3];
+}
+
+
+/* a cheap deterministic hash, the desktop "text" */
+static unsigned int
+glyph_bits (unsigned int x, unsigned int y)
+{
+	uint32_t h = x * 2654435761u ^ y * 40503u;
+
+	h ^= h >> 15;
+	h *= 2246822519u;
+
+	return h >> 13;
+}
+
+
+static void
+desktop_pixel (unsigned int x, unsigned int y,
+               unsigned int width, unsigned int height,
+               unsigned int *r, unsigned int *g, unsigned int *b)
+{
+	static const unsigned int windows[][4] = {
+		/* left, top, right, bottom: eighths of the screen */
+		{ 1, 1, 5, 6 },
+		{ 4, 3, 7, 7 }
+	};
+	unsigned int i, left, top, right, bottom, row, col;
+
+
+	/* the topmost window wins */
+	for (i = sizeof (windows) / sizeof (windows[0]); i-- > 0; ) {
+		left = windows[i][0] * width / 8;
+		top = windows[i][1] * height / 8;
+		right = windows[i][2] * width / 8;
+		bottom = windows[i][3] * height / 8;
+
+		if (x < left || x >= right || y < top || y >= bottom)
+			continue;
+
+		/* the title bar */
+		if (y - top < 24) {
+			*r = 0x44;
+			*g = 0x55;
+			*b = 0x77;
+			return;
+		}
+
+		/* 8x16 cells, some of them have a glyph */
+		row = (y - top - 24) % 16;
+		col = (x - left) % 8;
+
+		if (row >= 3 && row < 13 && col >= 1 && col < 7 &&
+		    (glyph_bits ((x - left) / 8, (y - top) / 16) & 3) != 0 &&
+		    (glyph_bits (x, y) & 1) != 0)
+		{
+			*r = *g = *b = 0x20;
+			return;
+		}
+
+		*r = *g = *b = 0xf4;
+		return;
+	}
+
+	*r = 0x2e;
+	*g = 0x34;
+	*b = 0x40;
+}
+
+
+extern unsigned char *
+xwd_make (unsigned int width, unsigned int height, unsigned int depth,
+          enum xwd_pattern pattern, size_t *size)
+{
+	uint32_t fields[XWD_FIELDS];
+	unsigned int bpp, ncolors, x, y, r, g, b, i;
+	size_t line, colormap;
+	unsigned char *xwd, *p;
+	uint32_t pixel;
+
+
+	if (depth == 8)
+		bpp = 8;
+	else if (depth == 16)
+		bpp = 16;
+	else if (depth == 24 || depth == 32)
+		bpp = 32;
+	else
+		return NULL;
+
+	ncolors = (depth == 8) ? XWD_COLORS : 0;
+	colormap = (size_t) ncolors * XWD_COLOR_SIZE;
+	line = ((size_t) width * bpp + 31) / 32 * 4;
+
+	*size = XWD_HEADER_SIZE + colormap + line * height;
+	xwd = calloc (1, *size);
+
+	if (xwd == NULL)
+		return NULL;
+
+	fields[0] = XWD_HEADER_SIZE;
+	fields[1] = 7;			/* file_version */
+	fields[2] = 2;			/* ZPixmap */
+	fields[3] = depth;
+	fields[4] = width;
+	fields[5] = height;
+	fields[6] = 0;			/* xoffset */
+	fields[7] = 0;			/* byte_order: LSBFirst */
+	fields[8] = 32;			/* bitmap_unit */
+	fields[9] = 0;			/* bitmap_bit_order */
+	fields[10] = 32;		/* bitmap_pad */
+	fields[11] = bpp;
+	fields[12] = line;
+	fields[13] = (depth == 8) ? 3 : 4;	/* PseudoColor : TrueColor */
+	fields[14] = (depth == 8) ? 0 : (bpp == 16) ? 0xf800 : 0xff0000;
+	fields[15] = (depth == 8) ? 0 : (bpp == 16) ? 0x07e0 : 0x00ff00;
+	fields[16] = (depth == 8) ? 0 : (bpp == 16) ? 0x001f : 0x0000ff;
+	fields[17] = 8;			/* bits_per_rgb */
+	fields[18] = XWD_COLORS;	/* colormap_entries */
+	fields[19] = ncolors;
+	fields[20] = width;
+	fields[21] = height;
+	fields[22] = 0;
+	fields[23] = 0;
+	fields[24] = 0;
+
+	for (i = 0; i < XWD_FIELDS; i++)
+		put_card32 (xwd + i * 4, fields[i]);
+
+	memcpy (xwd + XWD_FIELDS * 4, XWD_NAME, sizeof (XWD_NAME));
+
+	/* 3-3-2: the pixel value is the color */
+	p = xwd + XWD_HEADER_SIZE;
+
+	for (i = 0; i < ncolors; i++, p += XWD_COLOR_SIZE) {
+		put_card32 (p, i);
+		p[4] = p[5] = (i >> 5) * 255 / 7;
+		p[6] = p[7] = (i >> 2 & 7) * 255 / 7;
+		p[8] = p[9] = (i & 3) * 255 / 3;
+		p[10] = 7;		/* DoRed | DoGreen | DoBlue */
+	}
+
+	for (y = 0; y < height; y++) {
+		p = xwd + XWD_HEADER_SIZE + colormap + line * y;
+
+		for (x = 0; x < width; x++) {
+			if (pattern == XWD_DESKTOP)
+				desktop_pixel (x, y, width, height, &r, &g, &b);
+			else {
+				r = x * 255 / width;
+				g = y * 255 / height;
+				b = (x + y) & 0xff;
+			}
+
+			if (bpp == 8)
+				*p++ = (r >> 5) << 5 | (g >> 5) << 2 | b >> 6;
+			else if (bpp == 16) {
+				pixel = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+				*p++ = pixel;
+				*p++ = pixel >> 8;
+			}
+			else {
+				*p++ = b;
+				*p++ = g;
+				*p++ = r;
+				*p++ = 0;
+			}
+		}
+	}
+
+	return xwd;
+}
+
+
+extern size_t
+xwd_pixels (const unsigned char *xwd)
+{
+	/* header_size & ncolors */
+	return get_card32 (xwd) + get_card32 (xwd + 19 * 4) * XWD_COLOR_SIZE;
+}
+
+
+extern const char *
+xwd_pattern_name (enum xwd_pattern pattern)
+{
+	return (pattern == XWD_DESKTOP) ? "desktop" : "gradient";
+}
@@ -0,0 +1,28 @@
+#ifndef XMS_BENCH_XWD_H
+#define XMS_BENCH_XWD_H
+
+#include <stddef.h>
+
+/* what a synthesized frame looks like */
+enum xwd_pattern {
+	XWD_GRADIENT = 0,	/* smooth, compresses well */
+	XWD_DESKTOP		/* flat areas, windows & text-like noise */
+};
+
+/*
+ * A ZPixmap dump, like `xwd -root' makes. Depth 8 is a PseudoColor
+ * visual with a 3-3-2 colormap, 16, 24 & 32 are TrueColor ones.
+ * Returns a malloc ()ed dump or NULL.
+ */
+extern unsigned char *
+xwd_make (unsigned int width, unsigned int height, unsigned int depth,
+          enum xwd_pattern pattern, size_t *size);
+
+/* the offset of pixels in a dump made by xwd_make () */
+extern size_t
+xwd_pixels (const unsigned char *xwd);
+
+extern const char *
+xwd_pattern_name (enum xwd_pattern pattern);
+
+#endif /* XMS_BENCH_XWD_H */
@@ -0,0 +1,143 @@
+#include "budget.h"
+#include "atomics.h"
+#include "common.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+
+static const char *cache_names[BUDGET_CACHES] = {
+	"buffers",
+	"variants",
+	"frames"
+};
+
+static struct {
+	size_t limit;
+	budget_evict_cb evict[BUDGET_CACHES];
+	uint64_t bytes[BUDGET_CACHES];
+	uint64_t evicted[BUDGET_CACHES];
+} budget;
+
+/* one enforcer at a time, the rest do not wait */
+static pthread_mutex_t enforcer = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static uint64_t
+total_bytes (void)
+{
+	uint64_t total = 0;
+	unsigned int i;
+
+
+	for (i = 0; i < BUDGET_CACHES; i++)
+		total += xms_atomic_load (&budget.bytes[i]);
+
+	return total;
+}
+
+
+extern void
+init_budget (size_t limit)
+{
+	budget.limit = limit;
+}
+
+
+extern size_t
+budget_limit (void)
+{
+	return budget.limit;
+}
+
+
+extern void
+budget_register (enum budget_cache cache, budget_evict_cb evict)
+{
+	budget.evict[cache] = evict;
+}
+
+
+extern void
+budget_charge (enum budget_cache cache, size_t bytes)
+{
+	xms_atomic_add (&budget.bytes[cache], bytes);
+}
+
+
+extern void
+budget_uncharge (enum budget_cache cache, size_t bytes)
+{
+	xms_atomic_sub (&budget.bytes[cache], bytes);
+}
+
+
+extern void
+budget_enforce (void)
+{
+	uint64_t total;
+	size_t freed;
+	unsigned int i;
+	bool progress = true;
+
+
+	if (budget.limit == 0 || total_bytes () <= budget.limit)
+		return;
+
+	if (pthread_mutex_trylock (&enforcer) != 0)
+		return;
+
+	/*
+	 * evicted frames return their buffers to the pool, so it may
+	 * take another pass to trim them
+	 */
+	while (progress) {
+		progress = false;
+
+		for (i = 0; i < BUDGET_CACHES; i++) {
+			total = total_bytes ();
+
+			if (total <= budget.limit)
+				goto done;
+
+			if (budget.evict[i] == NULL)
+				continue;
+
+			/* evictors uncharge what they release */
+			freed = budget.evict[i] (total - budget.limit);
+
+			if (freed > 0) {
+				xms_atomic_add (&budget.evicted[i], freed);
+				debug ("budget: evicted %zu bytes of %s\n",
+					freed, cache_names[i]);
+				progress = true;
+			}
+		}
+	}
+
+done:
+	pthread_mutex_unlock (&enforcer);
+}
+
+
+extern void
+budget_usage (xms_budget_usage usage[BUDGET_CACHES])
+{
+	unsigned int i;
+
+
+	for (i = 0; i < BUDGET_CACHES; i++) {
+		usage[i].bytes = xms_atomic_load (&budget.bytes[i]);
+		usage[i].evicted = xms_atomic_load (&budget.evicted[i]);
+	}
+}
+
+
+extern const char *
+budget_cache_name (enum budget_cache cache)
+{
+	return cache_names[cache];
+}
@@ -0,0 +1,62 @@
+#ifndef XMS_BUDGET_H
+#define XMS_BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A server-wide memory budget (-B). Every frame-related cache charges
+ * the bytes it keeps, once the total is over the limit the caches are
+ * evicted in the order below: what is the cheapest to get back goes
+ * first, the primary frames go last.
+ */
+enum budget_cache {
+	BUDGET_BUFFERS = 0,	/* idle buffers (bufpool.c) */
+	BUDGET_VARIANTS,	/* lower quality variants (frames.c) */
+	BUDGET_FRAMES,		/* the frames ring (frames.c) */
+	BUDGET_CACHES
+};
+
+/* evicts up to `bytes' (or a bit more), returns bytes released */
+typedef size_t (*budget_evict_cb) (size_t bytes);
+
+typedef struct _xms_budget_usage {
+	/* bytes kept by the cache */
+	uint64_t bytes;
+
+	/* bytes evicted to stay within the budget, cumulative */
+	uint64_t evicted;
+} xms_budget_usage;
+
+
+/* 0: no limit, the usage is tracked anyway */
+extern void
+init_budget (size_t limit);
+
+extern size_t
+budget_limit (void);
+
+extern void
+budget_register (enum budget_cache cache, budget_evict_cb evict);
+
+/* both are lock-free & may be called with any lock held */
+extern void
+budget_charge (enum budget_cache cache, size_t bytes);
+
+extern void
+budget_uncharge (enum budget_cache cache, size_t bytes);
+
+/*
+ * Evicts caches until the total is within the limit. Must not be called
+ * with a lock of any cache held, a concurrent call returns right away.
+ */
+extern void
+budget_enforce (void);
+
+extern void
+budget_usage (xms_budget_usage usage[BUDGET_CACHES]);
+
+extern const char *
+budget_cache_name (enum budget_cache cache);
+
+#endif /* XMS_BUDGET_H */
@@ -0,0 +1,346 @@
+#if defined(__linux__)
+#define _GNU_SOURCE	/* MAP_ANONYMOUS, MAP_HUGETLB, MADV_HUGEPAGE */
+#endif
+#include "bufpool.h"
+#include "atomics.h"
+#include "budget.h"
+#include "common.h"
+#include "mpmc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+
+/* the smallest class is 64 KiB, the largest one is 64 MiB */
+#define BUFPOOL_MIN_SHIFT 16
+#define BUFPOOL_CLASSES 11
+/* idle bytes per class, but one buffer at least */
+#define BUFPOOL_CLASS_IDLE (64 * 1024 * 1024)
+/* max. idle buffers per class */
+#define BUFPOOL_MAX_IDLE 16
+#define BUFPOOL_HUGE_PAGE (2 * 1024 * 1024)
+
+#define CLASS_SIZE(cls) ((size_t) 1 << (BUFPOOL_MIN_SHIFT + (cls)))
+
+/* precedes the data, the padding keeps the data aligned */
+typedef union _buf_header {
+	struct {
+		/* of the whole mapping */
+		size_t length;
+
+		/* BUFPOOL_CLASSES for larger buffers */
+		unsigned int cls;
+	} h;
+	unsigned char pad[64];
+} buf_header;
+
+static struct {
+	enum bufpool_pages pages;
+
+	/* idle buffers (buf_header *) per class */
+	MPMC_QUEUE *idle[BUFPOOL_CLASSES];
+
+	/* MAP_HUGETLB has failed once, it is not reported again */
+	int hugetlb_failed;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t idle_bytes;
+} pool;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static unsigned int
+class_for (size_t size)
+{
+	unsigned int cls;
+
+
+	for (cls = 0; cls < BUFPOOL_CLASSES; cls++)
+		if (size <= CLASS_SIZE (cls) - sizeof (buf_header))
+			break;
+
+	return cls;
+}
+
+
+static size_t
+round_page (size_t size)
+{
+	long page = sysconf (_SC_PAGESIZE);
+
+	if (page <= 0)
+		page = 4096;
+
+	return (size + page - 1) / page * page;
+}
+
+
+static buf_header *
+map_buffer (size_t length)
+{
+	void *ptr = MAP_FAILED;
+
+
+#if defined(MAP_HUGETLB)
+	if (pool.pages == BUFPOOL_PAGES_HUGETLB &&
+	    length % BUFPOOL_HUGE_PAGE == 0)
+	{
+		ptr = mmap (NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (ptr == MAP_FAILED &&
+		    __atomic_exchange_n (&pool.hugetlb_failed, 1,
+			__ATOMIC_RELAXED) == 0)
+		{
+			warn ("bufpool: no huge pages (vm.nr_hugepages?), "
+				"using regular ones\n");
+		}
+	}
+#endif
+
+	if (ptr == MAP_FAILED) {
+		ptr = mmap (NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (ptr == MAP_FAILED) {
+			error ("bufpool: failed to map %zu bytes\n", length);
+			return NULL;
+		}
+
+#if defined(MADV_HUGEPAGE)
+		/* only aligned 2 MiB extents can be huge pages */
+		if (pool.pages != BUFPOOL_PAGES_DEFAULT &&
+		    length >= BUFPOOL_HUGE_PAGE)
+		{
+			(void) madvise (ptr, length, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+	return ptr;
+}
+
+
+/* idle buffers accounting, see budget.c */
+static void
+idle_add (size_t bytes)
+{
+	xms_atomic_add (&pool.idle_bytes, bytes);
+	budget_charge (BUDGET_BUFFERS, bytes);
+}
+
+
+static void
+idle_sub (size_t bytes)
+{
+	xms_atomic_sub (&pool.idle_bytes, bytes);
+	budget_uncharge (BUDGET_BUFFERS, bytes);
+}
+
+
+/* budget_evict_cb: the largest buffers go first */
+static size_t
+trim_idle (size_t bytes)
+{
+	size_t freed = 0;
+	unsigned int cls = BUFPOOL_CLASSES;
+	void *b;
+
+
+	while (cls-- > 0 && freed < bytes) {
+		if (pool.idle[cls] == NULL)
+			continue;
+
+		while (freed < bytes && mpmc_pop (pool.idle[cls], &b)) {
+			idle_sub (CLASS_SIZE (cls));
+			(void) munmap (b, CLASS_SIZE (cls));
+			freed += CLASS_SIZE (cls);
+		}
+	}
+
+	return freed;
+}
+
+
+extern void
+init_bufpool (enum bufpool_pages pages)
+{
+	unsigned int cls;
+	size_t idle;
+
+
+	pool.pages = pages;
+
+	for (cls = 0; cls < BUFPOOL_CLASSES; cls++) {
+		idle = BUFPOOL_CLASS_IDLE / CLASS_SIZE (cls);
+
+		if (idle == 0)
+			idle = 1;
+		else if (idle > BUFPOOL_MAX_IDLE)
+			idle = BUFPOOL_MAX_IDLE;
+
+		pool.idle[cls] = mpmc_new (idle);
+
+		if (pool.idle[cls] == NULL)
+			die ("failed to initialize buffer pool\n");
+	}
+
+	budget_register (BUDGET_BUFFERS, trim_idle);
+}
+
+
+extern void
+free_bufpool (void)
+{
+	unsigned int cls;
+	void *b;
+
+
+	for (cls = 0; cls < BUFPOOL_CLASSES; cls++) {
+		if (pool.idle[cls] == NULL)
+			continue;
+
+		while (mpmc_pop (pool.idle[cls], &b)) {
+			idle_sub (CLASS_SIZE (cls));
+			(void) munmap (b, CLASS_SIZE (cls));
+		}
+
+		mpmc_destroy (pool.idle[cls]);
+		pool.idle[cls] = NULL;
+	}
+}
+
+
+extern void *
+bufpool_alloc (size_t size)
+{
+	buf_header *b;
+	unsigned int cls;
+	size_t length;
+	void *e;
+
+
+	if (size == 0 || size > SIZE_MAX / 2)
+		return NULL;
+
+	cls = class_for (size);
+
+	if (cls < BUFPOOL_CLASSES && pool.idle[cls] != NULL &&
+	    mpmc_pop (pool.idle[cls], &e))
+	{
+		b = e;
+		idle_sub (b->h.length);
+		xms_atomic_inc (&pool.hits);
+
+		return b + 1;
+	}
+
+	if (cls < BUFPOOL_CLASSES)
+		length = CLASS_SIZE (cls);
+	else
+		length = round_page (sizeof (buf_header) + size);
+
+	b = map_buffer (length);
+
+	if (b == NULL)
+		return NULL;
+
+	b->h.length = length;
+	b->h.cls = cls;
+	xms_atomic_inc (&pool.misses);
+
+	return b + 1;
+}
+
+
+extern void *
+bufpool_realloc (void *ptr, size_t size)
+{
+	void *larger;
+
+
+	if (ptr == NULL)
+		return bufpool_alloc (size);
+
+	if (size <= bufpool_capacity (ptr))
+		return ptr;
+
+	larger = bufpool_alloc (size);
+
+	/* like realloc (), the old buffer is still valid */
+	if (larger == NULL)
+		return NULL;
+
+	memcpy (larger, ptr, bufpool_capacity (ptr));
+	bufpool_free (ptr);
+
+	return larger;
+}
+
+
+extern void
+bufpool_free (void *ptr)
+{
+	buf_header *b;
+	unsigned int cls;
+
+
+	if (ptr == NULL)
+		return;
+
+	b = (buf_header *) ptr - 1;
+	cls = b->h.cls;
+
+	if (cls < BUFPOOL_CLASSES && pool.idle[cls] != NULL) {
+		/* counted first, so bufpool_alloc () never goes below 0 */
+		idle_add (b->h.length);
+
+		if (mpmc_push (pool.idle[cls], b))
+			return;
+
+		idle_sub (b->h.length);
+	}
+
+	(void) munmap (b, b->h.length);
+}
+
+
+extern size_t
+bufpool_capacity (const void *ptr)
+{
+	const buf_header *b = (const buf_header *) ptr - 1;
+
+	return b->h.length - sizeof (*b);
+}
+
+
+extern bool
+bufpool_parse_pages (const char *name, enum bufpool_pages *pages)
+{
+	if (strcmp (name, "thp") == 0)
+		*pages = BUFPOOL_PAGES_THP;
+	else if (strcmp (name, "hugetlb") == 0)
+		*pages = BUFPOOL_PAGES_HUGETLB;
+	else
+		return false;
+
+	return true;
+}
+
+
+extern void
+bufpool_stats (xms_bufpool_stats *stats)
+{
+	stats->hits = xms_atomic_load (&pool.hits);
+	stats->misses = xms_atomic_load (&pool.misses);
+	stats->idle_bytes = xms_atomic_load (&pool.idle_bytes);
+}
@@ -0,0 +1,63 @@
+#ifndef XMS_BUFPOOL_H
+#define XMS_BUFPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frame-sized buffers: uploads and encoded frames. A buffer is mapped
+ * once and recycled through a free list of its size class (powers of
+ * two, 64 KiB .. 64 MiB), so a steady stream of frames does not map,
+ * unmap & fault in pages for every frame. Larger buffers are mapped
+ * and unmapped as is.
+ */
+
+/* how buffers of 2 MiB and more are backed */
+enum bufpool_pages {
+	BUFPOOL_PAGES_DEFAULT = 0,	/* regular pages */
+	BUFPOOL_PAGES_THP,		/* madvise (MADV_HUGEPAGE) */
+	BUFPOOL_PAGES_HUGETLB		/* MAP_HUGETLB, THP if there are none */
+};
+
+/* cumulative counters */
+typedef struct _xms_bufpool_stats {
+	/* allocations served from a free list / by a new mapping */
+	uint64_t hits;
+	uint64_t misses;
+
+	/* bytes of buffers in free lists */
+	uint64_t idle_bytes;
+} xms_bufpool_stats;
+
+
+extern void
+init_bufpool (enum bufpool_pages pages);
+
+/* unmaps idle buffers, buffers in use are still valid */
+extern void
+free_bufpool (void);
+
+/* NULL on failure or if `size' is 0 */
+extern void *
+bufpool_alloc (size_t size);
+
+/* keeps the buffer if it is large enough, `ptr' may be NULL */
+extern void *
+bufpool_realloc (void *ptr, size_t size);
+
+/* `ptr' may be NULL */
+extern void
+bufpool_free (void *ptr);
+
+/* usable bytes of the buffer, at least the size it was allocated for */
+extern size_t
+bufpool_capacity (const void *ptr);
+
+extern bool
+bufpool_parse_pages (const char *name, enum bufpool_pages *pages);
+
+extern void
+bufpool_stats (xms_bufpool_stats *stats);
+
+#endif /* XMS_BUFPOOL_H */
@@ -0,0 +1,170 @@
+#include "capture.h"
+#include "atomics.h"
+#include "clock.h"
+#include "common.h"
+#include "mutex.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Records go through stdio under a mutex: capturing is meant for
+ * profiling sessions, not for production. The file is flushed at
+ * the end of every upload.
+ */
+static struct {
+	FILE *fh;
+	SIMPLE_MUTEX *mutex;
+
+	/* the last upload id */
+	uint64_t uploads;
+
+	/* a write has failed, nothing is written anymore */
+	bool failed;
+} cap;
+
+
+/* ------------------------------------------------------------------ */
+
+
+/* must be called with the mutex held */
+static void
+write_record (uint64_t id, uint64_t timestamp, enum capture_type type,
+              const void *data, size_t len)
+{
+	xms_capture_record rec;
+
+
+	if (cap.failed)
+		return;
+
+	memset (&rec, 0, sizeof (rec));
+	rec.id = id;
+	rec.timestamp = timestamp;
+	rec.type = type;
+	rec.length = len;
+
+	if (fwrite (&rec, sizeof (rec), 1, cap.fh) != 1 ||
+	    (len > 0 && fwrite (data, 1, len, cap.fh) != len) ||
+	    (type != CAPTURE_DATA && fflush (cap.fh) != 0))
+	{
+		error ("capture: write: %s\n", strerror (errno));
+		cap.failed = true;
+	}
+}
+
+
+extern void
+init_capture (const char *path)
+{
+	xms_capture_header hdr;
+
+
+	cap.mutex = simple_mutex_create ();
+
+	if (cap.mutex == NULL)
+		die ("failed to initialize capture\n");
+
+	simple_mutex_init (cap.mutex);
+	cap.uploads = 0;
+	cap.failed = false;
+
+	cap.fh = fopen (path, "wb");
+
+	if (cap.fh == NULL)
+		die ("failed to open capture `%s': %s\n", path, strerror (errno));
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, CAPTURE_MAGIC, sizeof (CAPTURE_MAGIC));
+	hdr.version = CAPTURE_VERSION;
+	hdr.record_size = sizeof (xms_capture_record);
+
+	if (fwrite (&hdr, sizeof (hdr), 1, cap.fh) != 1 || fflush (cap.fh) != 0)
+		die ("failed to write capture `%s': %s\n", path, strerror (errno));
+}
+
+
+extern void
+free_capture (void)
+{
+	if (cap.fh == NULL)
+		return;
+
+	simple_mutex_lock (cap.mutex);
+
+	if (fclose (cap.fh) != 0)
+		warn ("capture: close: %s\n", strerror (errno));
+
+	xms_atomic_store (&cap.fh, NULL);
+	simple_mutex_unlock (cap.mutex);
+
+	simple_mutex_destroy (cap.mutex);
+	free (cap.mutex);
+	cap.mutex = NULL;
+}
+
+
+extern bool
+capture_enabled (void)
+{
+	return xms_atomic_load (&cap.fh) != NULL;
+}
+
+
+extern uint64_t
+capture_begin (uint64_t timestamp, const char *head, size_t len)
+{
+	uint64_t id;
+
+
+	if (!capture_enabled ())
+		return 0;
+
+	id = xms_atomic_inc (&cap.uploads);
+
+	simple_mutex_lock (cap.mutex);
+	write_record (id, timestamp, CAPTURE_BEGIN, head, len);
+	simple_mutex_unlock (cap.mutex);
+
+	return id;
+}
+
+
+extern void
+capture_data (uint64_t id, const char *data, size_t size)
+{
+	uint64_t now;
+	size_t len;
+
+
+	if (id == 0 || !capture_enabled ())
+		return;
+
+	now = clock_usec (CLOCK_REALTIME);
+
+	simple_mutex_lock (cap.mutex);
+
+	do {
+		len = (size > UINT32_MAX) ? UINT32_MAX : size;
+		write_record (id, now, CAPTURE_DATA, data, len);
+		data += len;
+		size -= len;
+	} while (size > 0);
+
+	simple_mutex_unlock (cap.mutex);
+}
+
+
+extern void
+capture_end (uint64_t id, bool complete)
+{
+	if (id == 0 || !capture_enabled ())
+		return;
+
+	simple_mutex_lock (cap.mutex);
+	write_record (id, clock_usec (CLOCK_REALTIME), complete ? CAPTURE_END : CAPTURE_ABORT,
+		NULL, 0);
+	simple_mutex_unlock (cap.mutex);
+}
@@ -0,0 +1,76 @@
+#ifndef XMS_CAPTURE_H
+#define XMS_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An upload capture is a header followed by records, each one is
+ * followed by `length' bytes. All numbers are stored in the host byte
+ * order, see bench/xms-replay.c for a reader.
+ *
+ * Concurrent uploads (e.g. ones rejected while another one is being
+ * received) interleave, their records are told apart by an id. An
+ * upload is:
+ *
+ *   CAPTURE_BEGIN   the request head as received: a request line and
+ *                   header lines, CRLF terminated, an empty line last
+ *   CAPTURE_DATA    a piece of the raw body (a multipart form), zero
+ *                   or more of them
+ *   CAPTURE_END     the body is complete, or CAPTURE_ABORT if the
+ *                   connection has gone before
+ */
+
+#define CAPTURE_MAGIC		"XMSCAPT"
+#define CAPTURE_VERSION		1
+
+typedef struct _xms_capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} xms_capture_header;
+
+enum capture_type {
+	CAPTURE_BEGIN = 1,
+	CAPTURE_DATA,
+	CAPTURE_END,
+	CAPTURE_ABORT
+};
+
+typedef struct _xms_capture_record {
+	/* an upload, numbered from 1 */
+	uint64_t id;
+
+	/* microseconds since the Epoch, CAPTURE_BEGIN: the arrival */
+	uint64_t timestamp;
+
+	/* enum capture_type */
+	uint32_t type;
+
+	/* bytes which follow the record */
+	uint32_t length;
+} xms_capture_record;
+
+
+extern void
+init_capture (const char *path);
+
+extern void
+free_capture (void);
+
+extern bool
+capture_enabled (void);
+
+/* starts an upload which has arrived at `timestamp', returns its id */
+extern uint64_t
+capture_begin (uint64_t timestamp, const char *head, size_t len);
+
+extern void
+capture_data (uint64_t id, const char *data, size_t size);
+
+/* `complete' is false if the upload has been cut short */
+extern void
+capture_end (uint64_t id, bool complete);
+
+#endif /* XMS_CAPTURE_H */
@@ -0,0 +1,12 @@
+#include "clock.h"
+
+
+extern uint64_t
+clock_usec (clockid_t clock)
+{
+	struct timespec tp;
+
+	(void) clock_gettime (clock, &tp);
+
+	return (uint64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
@@ -0,0 +1,15 @@
+#ifndef XMS_CLOCK_H
+#define XMS_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Microseconds of the given clock: CLOCK_REALTIME for timestamps
+ * which leave the process (since the Epoch), CLOCK_MONOTONIC for
+ * intervals.
+ */
+extern uint64_t
+clock_usec (clockid_t clock);
+
+#endif /* XMS_CLOCK_H */
@@ -1,24 +1,47 @@
 #ifndef XMS_CONTEXTS_H
 #define XMS_CONTEXTS_H
 
+#include "accesslog.h"
+#include "arena.h"
+#include "frames.h"
 #include "mhd.h"
 #include <stdbool.h>
+#include <stdint.h>
 
+/* see suspend.h */
+struct _suspend_entry;
 
 enum request_type {
 	GET 	= 0,
 	POST	= 1
 };
 
+/* GET: what a client is asking for */
+enum get_resource {
+	RES_DEFAULT	= 0,	/* the default page */
+	RES_FILE,		/* /get.jpg */
+	RES_FRAME,		/* /frame/<seq>.jpg */
+	RES_FRAMES,		/* /frames */
+	RES_PLAYBACK,		/* /playback?from=&to=&fps= */
+	RES_STREAM,		/* /stream */
+	RES_MEMORY,		/* /memory */
+	RES_METRICS		/* /metrics */
+};
+
 typedef struct _request_ctx {
+	/* request-scoped memory, the context itself lives here too */
+	xms_arena *arena;
+
 	/* Request type: GET, POST, etc */
 	enum request_type type;
 
 	/* POST: Handle to the POST processing state. */
 	struct MHD_PostProcessor *pp;
 
-	/* File handle to write uploaded data. */
-	FILE *fh;
+	/* POST: uploaded data, handed over to the pipeline (pipeline.c) */
+	unsigned char *upload;
+	size_t upload_size;
+	size_t upload_alloc;
 
 	/* HTTP response body we will return, NULL if not yet known. */
 	struct MHD_Response *response;
@@ -29,8 +52,43 @@ typedef struct _request_ctx {
 	/* POST: Is this request current uploader */
 	bool uploader;
 
-	/* GET: a client asking for our datafile */
-	bool getfile;
+	/* POST: an owner token of the upload slot, see slot.c */
+	uint32_t token;
+
+	/* POST: a handle of the parked connection, see suspend.c */
+	struct _suspend_entry *park;
+
+	/* POST: capture & receive stamps of the upload, see trace.h */
+	xms_frame_trace trace;
+
+	/* POST: an upload id in the capture (capture.c), 0 if none */
+	uint64_t capture_id;
+
+	/* GET: a resource requested by a client */
+	enum get_resource resource;
+
+	/* GET: a frame sequence number for RES_FRAME */
+	uint64_t frame_seq;
+
+	/* access log: enum access_method */
+	uint8_t method;
+
+	/* access log: the request start, realtime & monotonic (usec) */
+	uint64_t started;
+	uint64_t begin;
+
+	/* access log: the end of the last stage, monotonic (usec) */
+	uint64_t mark;
+
+	/* access log: durations of upload stages (usec) */
+	uint32_t stage[ACCESS_STAGES];
+
+	/* access log: body sizes, bytes_out is 0 for streams */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+
+	/* access log: HTTP status code we have returned */
+	unsigned int sent_status;
 } request_ctx;
 
 #endif /* XMS_CONTEXTS_H */
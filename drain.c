@@ -0,0 +1,84 @@
+#include "drain.h"
+#include "atomics.h"
+#include <pthread.h>
+#include <time.h>
+
+
+static unsigned int inflight;
+static int draining;
+
+/* drain_wait () sleeps here until `inflight' drops to zero */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+
+
+/* ------------------------------------------------------------------ */
+
+
+extern void
+drain_enter (void)
+{
+	xms_atomic_inc (&inflight);
+}
+
+
+extern void
+drain_leave (void)
+{
+	/*
+	 * seq_cst pairs with drain_start (): either we see `draining',
+	 * or drain_wait () sees the new `inflight'
+	 */
+	if (__atomic_sub_fetch (&inflight, 1, __ATOMIC_SEQ_CST) == 0 &&
+		__atomic_load_n (&draining, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock (&mutex);
+		pthread_cond_broadcast (&drained);
+		pthread_mutex_unlock (&mutex);
+	}
+}
+
+
+extern void
+drain_start (void)
+{
+	__atomic_store_n (&draining, 1, __ATOMIC_SEQ_CST);
+}
+
+
+extern bool
+drain_active (void)
+{
+	return xms_atomic_load (&draining) != 0;
+}
+
+
+extern bool
+drain_wait (unsigned int timeout)
+{
+	struct timespec ts;
+	bool done;
+
+
+	(void) clock_gettime (CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout;
+
+	pthread_mutex_lock (&mutex);
+
+	while (__atomic_load_n (&inflight, __ATOMIC_SEQ_CST) > 0) {
+		if (pthread_cond_timedwait (&drained, &mutex, &ts) != 0)
+			break;
+	}
+
+	done = __atomic_load_n (&inflight, __ATOMIC_SEQ_CST) == 0;
+	pthread_mutex_unlock (&mutex);
+
+	return done;
+}
+
+
+extern unsigned int
+drain_inflight (void)
+{
+	return xms_atomic_load (&inflight);
+}
@@ -0,0 +1,36 @@
+#ifndef XMS_DRAIN_H
+#define XMS_DRAIN_H
+
+#include <stdbool.h>
+
+
+/*
+ * Graceful shutdown: requests in flight are counted between answer_cb ()
+ * and request_completed_cb (), drain_wait () returns as soon as the last
+ * one has completed, so there is no need to sleep "long enough".
+ */
+
+/* a request has started */
+extern void
+drain_enter (void);
+
+/* a request has completed */
+extern void
+drain_leave (void);
+
+/* from now on new uploads are refused, see drain_active () */
+extern void
+drain_start (void);
+
+extern bool
+drain_active (void);
+
+/* waits up to `timeout' seconds, returns false if requests are left */
+extern bool
+drain_wait (unsigned int timeout);
+
+/* an amount of requests in flight */
+extern unsigned int
+drain_inflight (void);
+
+#endif /* XMS_DRAIN_H */
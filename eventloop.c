@@ -0,0 +1,361 @@
+#include "eventloop.h"
+#include "common.h"
+#include "drain.h"
+#include "pipeline.h"
+#include "suspend.h"
+#if defined(__linux__)
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+
+/* the TCP & the Unix socket daemons (main.c) */
+#define EVENTLOOP_DAEMONS 2
+/* events per epoll_wait () */
+#define EVENTLOOP_EVENTS 16
+/* how often parked uploaders are checked (sec) */
+#define EVENTLOOP_PARK_INTERVAL 1
+
+
+#if defined(__linux__)
+
+/* epoll_event.data of our sources */
+enum {
+	SOURCE_DAEMON = 0,
+	SOURCE_SIGNAL,
+	SOURCE_NOTIFY,
+	SOURCE_MHD_TIMER,
+	SOURCE_PARK_TIMER
+};
+
+static struct {
+	int epfd;
+	int sigfd;
+	int notifyfd;
+
+	/* the nearest MHD timeout, one-shot */
+	int mhd_timer;
+
+	/* parked uploaders, periodic */
+	int park_timer;
+	unsigned int park_timeout;
+
+	struct MHD_Daemon *daemons[EVENTLOOP_DAEMONS];
+	unsigned int ndaemons;
+
+	/* SIGINT or SIGTERM has been received */
+	bool stop;
+} loop = { -1, -1, -1, -1, -1, 0, { NULL, NULL }, 0, false };
+
+
+/* ------------------------------------------------------------------ */
+
+
+static void
+watch (int fd, uint32_t source)
+{
+	struct epoll_event ev;
+
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = source;
+
+	if (epoll_ctl (loop.epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		die ("event loop: epoll_ctl: %s\n", strerror (errno));
+}
+
+
+/* reads a counter of eventfd/timerfd, the value does not matter */
+static void
+consume (int fd)
+{
+	uint64_t value;
+
+	while (read (fd, &value, sizeof (value)) == sizeof (value))
+		;
+}
+
+
+static void
+arm_mhd_timer (void)
+{
+	struct itimerspec its;
+	MHD_UNSIGNED_LONG_LONG timeout, nearest = 0;
+	bool armed = false;
+	unsigned int i;
+
+
+	for (i = 0; i < loop.ndaemons; i++)
+		if (MHD_get_timeout (loop.daemons[i], &timeout) == MHD_YES &&
+		    (!armed || timeout < nearest))
+		{
+			nearest = timeout;
+			armed = true;
+		}
+
+	/* all zeros disarms the timer */
+	memset (&its, 0, sizeof (its));
+
+	if (armed) {
+		its.it_value.tv_sec = nearest / 1000;
+		its.it_value.tv_nsec = (nearest % 1000) * 1000000;
+
+		/* already due */
+		if (nearest == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	(void) timerfd_settime (loop.mhd_timer, 0, &its, NULL);
+}
+
+
+static void
+dispatch (const struct epoll_event *events, int n)
+{
+	struct signalfd_siginfo si;
+	unsigned int i;
+
+
+	for (i = 0; i < (unsigned int) n; i++) {
+		switch (events[i].data.u32) {
+		case SOURCE_SIGNAL:
+			while (read (loop.sigfd, &si, sizeof (si)) == sizeof (si))
+				loop.stop = true;
+			break;
+		case SOURCE_NOTIFY:
+			/* converted frames are published & viewers resumed */
+			consume (loop.notifyfd);
+			pipeline_publish_pending ();
+			break;
+		case SOURCE_MHD_TIMER:
+			consume (loop.mhd_timer);
+			break;
+		case SOURCE_PARK_TIMER:
+			consume (loop.park_timer);
+			resume_expired (loop.park_timeout);
+			break;
+		default: /* SOURCE_DAEMON: see below */
+			break;
+		}
+	}
+
+	/* resumed connections are processed here too */
+	for (i = 0; i < loop.ndaemons; i++)
+		(void) MHD_run (loop.daemons[i]);
+}
+
+
+/* `timeout' is in milliseconds, -1 waits forever */
+static void
+iterate (int timeout)
+{
+	struct epoll_event events[EVENTLOOP_EVENTS];
+	int n;
+
+
+	arm_mhd_timer ();
+
+	n = epoll_wait (loop.epfd, events, EVENTLOOP_EVENTS, timeout);
+
+	if (n < 0) {
+		if (errno != EINTR)
+			die ("event loop: epoll_wait: %s\n", strerror (errno));
+		return;
+	}
+
+	dispatch (events, n);
+}
+
+
+extern void
+init_eventloop (unsigned int park_timeout)
+{
+	sigset_t mask;
+	struct itimerspec its;
+
+
+	loop.epfd = epoll_create1 (EPOLL_CLOEXEC);
+
+	if (loop.epfd == -1)
+		die ("event loop: epoll_create1: %s\n", strerror (errno));
+
+	/* SIGINT & SIGTERM are blocked by main () */
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGINT);
+	sigaddset (&mask, SIGTERM);
+
+	loop.sigfd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	loop.notifyfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	loop.mhd_timer = timerfd_create (CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC);
+	loop.park_timer = timerfd_create (CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (loop.sigfd == -1 || loop.notifyfd == -1 ||
+	    loop.mhd_timer == -1 || loop.park_timer == -1)
+	{
+		die ("event loop: %s\n", strerror (errno));
+	}
+
+	watch (loop.sigfd, SOURCE_SIGNAL);
+	watch (loop.notifyfd, SOURCE_NOTIFY);
+	watch (loop.mhd_timer, SOURCE_MHD_TIMER);
+	watch (loop.park_timer, SOURCE_PARK_TIMER);
+
+	loop.park_timeout = park_timeout;
+
+	if (park_timeout > 0) {
+		memset (&its, 0, sizeof (its));
+		its.it_value.tv_sec = EVENTLOOP_PARK_INTERVAL;
+		its.it_interval.tv_sec = EVENTLOOP_PARK_INTERVAL;
+
+		if (timerfd_settime (loop.park_timer, 0, &its, NULL) != 0)
+			die ("event loop: timerfd_settime: %s\n",
+				strerror (errno));
+	}
+}
+
+
+extern void
+free_eventloop (void)
+{
+	int *fds[] = {
+		&loop.park_timer,
+		&loop.mhd_timer,
+		&loop.notifyfd,
+		&loop.sigfd,
+		&loop.epfd
+	};
+	unsigned int i;
+
+
+	for (i = 0; i < sizeof (fds) / sizeof (fds[0]); i++)
+		if (*fds[i] != -1) {
+			(void) close (*fds[i]);
+			*fds[i] = -1;
+		}
+
+	loop.ndaemons = 0;
+}
+
+
+extern void
+eventloop_add (struct MHD_Daemon *daemon)
+{
+	const union MHD_DaemonInfo *info;
+
+
+	if (loop.ndaemons == EVENTLOOP_DAEMONS)
+		die ("event loop: too many daemons\n");
+
+	info = MHD_get_daemon_info (daemon,
+		MHD_DAEMON_INFO_EPOLL_FD_LINUX_ONLY);
+
+	if (info == NULL)
+		die ("event loop: the daemon has no epoll fd\n");
+
+	watch (info->epoll_fd, SOURCE_DAEMON);
+	loop.daemons[loop.ndaemons++] = daemon;
+}
+
+
+extern void
+eventloop_notify (void)
+{
+	uint64_t one = 1;
+	ssize_t n;
+
+
+	/* EAGAIN: the loop has not read the counter yet, that is enough */
+	n = write (loop.notifyfd, &one, sizeof (one));
+	(void) n;
+}
+
+
+extern void
+eventloop_run (void)
+{
+	loop.stop = false;
+
+	while (!loop.stop)
+		iterate (-1);
+}
+
+
+extern bool
+eventloop_drain (unsigned int timeout)
+{
+	struct timespec now;
+	time_t deadline;
+	long left;
+
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &now);
+	deadline = now.tv_sec + timeout;
+
+	while (drain_inflight () > 0) {
+		(void) clock_gettime (CLOCK_MONOTONIC, &now);
+		left = (deadline - now.tv_sec) * 1000 - now.tv_nsec / 1000000;
+
+		if (left <= 0)
+			return false;
+
+		iterate ((int) left);
+	}
+
+	return true;
+}
+
+#else /* !__linux__ */
+
+extern void
+init_eventloop (unsigned int park_timeout)
+{
+	(void) park_timeout;
+	die ("event loop: Linux only\n");
+}
+
+
+extern void
+free_eventloop (void)
+{
+}
+
+
+extern void
+eventloop_add (struct MHD_Daemon *daemon)
+{
+	(void) daemon;
+}
+
+
+extern void
+eventloop_notify (void)
+{
+}
+
+
+extern void
+eventloop_run (void)
+{
+}
+
+
+extern bool
+eventloop_drain (unsigned int timeout)
+{
+	(void) timeout;
+
+	return drain_inflight () == 0;
+}
+
+#endif /* __linux__ */
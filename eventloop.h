@@ -0,0 +1,45 @@
+#ifndef XMS_EVENTLOOP_H
+#define XMS_EVENTLOOP_H
+
+#include "mhd.h"
+#include <stdbool.h>
+
+/*
+ * The server-owned event loop (-X, Linux only). MHD daemons run without
+ * internal threads, their epoll fds are polled by the main thread along
+ * with an eventfd of the pipeline (pipeline_publish_pending ()), timerfds
+ * of MHD & parked uploader timeouts and a signalfd of SIGINT & SIGTERM.
+ * So every MHD callback, publishing & resuming happen on one thread.
+ */
+
+
+/*
+ * Must be called after SIGINT & SIGTERM are blocked. Parked uploaders
+ * are answered 503 after `park_timeout' seconds, 0 disables it.
+ */
+extern void
+init_eventloop (unsigned int park_timeout);
+
+extern void
+free_eventloop (void);
+
+/* the daemon must be started with MHD_USE_EPOLL & no internal threads */
+extern void
+eventloop_add (struct MHD_Daemon *daemon);
+
+/* wakes the loop up to publish frames, it is a pipeline_notify_cb */
+extern void
+eventloop_notify (void);
+
+/* runs daemons until SIGINT or SIGTERM */
+extern void
+eventloop_run (void);
+
+/*
+ * Runs daemons until requests in flight are completed (drain.c), waits
+ * up to `timeout' seconds, returns false if requests are left.
+ */
+extern bool
+eventloop_drain (unsigned int timeout);
+
+#endif /* XMS_EVENTLOOP_H */
@@ -0,0 +1,602 @@
+#include "frames.h"
+#include "affinity.h"
+#include "atomics.h"
+#include "budget.h"
+#include "bufpool.h"
+#include "clock.h"
+#include "common.h"
+#include "imagemagick.h"
+#include "metrics.h"
+#include "mutex.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * The ring keeps the last `max_frames' published frames, but no more
+ * than `max_bytes' of encoded data. The newest frame is never evicted.
+ * Frames in the ring always have consecutive sequence numbers, thus
+ * a lookup by a sequence number is O(1).
+ */
+static struct {
+	xms_frame **slots;
+	size_t capacity;
+	size_t head;		/* index of the oldest frame */
+	size_t count;
+	size_t bytes;
+	size_t max_bytes;
+	uint64_t next_seq;
+	SIMPLE_MUTEX *mutex;
+} ring;
+
+
+/* JPEG quality and scale (percents) of each tier */
+static const struct {
+	unsigned int quality;
+	unsigned int scale;
+} tiers[FRAME_TIERS] = {
+	{  0, 100 },	/* the original frame */
+	{ 60,  75 },
+	{ 40,  50 }
+};
+
+/* markers of variant slots: being encoded, failed to encode */
+static xms_frame variant_busy;
+static xms_frame variant_failed;
+
+#define IS_VARIANT(v) \
+	((v) != NULL && (v) != &variant_busy && (v) != &variant_failed)
+
+/*
+ * Variants may be evicted (budget.c) while the frame is alive, so
+ * a variant is referenced by readers & dropped under this mutex.
+ */
+static SIMPLE_MUTEX *variants_mutex;
+
+/* max. amount of variants waiting to be encoded */
+#define VARIANT_QUEUE 16
+
+/*
+ * Variants are requested by viewers, i.e. on network threads, but
+ * encoded by a worker pinned to the `conv' CPUs. The queue holds
+ * a reference to each frame until its variant is done.
+ */
+static struct {
+	struct {
+		xms_frame *frame;
+		unsigned int tier;
+	} jobs[VARIANT_QUEUE];
+	size_t head;
+	size_t count;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool running;
+	bool stop;
+} encoder = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+static void *encoder_main (void *arg);
+static size_t evict_variants (size_t bytes);
+static size_t evict_frames (size_t bytes);
+
+
+/* ------------------------------------------------------------------ */
+
+
+extern void
+init_frames (size_t max_frames, size_t max_bytes)
+{
+	if (max_frames == 0)
+		max_frames = 1;
+
+	ring.slots = calloc (max_frames, sizeof (*ring.slots));
+
+	if (ring.slots == NULL)
+		die ("failed to initialize frames ring\n");
+
+	ring.capacity = max_frames;
+	ring.head = 0;
+	ring.count = 0;
+	ring.bytes = 0;
+	ring.max_bytes = max_bytes;
+	ring.next_seq = 1;
+	ring.mutex = simple_mutex_create ();
+	simple_mutex_init (ring.mutex);
+	variants_mutex = simple_mutex_create ();
+	simple_mutex_init (variants_mutex);
+
+	budget_register (BUDGET_VARIANTS, evict_variants);
+	budget_register (BUDGET_FRAMES, evict_frames);
+
+	encoder.head = 0;
+	encoder.count = 0;
+	encoder.stop = false;
+
+	/* without the worker viewers get the original frames */
+	if (pthread_create (&encoder.thread, NULL, encoder_main, NULL) == 0)
+		encoder.running = true;
+	else
+		error ("failed to start the variant encoder\n");
+}
+
+
+extern void
+free_frames (void)
+{
+	size_t i;
+
+
+	if (ring.slots == NULL)
+		return;
+
+	if (encoder.running) {
+		pthread_mutex_lock (&encoder.mutex);
+		encoder.stop = true;
+		pthread_cond_signal (&encoder.cond);
+		pthread_mutex_unlock (&encoder.mutex);
+
+		(void) pthread_join (encoder.thread, NULL);
+		encoder.running = false;
+	}
+
+	/* requests the worker has not got to */
+	for (i = 0; i < encoder.count; i++)
+		frame_unref (encoder.jobs[(encoder.head + i) % VARIANT_QUEUE].frame);
+
+	encoder.count = 0;
+
+	for (i = 0; i < ring.count; i++)
+		frame_unref (ring.slots[(ring.head + i) % ring.capacity]);
+
+	budget_uncharge (BUDGET_FRAMES, ring.bytes);
+	free (ring.slots);
+	ring.slots = NULL;
+	ring.count = 0;
+
+	simple_mutex_destroy (ring.mutex);
+	free (ring.mutex);
+	simple_mutex_destroy (variants_mutex);
+	free (variants_mutex);
+}
+
+
+extern xms_frame *
+frame_new (size_t size)
+{
+	xms_frame *frame = malloc (sizeof (*frame));
+
+	if (frame == NULL)
+		return NULL;
+
+	frame->data = bufpool_alloc (size);
+
+	if (frame->data == NULL && size > 0) {
+		free (frame);
+		return NULL;
+	}
+
+	frame->seq = 0;
+	frame->timestamp = 0;
+	memset (&frame->trace, 0, sizeof (frame->trace));
+	frame->size = size;
+	frame->refcount = 1;
+	frame->served = 0;
+	memset (frame->variant, 0, sizeof (frame->variant));
+
+	return frame;
+}
+
+
+extern xms_frame *
+frame_ref (xms_frame *frame)
+{
+	if (frame != NULL)
+		xms_atomic_inc (&frame->refcount);
+
+	return frame;
+}
+
+
+extern void
+frame_unref (xms_frame *frame)
+{
+	unsigned int i;
+
+
+	if (frame == NULL)
+		return;
+
+	if (xms_atomic_dec (&frame->refcount) == 0) {
+		for (i = 1; i < FRAME_TIERS; i++)
+			if (IS_VARIANT (frame->variant[i])) {
+				budget_uncharge (BUDGET_VARIANTS,
+					frame->variant[i]->size);
+				frame_unref (frame->variant[i]);
+			}
+
+		bufpool_free (frame->data);
+		free (frame);
+	}
+}
+
+
+static xms_frame *
+encode_variant (const xms_frame *frame, unsigned int tier)
+{
+	xms_frame *variant;
+	unsigned char *blob;
+	size_t size;
+
+
+	if (! convert_scaled (frame->data, frame->size,
+		tiers[tier].quality, tiers[tier].scale, &blob, &size))
+	{
+		return NULL;
+	}
+
+	variant = frame_new (size);
+
+	if (variant != NULL) {
+		memcpy (variant->data, blob, size);
+		variant->seq = frame->seq;
+		variant->timestamp = frame->timestamp;
+		variant->trace = frame->trace;
+	}
+
+	convert_free (blob);
+
+	return variant;
+}
+
+
+/* fills the variant slot marked as busy by frame_variant () */
+static void
+store_variant (xms_frame *frame, unsigned int tier)
+{
+	xms_frame *variant;
+
+
+	/* only the queue holds it, nobody is going to see the variant */
+	if (xms_atomic_load (&frame->refcount) == 1) {
+		xms_atomic_store (&frame->variant[tier], NULL);
+		return;
+	}
+
+	variant = encode_variant (frame, tier);
+
+	if (variant == NULL) {
+		xms_atomic_store (&frame->variant[tier], &variant_failed);
+		return;
+	}
+
+	/* the reference of the slot is dropped by frame_unref () */
+	budget_charge (BUDGET_VARIANTS, variant->size);
+	xms_atomic_store (&frame->variant[tier], variant);
+
+	budget_enforce ();
+}
+
+
+static void *
+encoder_main (void *arg)
+{
+	xms_frame *frame;
+	unsigned int tier;
+
+
+	(void) arg;
+	(void) affinity_pin (AFFINITY_CONVERT);
+
+	pthread_mutex_lock (&encoder.mutex);
+
+	for (;;) {
+		while (encoder.count == 0 && !encoder.stop)
+			pthread_cond_wait (&encoder.cond, &encoder.mutex);
+
+		if (encoder.stop)
+			break;
+
+		frame = encoder.jobs[encoder.head].frame;
+		tier = encoder.jobs[encoder.head].tier;
+		encoder.head = (encoder.head + 1) % VARIANT_QUEUE;
+		encoder.count--;
+
+		pthread_mutex_unlock (&encoder.mutex);
+
+		store_variant (frame, tier);
+		frame_unref (frame);
+
+		pthread_mutex_lock (&encoder.mutex);
+	}
+
+	pthread_mutex_unlock (&encoder.mutex);
+
+	return NULL;
+}
+
+
+/* returns false if the queue is full or the worker is not there */
+static bool
+request_variant (xms_frame *frame, unsigned int tier)
+{
+	bool queued = false;
+	size_t i;
+
+
+	pthread_mutex_lock (&encoder.mutex);
+
+	if (encoder.running && !encoder.stop && encoder.count < VARIANT_QUEUE) {
+		i = (encoder.head + encoder.count) % VARIANT_QUEUE;
+		encoder.jobs[i].frame = frame_ref (frame);
+		encoder.jobs[i].tier = tier;
+		encoder.count++;
+		queued = true;
+
+		pthread_cond_signal (&encoder.cond);
+	}
+
+	pthread_mutex_unlock (&encoder.mutex);
+
+	return queued;
+}
+
+
+/* the variant if it is there, the frame itself otherwise */
+static xms_frame *
+variant_ref (xms_frame *frame, unsigned int tier)
+{
+	xms_frame *variant;
+
+
+	simple_mutex_lock (variants_mutex);
+	variant = xms_atomic_load (&frame->variant[tier]);
+	variant = frame_ref (IS_VARIANT (variant) ? variant : frame);
+	simple_mutex_unlock (variants_mutex);
+
+	return variant;
+}
+
+
+extern xms_frame *
+frame_variant (xms_frame *frame, unsigned int tier)
+{
+	xms_frame *expected = NULL;
+
+
+	if (tier == 0 || tier >= FRAME_TIERS)
+		return frame_ref (frame);
+
+	/* only the first caller requests a variant, nobody waits for it */
+	if (__atomic_compare_exchange_n (&frame->variant[tier], &expected,
+		&variant_busy, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+	    !request_variant (frame, tier))
+	{
+		/* a later caller may try again */
+		xms_atomic_store (&frame->variant[tier], NULL);
+	}
+
+	return variant_ref (frame, tier);
+}
+
+
+extern void
+frame_served (xms_frame *frame)
+{
+	uint64_t now;
+
+
+	if (__atomic_exchange_n (&frame->served, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	/* the clock may have been stepped back */
+	now = clock_usec (CLOCK_REALTIME);
+
+	if (now >= frame->timestamp)
+		metrics_observe (METRIC_FIRST_SERVE, now - frame->timestamp);
+
+	if (frame->trace.capture != 0 && now >= frame->trace.capture)
+		metrics_observe (METRIC_CAPTURE_TO_SERVE,
+			now - frame->trace.capture);
+}
+
+
+extern size_t
+frame_variant_size (xms_frame *frame, unsigned int tier)
+{
+	xms_frame *variant;
+	size_t size;
+
+
+	if (tier == 0 || tier >= FRAME_TIERS)
+		return frame->size;
+
+	simple_mutex_lock (variants_mutex);
+	variant = xms_atomic_load (&frame->variant[tier]);
+	size = IS_VARIANT (variant) ? variant->size : 0;
+	simple_mutex_unlock (variants_mutex);
+
+	if (size > 0)
+		return size;
+
+	/* a rough guess: proportional to the area, lower quality halves */
+	return frame->size / 2 * tiers[tier].scale / 100 * tiers[tier].scale / 100;
+}
+
+
+/* must be called with the ring mutex held */
+static void
+evict_oldest (void)
+{
+	xms_frame *frame = ring.slots[ring.head];
+
+	ring.slots[ring.head] = NULL;
+	ring.head = (ring.head + 1) % ring.capacity;
+	ring.count--;
+	ring.bytes -= frame->size;
+	budget_uncharge (BUDGET_FRAMES, frame->size);
+
+	frame_unref (frame);
+}
+
+
+/* budget_evict_cb: the oldest frames go first, variants only */
+static size_t
+evict_variants (size_t bytes)
+{
+	xms_frame *frame, *variant;
+	size_t i, freed = 0;
+	unsigned int tier;
+
+
+	simple_mutex_lock (ring.mutex);
+	simple_mutex_lock (variants_mutex);
+
+	for (i = 0; i < ring.count && freed < bytes; i++) {
+		frame = ring.slots[(ring.head + i) % ring.capacity];
+
+		for (tier = 1; tier < FRAME_TIERS; tier++) {
+			variant = xms_atomic_load (&frame->variant[tier]);
+
+			/* a busy slot is left to its encoder */
+			if (!IS_VARIANT (variant) ||
+			    !__atomic_compare_exchange_n (&frame->variant[tier],
+				&variant, NULL, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				continue;
+			}
+
+			/* encoded again on demand */
+			freed += variant->size;
+			budget_uncharge (BUDGET_VARIANTS, variant->size);
+			frame_unref (variant);
+		}
+	}
+
+	simple_mutex_unlock (variants_mutex);
+	simple_mutex_unlock (ring.mutex);
+
+	return freed;
+}
+
+
+/* budget_evict_cb: the newest frame is never evicted */
+static size_t
+evict_frames (size_t bytes)
+{
+	size_t freed = 0;
+
+
+	simple_mutex_lock (ring.mutex);
+
+	while (ring.count > 1 && freed < bytes) {
+		freed += ring.slots[ring.head]->size;
+		evict_oldest ();
+	}
+
+	simple_mutex_unlock (ring.mutex);
+
+	return freed;
+}
+
+
+extern void
+frames_publish (xms_frame *frame)
+{
+	simple_mutex_lock (ring.mutex);
+
+	frame->seq = ring.next_seq++;
+	frame->timestamp = clock_usec (CLOCK_REALTIME);
+
+	if (ring.count == ring.capacity)
+		evict_oldest ();
+
+	ring.slots[(ring.head + ring.count) % ring.capacity] =
+		frame_ref (frame);
+	ring.count++;
+	ring.bytes += frame->size;
+	budget_charge (BUDGET_FRAMES, frame->size);
+
+	while (ring.count > 1 && ring.bytes > ring.max_bytes)
+		evict_oldest ();
+
+	simple_mutex_unlock (ring.mutex);
+
+	budget_enforce ();
+}
+
+
+extern xms_frame *
+frames_get (uint64_t seq)
+{
+	xms_frame *frame = NULL;
+	uint64_t oldest;
+
+
+	simple_mutex_lock (ring.mutex);
+
+	if (ring.count > 0) {
+		oldest = ring.slots[ring.head]->seq;
+
+		if (seq >= oldest && seq - oldest < ring.count)
+			frame = frame_ref (ring.slots[
+				(ring.head + (seq - oldest)) % ring.capacity]);
+	}
+
+	simple_mutex_unlock (ring.mutex);
+
+	return frame;
+}
+
+
+extern xms_frame *
+frames_latest (void)
+{
+	xms_frame *frame = NULL;
+
+
+	simple_mutex_lock (ring.mutex);
+
+	if (ring.count > 0)
+		frame = frame_ref (ring.slots[
+			(ring.head + ring.count - 1) % ring.capacity]);
+
+	simple_mutex_unlock (ring.mutex);
+
+	return frame;
+}
+
+
+extern size_t
+frames_capacity (void)
+{
+	return ring.capacity;
+}
+
+
+extern size_t
+frames_list (xms_frame_info *list, size_t max)
+{
+	size_t i;
+	xms_frame *frame;
+
+
+	simple_mutex_lock (ring.mutex);
+
+	for (i = 0; i < ring.count && i < max; i++) {
+		frame = ring.slots[(ring.head + i) % ring.capacity];
+		list[i].seq = frame->seq;
+		list[i].timestamp = frame->timestamp;
+		list[i].size = frame->size;
+	}
+
+	simple_mutex_unlock (ring.mutex);
+
+	return i;
+}
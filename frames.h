@@ -0,0 +1,116 @@
+#ifndef XMS_FRAMES_H
+#define XMS_FRAMES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* quality tiers of a frame, the tier 0 is the original frame */
+#define FRAME_TIERS 3
+
+/* stages of a frame, microseconds since the Epoch, see trace.h */
+typedef struct _xms_frame_trace {
+	/* X-Capture-Time of the upload, 0 if not given */
+	uint64_t capture;
+
+	/* X-Capture-Seq of the upload, if has_seq */
+	uint64_t capture_seq;
+	bool has_seq;
+
+	/* the upload has been received, decoded & encoded */
+	uint64_t received;
+	uint64_t decoded;
+	uint64_t encoded;
+} xms_frame_trace;
+
+/* an encoded frame (JPEG), shared by the ring and its readers */
+typedef struct _xms_frame {
+	/* sequence number, assigned by frames_publish () */
+	uint64_t seq;
+
+	/* publish time, microseconds since the Epoch */
+	uint64_t timestamp;
+
+	/* stamps of the stages before publishing */
+	xms_frame_trace trace;
+
+	/* encoded data */
+	unsigned char *data;
+	size_t size;
+
+	/* see frame_ref () & frame_unref () */
+	unsigned int refcount;
+
+	/* the frame has been served already, see frame_served () */
+	unsigned int served;
+
+	/* lower quality variants, requested by frame_variant () */
+	struct _xms_frame *variant[FRAME_TIERS];
+} xms_frame;
+
+/* a snapshot entry of the ring, see frames_list () */
+typedef struct _xms_frame_info {
+	uint64_t seq;
+	uint64_t timestamp;
+	size_t size;
+} xms_frame_info;
+
+
+extern void
+init_frames (size_t max_frames, size_t max_bytes);
+
+extern void
+free_frames (void);
+
+/* allocates a frame with a `size' bytes buffer, refcount is 1 */
+extern xms_frame *
+frame_new (size_t size);
+
+extern xms_frame *
+frame_ref (xms_frame *frame);
+
+extern void
+frame_unref (xms_frame *frame);
+
+/*
+ * Returns a new reference to the frame encoded at the given tier.
+ * The first caller queues the variant to a worker and never waits;
+ * until it is encoded (or if encoding has failed) the original frame
+ * is returned.
+ */
+extern xms_frame *
+frame_variant (xms_frame *frame, unsigned int tier);
+
+/*
+ * The first call per frame reports publish-to-serve & capture-to-serve
+ * latency (metrics.c)
+ */
+extern void
+frame_served (xms_frame *frame);
+
+/* the size of a variant, estimated if it has not been encoded yet */
+extern size_t
+frame_variant_size (xms_frame *frame, unsigned int tier);
+
+/* puts the frame into the ring, the caller keeps its own reference */
+extern void
+frames_publish (xms_frame *frame);
+
+/* returns a new reference or NULL if the frame has gone */
+extern xms_frame *
+frames_get (uint64_t seq);
+
+/* returns a new reference to the newest frame or NULL */
+extern xms_frame *
+frames_latest (void);
+
+/* max. amount of frames in the ring */
+extern size_t
+frames_capacity (void);
+
+/* fills `list' with up to `max' entries (oldest first) */
+extern size_t
+frames_list (xms_frame_info *list, size_t max);
+
+#endif /* XMS_FRAMES_H */
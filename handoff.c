@@ -0,0 +1,425 @@
+#include "handoff.h"
+#include "common.h"
+#include "frames.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+#define HANDOFF_MAGIC "XMSHOFF"
+#define HANDOFF_VERSION 1
+
+/* seconds to wait for a predecessor's message or a successor's ack */
+#define HANDOFF_TIMEOUT 5
+
+/* a successor has started its daemon, the predecessor may leave */
+#define HANDOFF_ACK 'A'
+
+/* refuse to allocate garbage */
+#define HANDOFF_MAX_FRAME (64 * 1024 * 1024)
+
+/* sent along with the listening socket, followed by the frame data */
+typedef struct _handoff_msg {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t frame_size;	/* 0 if there is no frame */
+} handoff_msg;
+
+static struct {
+	int fd;
+
+	/* a predecessor waiting for HANDOFF_ACK, see handoff_receive () */
+	int peer;
+
+	char *path;
+	struct MHD_Daemon *daemon;
+	pthread_t thread;
+	bool running;
+
+	/* the path belongs to a successor, see handoff_stop () */
+	bool handed;
+} ho = { -1, -1, NULL, NULL, 0, false, false };
+
+
+/* ------------------------------------------------------------------ */
+
+
+static bool
+make_address (const char *path, struct sockaddr_un *addr)
+{
+	if (strlen (path) >= sizeof (addr->sun_path)) {
+		error ("handoff: path is too long: %s\n", path);
+		return false;
+	}
+
+	memset (addr, 0, sizeof (*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy (addr->sun_path, path);
+
+	return true;
+}
+
+
+static bool
+send_all (int fd, const unsigned char *data, size_t size)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		n = send (fd, data, size, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		data += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+
+static bool
+read_all (int fd, unsigned char *data, size_t size)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		n = read (fd, data, size);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		data += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+
+static bool
+send_listener (int peer, MHD_socket listener, const xms_frame *frame)
+{
+	handoff_msg msg;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE (sizeof (int))];
+		struct cmsghdr align;
+	} control;
+
+
+	memset (&msg, 0, sizeof (msg));
+	memcpy (msg.magic, HANDOFF_MAGIC, sizeof (msg.magic));
+	msg.version = HANDOFF_VERSION;
+	msg.frame_size = (frame != NULL) ? frame->size : 0;
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof (msg);
+
+	memset (&mh, 0, sizeof (mh));
+	memset (&control, 0, sizeof (control));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof (control.buf);
+
+	cmsg = CMSG_FIRSTHDR (&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+	memcpy (CMSG_DATA (cmsg), &listener, sizeof (int));
+
+	if (sendmsg (peer, &mh, MSG_NOSIGNAL) != (ssize_t) sizeof (msg))
+		return false;
+
+	return frame == NULL || send_all (peer, frame->data, frame->size);
+}
+
+
+static MHD_socket
+recv_listener (int peer, uint64_t *frame_size)
+{
+	handoff_msg msg;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int fd = -1;
+	union {
+		char buf[CMSG_SPACE (sizeof (int))];
+		struct cmsghdr align;
+	} control;
+
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof (msg);
+
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof (control.buf);
+
+	if (recvmsg (peer, &mh, 0) != (ssize_t) sizeof (msg))
+		return MHD_INVALID_SOCKET;
+
+	for (cmsg = CMSG_FIRSTHDR (&mh); cmsg != NULL;
+		cmsg = CMSG_NXTHDR (&mh, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+		}
+	}
+
+	if (memcmp (msg.magic, HANDOFF_MAGIC, sizeof (msg.magic)) != 0 ||
+		msg.version != HANDOFF_VERSION)
+	{
+		error ("handoff: unknown protocol\n");
+
+		if (fd != -1)
+			(void) close (fd);
+
+		return MHD_INVALID_SOCKET;
+	}
+
+	*frame_size = msg.frame_size;
+
+	return fd;
+}
+
+
+static void
+receive_frame (int peer, uint64_t size)
+{
+	xms_frame *frame;
+
+	if (size == 0)
+		return;
+
+	if (size > HANDOFF_MAX_FRAME) {
+		warn ("handoff: frame is too large: %llu bytes\n",
+			(unsigned long long) size);
+		return;
+	}
+
+	frame = frame_new (size);
+
+	if (frame == NULL) {
+		error ("handoff: failed to allocate frame: %llu bytes\n",
+			(unsigned long long) size);
+		return;
+	}
+
+	if (read_all (peer, frame->data, frame->size)) {
+		frames_publish (frame);
+		info ("* Handoff: took over the latest frame, %zu bytes\n",
+			frame->size);
+	}
+	else
+		warn ("handoff: failed to read frame\n");
+
+	frame_unref (frame);
+}
+
+
+extern MHD_socket
+handoff_receive (const char *path)
+{
+	struct sockaddr_un addr;
+	struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+	MHD_socket listener;
+	uint64_t frame_size = 0;
+	int peer;
+
+
+	if (!make_address (path, &addr))
+		return MHD_INVALID_SOCKET;
+
+	peer = socket (AF_UNIX, SOCK_STREAM, 0);
+
+	if (peer == -1)
+		return MHD_INVALID_SOCKET;
+
+	(void) setsockopt (peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+	if (connect (peer, (struct sockaddr *) &addr, sizeof (addr)) != 0) {
+		/* nobody is there, start from scratch */
+		if (errno != ENOENT && errno != ECONNREFUSED)
+			warn ("handoff: failed to connect to %s: %s\n",
+				path, strerror (errno));
+		(void) close (peer);
+		return MHD_INVALID_SOCKET;
+	}
+
+	listener = recv_listener (peer, &frame_size);
+
+	if (listener == MHD_INVALID_SOCKET) {
+		warn ("handoff: failed to take over from %s\n", path);
+		(void) close (peer);
+		return MHD_INVALID_SOCKET;
+	}
+
+	info ("* Handoff: took over the listener from %s\n", path);
+	receive_frame (peer, frame_size);
+
+	/* the predecessor keeps serving until handoff_serve () */
+	ho.peer = peer;
+
+	return listener;
+}
+
+
+/* the successor may fail to start, then we keep serving */
+static bool
+wait_ack (int peer)
+{
+	struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+	unsigned char ack = 0;
+
+	(void) setsockopt (peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+	return read_all (peer, &ack, 1) && ack == HANDOFF_ACK;
+}
+
+
+static void *
+serve_main (void *arg)
+{
+	const union MHD_DaemonInfo *di;
+	xms_frame *frame;
+	int peer;
+	bool sent;
+
+
+	(void) arg;
+
+	for (;;) {
+		peer = accept (ho.fd, NULL, NULL);
+
+		if (peer == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			/* handoff_stop () */
+			break;
+		}
+
+		di = MHD_get_daemon_info (ho.daemon, MHD_DAEMON_INFO_LISTEN_FD);
+		frame = frames_latest ();
+
+		sent = di != NULL &&
+			send_listener (peer, di->listen_fd, frame) &&
+			wait_ack (peer);
+
+		frame_unref (frame);
+		(void) close (peer);
+
+		if (sent) {
+			note ("* Handoff: the listener has been handed over\n");
+			ho.handed = true;
+
+			/* drain & exit, see main () */
+			(void) kill (getpid (), SIGTERM);
+			break;
+		}
+
+		warn ("handoff: failed to hand the listener over\n");
+	}
+
+	return NULL;
+}
+
+
+extern void
+handoff_serve (const char *path, struct MHD_Daemon *daemon)
+{
+	struct sockaddr_un addr;
+	unsigned char ack = HANDOFF_ACK;
+
+
+	/* our daemon is up, let the predecessor go */
+	if (ho.peer != -1) {
+		if (!send_all (ho.peer, &ack, 1))
+			warn ("handoff: failed to release the predecessor\n");
+
+		(void) close (ho.peer);
+		ho.peer = -1;
+	}
+
+	if (!make_address (path, &addr))
+		return;
+
+	ho.fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+	if (ho.fd == -1) {
+		error ("handoff: socket: %s\n", strerror (errno));
+		return;
+	}
+
+	/* a predecessor has left it, it doesn't need it anymore */
+	(void) unlink (path);
+
+	if (bind (ho.fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+		listen (ho.fd, 1) != 0)
+	{
+		error ("handoff: failed to listen on %s: %s\n",
+			path, strerror (errno));
+		(void) close (ho.fd);
+		ho.fd = -1;
+		return;
+	}
+
+	ho.path = strdup (path);
+	ho.daemon = daemon;
+	ho.handed = false;
+
+	if (pthread_create (&ho.thread, NULL, serve_main, NULL) != 0) {
+		error ("handoff: failed to start a thread\n");
+		handoff_stop ();
+		return;
+	}
+
+	ho.running = true;
+}
+
+
+extern void
+handoff_stop (void)
+{
+	if (ho.fd == -1)
+		return;
+
+	/* wakes up accept () */
+	(void) shutdown (ho.fd, SHUT_RDWR);
+
+	if (ho.running) {
+		(void) pthread_join (ho.thread, NULL);
+		ho.running = false;
+	}
+
+	(void) close (ho.fd);
+	ho.fd = -1;
+
+	/* a successor has already bound the path */
+	if (!ho.handed && ho.path != NULL)
+		(void) unlink (ho.path);
+
+	free (ho.path);
+	ho.path = NULL;
+}
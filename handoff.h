@@ -0,0 +1,34 @@
+#ifndef XMS_HANDOFF_H
+#define XMS_HANDOFF_H
+
+#include "mhd.h"
+
+/*
+ * Zero-downtime restart. A running server listens on a Unix socket,
+ * a new one connects to it on startup and receives the listening
+ * socket (SCM_RIGHTS) and the latest frame. Once the new one has started
+ * its daemon, the old one drains and exits, while the new one is already
+ * accepting on the same socket.
+ */
+
+
+/*
+ * Takes over from a server listening on `path'. Returns the listening
+ * socket and puts the frame into the frames ring (frames.c), or returns
+ * MHD_INVALID_SOCKET if there is no running server.
+ */
+extern MHD_socket
+handoff_receive (const char *path);
+
+/*
+ * Releases a predecessor, if any, and waits for a successor on `path'.
+ * Once the listener has been handed over, SIGTERM is sent to the process
+ * to drain & exit.
+ */
+extern void
+handoff_serve (const char *path, struct MHD_Daemon *daemon);
+
+extern void
+handoff_stop (void);
+
+#endif /* XMS_HANDOFF_H */
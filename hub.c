@@ -0,0 +1,402 @@
+#include "hub.h"
+#include "atomics.h"
+#include "clock.h"
+#include "common.h"
+#include "frames.h"
+#include "mjpeg.h"
+#include "mutex.h"
+#include "trace.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/* see MHD_create_response_from_callback () */
+#define HUB_BLOCK_SIZE (32 * 1024)
+
+/* publish interval bounds (usec), the default is used until known */
+#define HUB_DEFAULT_INTERVAL 1000000
+#define HUB_MIN_INTERVAL 100000
+#define HUB_MAX_INTERVAL 5000000
+
+/* drain times below this (usec) tell nothing about a link */
+#define HUB_MIN_DRAIN_TIME 1000
+
+/* trace headers of a part, see frame_headers () */
+#define HUB_HEADERS_SIZE 384
+
+
+/*
+ * Every viewer shares encoded frames from the ring (frames.c) and
+ * remembers the last frame it has got. When a viewer is ready for
+ * the next frame, it takes the newest one: slow viewers skip frames
+ * instead of queueing them. When there is nothing new, the viewer
+ * connection is suspended until the next publish.
+ *
+ * MHD asks for more data when the socket becomes writable, thus the
+ * time between handing out a frame and the next call after its last
+ * byte tells how fast the viewer drains responses. The estimated
+ * throughput selects a quality tier of a frame (frames.c) which can
+ * be delivered within a publish interval.
+ */
+typedef struct _hub_viewer {
+	struct MHD_Connection *connection;
+
+	/* a number of the viewer in trace events (trace.c) */
+	uint64_t id;
+
+	/* the frame being sent and the last frame taken */
+	xms_frame *frame;
+	uint64_t last_seq;
+
+	mjpeg_part part;
+	bool ended;
+
+	/* throughput estimation: bytes per second, 0 is unknown */
+	uint64_t rate;
+	uint64_t part_start;
+	size_t part_size;
+	unsigned long calls;
+	unsigned long done_call;
+
+	/* a viewer is parked while waiting for a new frame */
+	bool parked;
+	struct _hub_viewer *prev;
+	struct _hub_viewer *next;
+} hub_viewer;
+
+
+static struct {
+	SIMPLE_MUTEX *mutex;
+	hub_viewer *parked;
+	uint64_t seq;
+	bool closing;
+
+	/* the last viewer id, see hub_viewer_response () */
+	uint64_t viewers;
+
+	/* an average interval between publishes, usec */
+	uint64_t interval;
+	uint64_t last_publish;
+} hub;
+
+
+/* ------------------------------------------------------------------ */
+
+
+extern void
+init_hub (void)
+{
+	hub.mutex = simple_mutex_create ();
+	simple_mutex_init (hub.mutex);
+	hub.parked = NULL;
+	hub.seq = 0;
+	hub.closing = false;
+	hub.viewers = 0;
+	hub.interval = HUB_DEFAULT_INTERVAL;
+	hub.last_publish = 0;
+}
+
+
+extern void
+free_hub (void)
+{
+	simple_mutex_destroy (hub.mutex);
+	free (hub.mutex);
+	hub.mutex = NULL;
+}
+
+
+/* must be called with the hub mutex held */
+static void
+unlink_viewer (hub_viewer *v)
+{
+	if (v->prev != NULL)
+		v->prev->next = v->next;
+	else
+		hub.parked = v->next;
+
+	if (v->next != NULL)
+		v->next->prev = v->prev;
+
+	v->prev = v->next = NULL;
+	v->parked = false;
+}
+
+
+static void
+resume_parked (void)
+{
+	hub_viewer *v, *next;
+
+
+	/* hub mutex is held by the caller */
+	v = hub.parked;
+	hub.parked = NULL;
+
+	for (; v != NULL; v = next) {
+		next = v->next;
+		v->prev = v->next = NULL;
+		v->parked = false;
+		MHD_resume_connection (v->connection);
+	}
+}
+
+
+extern void
+hub_publish (uint64_t seq)
+{
+	uint64_t now = clock_usec (CLOCK_MONOTONIC), interval;
+
+
+	simple_mutex_lock (hub.mutex);
+
+	if (hub.last_publish != 0) {
+		interval = now - hub.last_publish;
+
+		if (interval < HUB_MIN_INTERVAL)
+			interval = HUB_MIN_INTERVAL;
+		else if (interval > HUB_MAX_INTERVAL)
+			interval = HUB_MAX_INTERVAL;
+
+		xms_atomic_store (&hub.interval,
+			(hub.interval * 3 + interval) / 4);
+	}
+
+	hub.last_publish = now;
+	hub.seq = seq;
+	resume_parked ();
+	simple_mutex_unlock (hub.mutex);
+}
+
+
+extern void
+hub_shutdown (void)
+{
+	simple_mutex_lock (hub.mutex);
+	xms_atomic_store (&hub.closing, true);
+	resume_parked ();
+	simple_mutex_unlock (hub.mutex);
+}
+
+
+/*
+ * Returns false if there is a new frame already, so the viewer
+ * must not wait.
+ */
+static bool
+park_viewer (hub_viewer *v)
+{
+	bool parked = false;
+
+
+	simple_mutex_lock (hub.mutex);
+
+	if (hub.seq <= v->last_seq && ! hub.closing) {
+		v->prev = NULL;
+		v->next = hub.parked;
+		if (hub.parked != NULL)
+			hub.parked->prev = v;
+		hub.parked = v;
+		v->parked = true;
+
+		/* under the lock: hub_publish () resumes us after this */
+		MHD_suspend_connection (v->connection);
+		parked = true;
+	}
+
+	simple_mutex_unlock (hub.mutex);
+
+	return parked;
+}
+
+
+static void
+update_rate (hub_viewer *v, uint64_t now)
+{
+	uint64_t elapsed = now - v->part_start, sample;
+
+
+	if (elapsed < HUB_MIN_DRAIN_TIME)
+		return;
+
+	sample = (uint64_t) v->part_size * 1000000 / elapsed;
+	v->rate = (v->rate == 0) ? sample : (v->rate * 3 + sample) / 4;
+}
+
+
+/* the best tier which could be drained within a publish interval */
+static unsigned int
+select_tier (hub_viewer *v, xms_frame *frame)
+{
+	uint64_t budget;
+	unsigned int tier;
+
+
+	if (v->rate == 0)
+		return 0;
+
+	budget = v->rate * xms_atomic_load (&hub.interval) / 1000000;
+
+	for (tier = 0; tier < FRAME_TIERS - 1; tier++)
+		if (frame_variant_size (frame, tier) <= budget)
+			break;
+
+	return tier;
+}
+
+
+/* trace headers of a part, a line which doesn't fit is omitted */
+static void
+frame_headers (const xms_frame *frame, char *buf, size_t size)
+{
+	char values[TRACE_HEADERS][TRACE_VALUE_SIZE];
+	size_t len = 0;
+	unsigned int i;
+	int n;
+
+
+	trace_headers (frame, values);
+	buf[0] = '\0';
+
+	for (i = 0; i < TRACE_HEADERS; i++) {
+		if (values[i][0] == '\0')
+			continue;
+
+		n = snprintf (buf + len, size - len, "%s: %s\r\n",
+			TRACE_HEADER_NAMES[i], values[i]);
+
+		if (n < 0 || (size_t) n >= size - len)
+			buf[len] = '\0';
+		else
+			len += n;
+	}
+}
+
+
+static ssize_t
+viewer_reader_cb (void *cls, uint64_t pos, char *buf, size_t max)
+{
+	hub_viewer *v = cls;
+	xms_frame *frame;
+	char headers[HUB_HEADERS_SIZE];
+	size_t total = 0;
+	uint64_t now = clock_usec (CLOCK_MONOTONIC);
+
+
+	(void) pos;
+
+	v->calls++;
+
+	while (total < max) {
+		if (mjpeg_part_done (&v->part)) {
+			/* the previous frame has been sent completely */
+			if (v->frame != NULL) {
+				/* ... and MHD has asked for more since then */
+				if (v->done_call < v->calls)
+					update_rate (v, now);
+
+				frame_unref (v->frame);
+				v->frame = NULL;
+			}
+
+			if (v->ended)
+				break;
+
+			if (xms_atomic_load (&hub.closing)) {
+				mjpeg_part_end (&v->part);
+				v->ended = true;
+				continue;
+			}
+
+			frame = frames_latest ();
+
+			if (frame == NULL || frame->seq <= v->last_seq) {
+				frame_unref (frame);
+
+				/* let MHD send what we have got first */
+				if (total > 0)
+					break;
+
+				if (park_viewer (v))
+					return 0;
+
+				continue;
+			}
+
+			v->last_seq = frame->seq;
+			frame_served (frame);
+			v->frame = frame_variant (frame, select_tier (v, frame));
+			frame_unref (frame);
+
+			frame_headers (v->frame, headers, sizeof (headers));
+			mjpeg_part_frame (&v->part,
+				v->frame->data, v->frame->size,
+				v->frame->timestamp, v->frame->seq, headers);
+			trace_sent (v->frame, "stream", v->id);
+			v->part_start = now;
+			v->part_size = v->frame->size;
+		}
+
+		total += mjpeg_part_copy (&v->part, buf + total, max - total);
+
+		/*
+		 * the rate is sampled by the next call, which comes once
+		 * the socket has taken the tail of the part
+		 */
+		if (mjpeg_part_done (&v->part)) {
+			v->done_call = v->calls;
+			break;
+		}
+	}
+
+	if (total == 0)
+		return MHD_CONTENT_READER_END_OF_STREAM;
+
+	return total;
+}
+
+
+static void
+viewer_free_cb (void *cls)
+{
+	hub_viewer *v = cls;
+
+
+	simple_mutex_lock (hub.mutex);
+	if (v->parked)
+		unlink_viewer (v);
+	simple_mutex_unlock (hub.mutex);
+
+	frame_unref (v->frame);
+	free (v);
+}
+
+
+extern struct MHD_Response *
+hub_viewer_response (struct MHD_Connection *connection)
+{
+	hub_viewer *v;
+	struct MHD_Response *response;
+
+
+	v = calloc (1, sizeof (*v));
+
+	if (v == NULL)
+		return NULL;
+
+	v->connection = connection;
+	v->id = xms_atomic_inc (&hub.viewers);
+	mjpeg_part_init (&v->part);
+
+	response = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN,
+		HUB_BLOCK_SIZE,
+		&viewer_reader_cb,
+		v,
+		&viewer_free_cb);
+
+	if (response == NULL)
+		free (v);
+
+	return response;
+}
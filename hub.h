@@ -0,0 +1,26 @@
+#ifndef XMS_HUB_H
+#define XMS_HUB_H
+
+#include "mhd.h"
+#include <stdint.h>
+
+
+extern void
+init_hub (void);
+
+extern void
+free_hub (void);
+
+/* wakes up viewers waiting for a frame newer than they have got */
+extern void
+hub_publish (uint64_t seq);
+
+/* ends all streams, parked viewers are resumed */
+extern void
+hub_shutdown (void);
+
+/* creates an MJPEG response of live frames for the connection */
+extern struct MHD_Response *
+hub_viewer_response (struct MHD_Connection *connection);
+
+#endif /* XMS_HUB_H */
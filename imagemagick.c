@@ -1,85 +1,282 @@
 #include <stdio.h>
 #include <stdbool.h>
-#include <limits.h>
+#include <stdlib.h>
 #if (defined IM_VERSION) && IM_VERSION >= 7
 	#include <MagickWand/MagickWand.h>
 #else
 	#include <wand/MagickWand.h>
 #endif
 #include "common.h"
+#include "imagemagick.h"
+#include "mpmc.h"
 
 
-#ifndef PATH_MAX
-#define PATH_MAX 1024
+/* uploaded frames are XWD dumps, published ones are JPEGs */
+#ifndef IM_IN_FORMAT
+#define IM_IN_FORMAT	"XWD"
 #endif
-
-#if defined(_MSC_VER) && _MSC_VER+0 <= 1800
-/* Substitution is OK while return value is not used */
-#define snprintf _snprintf
+#ifndef IM_OUT_FORMAT
+#define IM_OUT_FORMAT	"JPEG"
 #endif
 
-#ifndef IM_IN_FMT
-#define IM_IN_FMT	"xwd:%s"
+/* the pixel cache stays in memory, it never spills to disk */
+#ifndef IM_MEMORY_LIMIT
+#define IM_MEMORY_LIMIT	(1024 * 1024 * 1024)
 #endif
-#ifndef IM_OUT_FMT
-#define IM_OUT_FMT	"jpg:%s"
+#ifndef IM_MAP_LIMIT
+#define IM_MAP_LIMIT	(1024 * 1024 * 1024)
 #endif
 
+/* idle wands kept for the next frames, see wand_get () */
+#define IM_IDLE_WANDS	16
+
+
+struct _xms_image {
+	MagickWand *wand;
+};
+
+/*
+ * Wands are created once and reused across frames: an image moves
+ * between pipeline threads, so idle wands are shared, not per thread.
+ */
+static MPMC_QUEUE *wands;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static MagickWand *
+wand_get (void)
+{
+	void *wand;
+
+	if (wands != NULL && mpmc_pop (wands, &wand))
+		return wand;
+
+	return NewMagickWand ();
+}
+
 
 static void
-error_handler ( const ExceptionType severity,
-		const char *reason,
-		const char *description)
+wand_put (MagickWand *wand)
 {
-	(void) severity;
-	error ("imagemagick: %s (%s)\n", reason, description);
+	if (wand == NULL)
+		return;
+
+	/* images, options & exceptions are gone, the wand is blank */
+	ClearMagickWand (wand);
+
+	if (wands == NULL || !mpmc_push (wands, wand))
+		DestroyMagickWand (wand);
+}
+
+
+static void
+set_resource_limit (ResourceType type, const char *name,
+                    MagickSizeType limit)
+{
+	if (SetMagickResourceLimit (type, limit) == MagickFalse)
+		warn ("imagemagick: failed to limit %s to %llu\n",
+			name, (unsigned long long) limit);
+}
+
+
+static void
+log_wand_error (MagickWand *wand, const char *what)
+{
+	ExceptionType severity;
+	char *description;
+
+	description = MagickGetException (wand, &severity);
+	error ("imagemagick: %s: %s\n", what, description);
+	MagickRelinquishMemory (description);
+}
+
+
+extern void
+init_imagemagick (unsigned int threads)
+{
+	MagickWandGenesis ();
+
+	if (threads > 0)
+		set_resource_limit (ThreadResource, "threads", threads);
+
+	set_resource_limit (MemoryResource, "memory", IM_MEMORY_LIMIT);
+	set_resource_limit (MapResource, "map", IM_MAP_LIMIT);
+	set_resource_limit (DiskResource, "disk", 0);
+
+	wands = mpmc_new (IM_IDLE_WANDS);
+
+	if (wands == NULL)
+		die ("failed to initialize imagemagick\n");
+}
+
+
+extern void
+free_imagemagick (void)
+{
+	void *wand;
+
+
+	if (wands != NULL) {
+		while (mpmc_pop (wands, &wand))
+			DestroyMagickWand (wand);
+
+		mpmc_destroy (wands);
+		wands = NULL;
+	}
+
+	MagickWandTerminus ();
+}
+
+
+extern xms_image *
+image_decode (const unsigned char *in, size_t in_size)
+{
+	xms_image *image = malloc (sizeof (*image));
+
+
+	if (image == NULL)
+		return NULL;
+
+	image->wand = wand_get ();
+
+	if (image->wand == NULL) {
+		free (image);
+		return NULL;
+	}
+
+	/* XWD has no magic bytes, thus the format must be set explicitly */
+	if (MagickSetFormat (image->wand, IM_IN_FORMAT) == MagickFalse ||
+		MagickReadImageBlob (image->wand, in, in_size) == MagickFalse)
+	{
+		log_wand_error (image->wand, "decode");
+		image_destroy (image);
+		return NULL;
+	}
+
+	return image;
+}
+
+
+extern char *
+image_signature (xms_image *image)
+{
+	char *signature = MagickGetImageSignature (image->wand);
+
+	if (signature == NULL)
+		log_wand_error (image->wand, "signature");
+
+	return signature;
 }
 
 
 extern bool
-convert (const char *in, const char *out)
+image_encode (xms_image *image, unsigned char **out, size_t *out_size)
 {
-	MagickBooleanType status = MagickFalse;
-	ImageInfo *image_info;
-	ExceptionInfo *exception;
-	char im_in[PATH_MAX - 5];
-	char im_out[PATH_MAX - 5];
-	char *argv[] = {
-		"x11mirror-server",
-		NULL,
-		NULL
-	};
-
-	snprintf (im_in, PATH_MAX - 5, IM_IN_FMT, in);
-	snprintf (im_out, PATH_MAX - 5, IM_OUT_FMT, out);
-
-	argv[1] = im_in;
-	argv[2] = im_out;
-
-	image_info = AcquireImageInfo ();
-	exception = AcquireExceptionInfo ();
-
-	if (image_info && exception) {
-		/* XXX: do we need always set the error handler?? */
-		(void) SetErrorHandler (error_handler);
-
-		status = ConvertImageCommand (
-			image_info,
-			(sizeof (argv) / sizeof (argv[0])),
-			argv, 
-			(char **)NULL, exception);
-
-		if (status == MagickFalse) {
-			if (exception->severity != UndefinedException)
-				CatchException (exception);
-		}
+	if (MagickSetImageFormat (image->wand, IM_OUT_FORMAT) == MagickFalse) {
+		log_wand_error (image->wand, "encode");
+		return false;
+	}
+
+	*out = MagickGetImageBlob (image->wand, out_size);
+
+	if (*out == NULL) {
+		log_wand_error (image->wand, "encode");
+		return false;
+	}
+
+	return true;
+}
+
+
+extern void
+image_size (xms_image *image, size_t *width, size_t *height)
+{
+	*width = MagickGetImageWidth (image->wand);
+	*height = MagickGetImageHeight (image->wand);
+}
+
+
+extern bool
+image_export_rgb (xms_image *image, unsigned char *out)
+{
+	size_t width, height;
+
+	image_size (image, &width, &height);
+
+	if (MagickExportImagePixels (image->wand, 0, 0, width, height,
+		"RGB", CharPixel, out) == MagickFalse)
+	{
+		log_wand_error (image->wand, "export");
+		return false;
+	}
+
+	return true;
+}
+
+
+extern void
+image_destroy (xms_image *image)
+{
+	if (image != NULL) {
+		wand_put (image->wand);
+		free (image);
 	}
-	else {
-		die ("failed to initialize IM\n");
+}
+
+
+extern bool
+convert_scaled (const unsigned char *in, size_t in_size,
+		unsigned int quality, unsigned int scale,
+		unsigned char **out, size_t *out_size)
+{
+	MagickWand *wand;
+	size_t width, height;
+	bool ok = false;
+
+
+	wand = wand_get ();
+
+	if (wand == NULL)
+		return false;
+
+	if (MagickReadImageBlob (wand, in, in_size) == MagickTrue) {
+		width = MagickGetImageWidth (wand) * scale / 100;
+		height = MagickGetImageHeight (wand) * scale / 100;
+
+		if (width == 0)
+			width = 1;
+		if (height == 0)
+			height = 1;
+
+#if IM_VERSION >= 7
+		ok = MagickResizeImage (wand, width, height, TriangleFilter)
+#else
+		ok = MagickResizeImage (wand, width, height, TriangleFilter, 1.0)
+#endif
+			== MagickTrue;
+
+		ok = ok && MagickSetImageCompressionQuality (wand, quality)
+			== MagickTrue;
+
+		if (ok) {
+			*out = MagickGetImageBlob (wand, out_size);
+			ok = (*out != NULL);
+		}
 	}
 
-	DestroyImageInfo (image_info);
-	DestroyExceptionInfo (exception);
+	if (! ok)
+		log_wand_error (wand, "scale");
+
+	wand_put (wand);
+
+	return ok;
+}
+
 
-	return (status == MagickTrue) ? true : false;
+extern void
+convert_free (void *blob)
+{
+	MagickRelinquishMemory (blob);
 }
@@ -1,8 +1,51 @@
 #ifndef XMS_IMAGEMAGICK_H
 #define XMS_IMAGEMAGICK_H
 
+#include <stdbool.h>
+#include <stddef.h>
 
+/* `threads' caps ImageMagick (OpenMP) threads, 0 keeps the default */
+extern void
+init_imagemagick (unsigned int threads);
+
+extern void
+free_imagemagick (void);
+
+/* a decoded image, see image_decode () */
+typedef struct _xms_image xms_image;
+
+/* decodes an uploaded frame (XWD) */
+extern xms_image *
+image_decode (const unsigned char *in, size_t in_size);
+
+/* a digest of pixels, release it by convert_free () */
+extern char *
+image_signature (xms_image *image);
+
+/* encodes to JPEG, the result must be released by convert_free () */
+extern bool
+image_encode (xms_image *image, unsigned char **out, size_t *out_size);
+
+extern void
+image_size (xms_image *image, size_t *width, size_t *height);
+
+/* packed 8-bit RGB, `out' must hold width * height * 3 bytes */
+extern bool
+image_export_rgb (xms_image *image, unsigned char *out);
+
+extern void
+image_destroy (xms_image *image);
+
+/*
+ * Re-encodes a JPEG scaled to `scale' percents with given quality.
+ * The result must be released by convert_free ().
+ */
 extern bool
-convert (const char *in, const char *out);
+convert_scaled (const unsigned char *in, size_t in_size,
+		unsigned int quality, unsigned int scale,
+		unsigned char **out, size_t *out_size);
+
+extern void
+convert_free (void *blob);
 
 #endif /* XMS_IMAGEMAGICK_H */
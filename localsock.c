@@ -0,0 +1,89 @@
+#include "localsock.h"
+#include "common.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/* a backlog of the listener, see listen () */
+#define LOCALSOCK_BACKLOG 64
+
+
+static struct {
+	char *path;
+
+	/* the socket file we have created */
+	dev_t dev;
+	ino_t ino;
+} local;
+
+
+/* ------------------------------------------------------------------ */
+
+
+extern MHD_socket
+localsock_open (const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		error ("local socket: path is too long: %s\n", path);
+		return MHD_INVALID_SOCKET;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd == -1) {
+		error ("local socket: %s\n", strerror (errno));
+		return MHD_INVALID_SOCKET;
+	}
+
+	/* a previous instance (or a crashed one) has left it */
+	if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+		(void) unlink (path);
+
+	if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+		listen (fd, LOCALSOCK_BACKLOG) != 0 ||
+		lstat (path, &st) != 0)
+	{
+		error ("local socket: failed to listen on %s: %s\n",
+			path, strerror (errno));
+		(void) close (fd);
+		return MHD_INVALID_SOCKET;
+	}
+
+	local.path = strdup (path);
+	local.dev = st.st_dev;
+	local.ino = st.st_ino;
+
+	return fd;
+}
+
+
+extern void
+localsock_close (void)
+{
+	struct stat st;
+
+	if (local.path == NULL)
+		return;
+
+	/* the listener is closed along with its daemon */
+	if (lstat (local.path, &st) == 0 &&
+		st.st_dev == local.dev && st.st_ino == local.ino)
+	{
+		(void) unlink (local.path);
+	}
+
+	free (local.path);
+	local.path = NULL;
+}
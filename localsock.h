@@ -0,0 +1,19 @@
+#ifndef XMS_LOCALSOCK_H
+#define XMS_LOCALSOCK_H
+
+#include "mhd.h"
+
+/*
+ * A Unix domain socket listener for co-located clients, it is served
+ * by a separate MHD daemon alongside the TCP one (main.c).
+ */
+
+/* replaces a stale socket file, MHD_INVALID_SOCKET on failure */
+extern MHD_socket
+localsock_open (const char *path);
+
+/* removes the socket file unless a successor has replaced it */
+extern void
+localsock_close (void);
+
+#endif /* XMS_LOCALSOCK_H */
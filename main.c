@@ -3,12 +3,33 @@
 #include "server.h"
 #include "suspend.h"
 #include "responses.h"
+#include "frames.h"
+#include "hub.h"
+#include "imagemagick.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "record.h"
+#include "accesslog.h"
+#include "affinity.h"
+#include "budget.h"
+#include "bufpool.h"
+#include "capture.h"
+#include "drain.h"
+#include "eventloop.h"
+#include "handoff.h"
+#include "localsock.h"
+#include "shmstore.h"
+#include "trace.h"
 #include "vlogger.h"
 #include <errno.h>
 #include <limits.h>
 #include <time.h>
 #include <signal.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #ifdef _MSC_VER
 #ifndef strcasecmp
 #define strcasecmp(a,b) _stricmp((a),(b))
@@ -32,6 +53,16 @@
 #define DEFAULT_HTTPD_CONNECTION_MEMORY_LIMIT (128 * 1024)
 /* MHD_OPTION_CONNECTION_MEMORY_INCREMENT */
 #define DEFAULT_HTTPD_CONNECTION_MEMORY_INCREMENT (1 * 1024)
+/* max. amount of waiting uploaders (suspend.c) */
+#define DEFAULT_SUSPEND_QUEUE_SIZE 1024
+/* an amount of recent frames to keep in memory (frames.c) */
+#define DEFAULT_FRAMES_RING_SIZE 30
+/* max. memory size of the recent frames (frames.c) */
+#define DEFAULT_FRAMES_RING_MEMORY (64 * 1024 * 1024)
+/* frames per a pipeline queue (pipeline.c) */
+#define DEFAULT_PIPELINE_DEPTH 2
+/* max. seconds to wait for requests in flight on shutdown (drain.c) */
+#define DEFAULT_SHUTDOWN_GRACE 10
 
 
 typedef struct _httpd_options {
@@ -42,11 +73,38 @@ typedef struct _httpd_options {
 	size_t          memory_limit;
 	size_t          memory_increment;
 	int             daemonize;
+	size_t          frames_ring_size;
+	size_t          frames_ring_memory;
+	size_t          memory_budget;
+	const char     *record_dir;
+	const char     *access_log;
+	const char     *trace_file;
+	const char     *capture_file;
+	const char     *shm_name;
+	unsigned int    convert_threads;
+	size_t          suspend_queue_size;
+	size_t          pipeline_depth;
+	enum pipeline_backpressure backpressure;
+	unsigned int    shutdown_grace;
+	const char     *handoff_path;
+	MHD_socket      listen_fd;
+	const char     *local_path;
+	int             external;
+	enum bufpool_pages buffer_pages;
 } httpd_options;
 
 
+static void
+log_httpd_options (httpd_options *ops);
+
 static struct MHD_Daemon *
-start_httpd (httpd_options *ops);
+start_httpd (httpd_options *ops, MHD_socket listener);
+
+static void
+quiesce_httpd (struct MHD_Daemon *daemon);
+
+static void
+drain_httpd (unsigned int grace, int external);
 
 static void
 stop_httpd (struct MHD_Daemon *daemon);
@@ -63,16 +121,58 @@ print_usage (const char *argv0);
 /* ------------------------------------------------------------------ */
 
 
+static void
+log_httpd_options (httpd_options *ops)
+{
+	info ("* Powered by libmicrohttpd version %s (0x%08x)\n",
+		MHD_get_version (),
+		MHD_VERSION);
+	if (ops->listen_fd != MHD_INVALID_SOCKET)
+		info ("* Start listener handed over by a predecessor\n");
+	else
+		info ("* Start listener on port %d\n", ops->port);
+	if (ops->local_path != NULL)
+		info ("* Start listener on %s\n", ops->local_path);
+	info ("* Connection timeout: %d\n", ops->connect_timeout);
+	info ("* Thread pool size: %d\n", ops->thread_pool_size);
+	info ("* Memory limit per connection: %zu\n", ops->memory_limit);
+	info ("* Memory increment per connection: %zu\n", ops->memory_increment);
+	if (ops->memory_budget > 0)
+		info ("* Memory budget of frame caches: %zu\n",
+			ops->memory_budget);
+
+#if MHD_VERSION >= 0x00095100
+	if (ops->mode & MHD_USE_EPOLL)
+#else
+	if (ops->mode & MHD_USE_EPOLL_LINUX_ONLY)
+#endif
+		info ("* Poller backend: epoll\n");
+	else
+		info ("* Poller backend: select\n");
+
+	if (ops->external)
+		info ("* Event loop: the main thread\n");
+
+	if (ops->mode & MHD_USE_TCP_FASTOPEN)
+		info ("* TCP Fast Open: enabled\n");
+	else
+		info ("* TCP Fast Open: disabled\n");
+}
+
+
+/* `listener' is MHD_INVALID_SOCKET to bind ops->port */
 static struct MHD_Daemon *
-start_httpd (httpd_options *ops)
+start_httpd (httpd_options *ops, MHD_socket listener)
 {
 	struct MHD_Daemon *daemon;
 	enum daemon_options_index {
 		CONNECTION_TIMEOUT = 0,
 		REQUEST_COMPLETED_CB,
+		NOTIFY_CONNECTION_CB,
 		THREAD_POOL_SIZE,
 		MEMORY_LIMIT,
-		MEMORY_INCREMENT
+		MEMORY_INCREMENT,
+		LISTEN_SOCKET
 	};
 	struct MHD_OptionItem daemon_options[] = {
 		{
@@ -87,6 +187,12 @@ start_httpd (httpd_options *ops)
 			(intptr_t) &request_completed_cb,
 			NULL
 		},
+		{
+			/* MHD_NotifyConnectionCallback, see /metrics */
+			MHD_OPTION_NOTIFY_CONNECTION,
+			(intptr_t) &connection_cb,
+			NULL
+		},
 		{
 			/* unsigned int */
 			MHD_OPTION_THREAD_POOL_SIZE,
@@ -105,6 +211,12 @@ start_httpd (httpd_options *ops)
 			DEFAULT_HTTPD_CONNECTION_MEMORY_INCREMENT,
 			NULL
 		},
+		{
+			/* MHD_socket, a listener handed over (handoff.c) */
+			MHD_OPTION_LISTEN_SOCKET,
+			MHD_INVALID_SOCKET,
+			NULL
+		},
 		{ 	MHD_OPTION_END, 0, NULL } /* must always be the last */
 	};
 
@@ -113,29 +225,10 @@ start_httpd (httpd_options *ops)
 	daemon_options[MEMORY_LIMIT].value = ops->memory_limit;
 	daemon_options[MEMORY_INCREMENT].value = ops->memory_increment;
 
-	info ("* Powered by libmicrohttpd version %s (0x%08x)\n",
-		MHD_get_version (),
-		MHD_VERSION);
-	info ("* Start listener on port %d\n", ops->port);
-	info ("* Connection timeout: %d\n", ops->connect_timeout);
-	info ("* Thread pool size: %d\n", ops->thread_pool_size);
-	info ("* Memory limit per connection: %zu\n", ops->memory_limit);
-	info ("* Memory increment per connection: %zu\n", ops->memory_increment);
-
-#if MHD_VERSION >= 0x00095100
-	if (ops->mode & MHD_USE_EPOLL)
-#else
-	if (ops->mode & MHD_USE_EPOLL_LINUX_ONLY)
-#endif
-		info ("* Poller backend: epoll\n");
-	else
-		info ("* Poller backend: select\n");
-
-	if (ops->mode & MHD_USE_TCP_FASTOPEN)
-		info ("* TCP Fast Open: enabled\n");
+	if (listener != MHD_INVALID_SOCKET)
+		daemon_options[LISTEN_SOCKET].value = listener;
 	else
-		info ("* TCP Fast Open: disabled\n");
-
+		daemon_options[LISTEN_SOCKET].option = MHD_OPTION_END;
 
 	daemon = MHD_start_daemon (
 		ops->mode,
@@ -149,6 +242,62 @@ start_httpd (httpd_options *ops)
 }
 
 
+static void
+quiesce_httpd (struct MHD_Daemon *daemon)
+{
+	MHD_socket listener;
+
+	/*
+	 * stop accepting, connections already accepted are served;
+	 * MHD_USE_SUSPEND_RESUME implies the ITC channel it needs
+	 */
+	listener = MHD_quiesce_daemon (daemon);
+
+	if (listener != MHD_INVALID_SOCKET)
+#if defined(_WIN32)
+		(void) closesocket (listener);
+#else
+		(void) close (listener);
+#endif
+	else
+		warn ("* Failed to stop the listener\n");
+}
+
+
+/* `external': daemons are run by the event loop (eventloop.c) */
+static void
+drain_httpd (unsigned int grace, int external)
+{
+	bool drained;
+
+	struct timespec start, end;
+
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &start);
+
+	/* parked uploaders & viewers are answered right away */
+	drain_start ();
+	hub_shutdown ();
+	resume_all_connections ();
+
+	if (external)
+		drained = eventloop_drain (grace);
+	else
+		drained = drain_wait (grace);
+
+	if (!drained) {
+		warn ("* %u requests are still in flight after %u sec.\n",
+			drain_inflight (), grace);
+		return;
+	}
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &end);
+	info ("* Drained in %.3f sec.\n",
+		(end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+
 static void
 stop_httpd (struct MHD_Daemon *daemon)
 {
@@ -192,6 +341,8 @@ print_usage (const char *argv0)
 	/* epoll switch */
 #if defined(__linux__)
 	desc ("-E", "enable epoll backend (Linux only)");
+	/* external event loop */
+	desc ("-X", "run MHD in the server's event loop (Linux only)");
 	/* TCP Fast Open switch */
 	desc ("-F", "enable TCP Fast Open support (Linux only)");
 #endif
@@ -203,6 +354,68 @@ print_usage (const char *argv0)
 		"max memory size per connection, default %d",
 		DEFAULT_HTTPD_CONNECTION_MEMORY_LIMIT);
 	desc ("-M MEMORY_LIMIT", buffer);
+	/* recent frames */
+	snprintf (buffer, BUFFER_SIZE,
+		"an amount of recent frames to keep, default %d",
+		DEFAULT_FRAMES_RING_SIZE);
+	desc ("-R FRAMES", buffer);
+	/* recent frames memory limit */
+	snprintf (buffer, BUFFER_SIZE,
+		"max memory size of recent frames, default %d",
+		DEFAULT_FRAMES_RING_MEMORY);
+	desc ("-m FRAMES_MEMORY", buffer);
+	/* all caches */
+	desc ("-B BYTES",
+		"max memory size of all frame caches, unlimited by default");
+	/* waiting uploaders */
+	snprintf (buffer, BUFFER_SIZE,
+		"max. amount of waiting uploaders, default %d",
+		DEFAULT_SUSPEND_QUEUE_SIZE);
+	desc ("-Q QUEUE_SIZE", buffer);
+	/* pipeline */
+	snprintf (buffer, BUFFER_SIZE,
+		"frames per a pipeline queue, default %d",
+		DEFAULT_PIPELINE_DEPTH);
+	desc ("-P DEPTH", buffer);
+	desc ("-b drop|throttle",
+		"when the pipeline is behind, default throttle, "
+		"uploads drop with -X");
+	desc ("-G thp|hugetlb",
+		"back frame buffers by huge pages, disabled by default");
+	/* shutdown */
+	snprintf (buffer, BUFFER_SIZE,
+		"max. seconds to finish requests on exit, default %d",
+		DEFAULT_SHUTDOWN_GRACE);
+	desc ("-g GRACE", buffer);
+	/* zero-downtime restart */
+	desc ("-H PATH",
+		"take over the listener from/hand it over via a socket");
+	/* Unix domain socket */
+	desc ("-U PATH",
+		"listen on a Unix domain socket too, disabled by default");
+	/* recording */
+	desc ("-r DIR_PATH",
+		"record every frame to a directory, disabled by default");
+	/* binary access log */
+	desc ("-A FILE",
+		"write a binary access log, disabled by default");
+	/* frame trace */
+	desc ("-e FILE",
+		"write frame stage events (Chrome trace), disabled by default");
+	/* upload capture */
+	desc ("-c FILE",
+		"capture uploads for bench/xms-replay, disabled by default");
+	/* shared memory */
+	desc ("-s NAME",
+		"publish frames to POSIX shared memory, disabled by default");
+#if defined(__linux__)
+	/* CPU affinity */
+	desc ("-a ROLE=CPULIST",
+		"pin mhd, conv or log threads to CPUs, e.g. conv=4-7");
+#endif
+	/* ImageMagick threads */
+	desc ("-j THREADS_NUM",
+		"max. ImageMagick threads, default CPUs of conv or all");
 	/* an amount of threads */
 	snprintf (buffer, BUFFER_SIZE,
 		"an amount of threads, default %d",
@@ -226,6 +439,13 @@ daemonize (void)
 }
 
 
+static void
+pin_log_thread (void)
+{
+	(void) affinity_pin (AFFINITY_LOG);
+}
+
+
 static volatile sig_atomic_t sigflag;
 static sigset_t newmask, oldmask, zeromask;
 
@@ -258,10 +478,11 @@ extern int
 main (int argc, char *argv[])
 {
 	struct MHD_Daemon *daemon;
+	struct MHD_Daemon *local_daemon = NULL;
+	MHD_socket local_fd;
 	httpd_options ops;
 	vlogger_t vlogger;
 	int opt;
-	const struct timespec ts_wait = { 2, 0 };
 
 
 	ops.daemonize = 0;
@@ -271,14 +492,33 @@ main (int argc, char *argv[])
 	ops.thread_pool_size = DEFAULT_HTTPD_THREAD_POOL_SIZE;
 	ops.memory_limit = DEFAULT_HTTPD_CONNECTION_MEMORY_LIMIT;
 	ops.memory_increment = DEFAULT_HTTPD_CONNECTION_MEMORY_INCREMENT;
+	ops.frames_ring_size = DEFAULT_FRAMES_RING_SIZE;
+	ops.frames_ring_memory = DEFAULT_FRAMES_RING_MEMORY;
+	ops.memory_budget = 0;
+	ops.record_dir = NULL;
+	ops.access_log = NULL;
+	ops.trace_file = NULL;
+	ops.capture_file = NULL;
+	ops.shm_name = NULL;
+	ops.convert_threads = 0;
+	ops.suspend_queue_size = DEFAULT_SUSPEND_QUEUE_SIZE;
+	ops.pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+	ops.backpressure = BACKPRESSURE_THROTTLE;
+	ops.shutdown_grace = DEFAULT_SHUTDOWN_GRACE;
+	ops.handoff_path = NULL;
+	ops.listen_fd = MHD_INVALID_SOCKET;
+	ops.local_path = NULL;
+	ops.external = 0;
+	ops.buffer_pages = BUFPOOL_PAGES_DEFAULT;
 
 	vlogger.syslog_ident = "x11mirror-server";
 	vlogger.syslog_facility = "";
 	vlogger.mode = VLOGGER_MODE_NORMAL;
 	vlogger.outfile = NULL;
 	vlogger.errfile = NULL;
+	vlogger.writer_init = pin_log_thread;
 
-	while ((opt = getopt (argc, argv, "dqhp:t:DEFI:L:M:T:")) != -1) {
+	while ((opt = getopt (argc, argv, "dqhp:t:DEFXI:L:M:T:R:m:B:r:Q:A:e:c:a:j:P:b:G:g:H:s:U:")) != -1) {
 		switch (opt) {
 		case 'h': print_usage_exit (argv[0]);
 		case 'p': {
@@ -309,6 +549,9 @@ main (int argc, char *argv[])
 		case 'F':
 			ops.mode |= MHD_USE_TCP_FASTOPEN;
 			break;
+		case 'X':
+			ops.external = 1;
+			break;
 #endif
 		case 'I': {
 			int increment;
@@ -336,6 +579,94 @@ main (int argc, char *argv[])
 				die ("Invalid thread pool size: %s.\n", optarg);
 			ops.thread_pool_size = num;
 		} break;
+		case 'R': {
+			int num;
+			sscanf (optarg, "%d", &num);
+			if (num <= 0)
+				die ("Invalid amount of frames: %s.\n", optarg);
+			ops.frames_ring_size = num;
+		} break;
+		case 'm': {
+			long limit;
+			sscanf (optarg, "%ld", &limit);
+			if (limit < 0)
+				die ("Invalid frames memory limit: %s.\n", optarg);
+			ops.frames_ring_memory = limit;
+		} break;
+		case 'B': {
+			long limit = -1;
+			sscanf (optarg, "%ld", &limit);
+			if (limit < 0)
+				die ("Invalid memory budget: %s.\n", optarg);
+			ops.memory_budget = limit;
+		} break;
+		case 'r':
+			ops.record_dir = optarg;
+			break;
+		case 'A':
+			ops.access_log = optarg;
+			break;
+		case 'e':
+			ops.trace_file = optarg;
+			break;
+		case 'c':
+			ops.capture_file = optarg;
+			break;
+		case 's':
+			ops.shm_name = optarg;
+			break;
+#if defined(__linux__)
+		case 'a':
+			if (!affinity_parse (optarg))
+				die ("Invalid CPU affinity: %s.\n", optarg);
+			break;
+#endif
+		case 'j': {
+			int num;
+			sscanf (optarg, "%d", &num);
+			if (num <= 0)
+				die ("Invalid amount of conversion threads: %s.\n",
+					optarg);
+			ops.convert_threads = num;
+		} break;
+		case 'Q': {
+			int num;
+			sscanf (optarg, "%d", &num);
+			if (num <= 0)
+				die ("Invalid queue size: %s.\n", optarg);
+			ops.suspend_queue_size = num;
+		} break;
+		case 'P': {
+			int num;
+			sscanf (optarg, "%d", &num);
+			if (num <= 0)
+				die ("Invalid pipeline depth: %s.\n", optarg);
+			ops.pipeline_depth = num;
+		} break;
+		case 'b':
+			if (!pipeline_parse_backpressure (optarg,
+				&ops.backpressure))
+			{
+				die ("Invalid backpressure mode: %s.\n", optarg);
+			}
+			break;
+		case 'G':
+			if (!bufpool_parse_pages (optarg, &ops.buffer_pages))
+				die ("Invalid huge pages mode: %s.\n", optarg);
+			break;
+		case 'g': {
+			int grace = -1;
+			sscanf (optarg, "%d", &grace);
+			if (grace < 0)
+				die ("Invalid shutdown grace: %s.\n", optarg);
+			ops.shutdown_grace = grace;
+		} break;
+		case 'H':
+			ops.handoff_path = optarg;
+			break;
+		case 'U':
+			ops.local_path = optarg;
+			break;
 		case 'q':
 			vlogger.mode = VLOGGER_MODE_SILENT;
 			break;
@@ -354,6 +685,18 @@ main (int argc, char *argv[])
 	if (XMS_STORAGE_DIR == NULL)
 		XMS_STORAGE_DIR = ".";
 
+	/* daemons without internal threads, polled via their epoll fds */
+	if (ops.external) {
+		if (ops.thread_pool_size > 1)
+			die ("Thread pool is not supported by -X.\n");
+		ops.mode &= ~MHD_USE_SELECT_INTERNALLY;
+#if MHD_VERSION >= 0x00095100
+		ops.mode |= MHD_USE_EPOLL;
+#else
+		ops.mode |= MHD_USE_EPOLL_LINUX_ONLY;
+#endif
+	}
+
 	if (ops.daemonize)
 		daemonize ();
 
@@ -361,37 +704,134 @@ main (int argc, char *argv[])
 
 	vlogger_open (&vlogger);
 
+	/* counters are updated from now on (metrics.c) */
+	init_metrics ();
+
 	/* initialize server internal data (server.c) */
 	init_server_data ();
 
+	/* initialize ImageMagick (imagemagick.c) */
+	if (ops.convert_threads == 0)
+		ops.convert_threads = affinity_cpus (AFFINITY_CONVERT);
+	init_imagemagick (ops.convert_threads);
+
 	/* initialize MHD default responses (responses.c) */
 	init_mhd_responses ();
 
+	/* frame caches share one memory budget (budget.c) */
+	init_budget (ops.memory_budget);
+
+	/* uploads & frames are recycled buffers (bufpool.c) */
+	init_bufpool (ops.buffer_pages);
+
+	/* recent frames are kept in memory (frames.c) */
+	init_frames (ops.frames_ring_size, ops.frames_ring_memory);
+
+	/* live viewers share published frames (hub.c) */
+	init_hub ();
+
+	/* on-disk recording is optional (record.c) */
+	if (ops.record_dir != NULL)
+		init_recorder (ops.record_dir);
+
+	/* binary access log is optional (accesslog.c) */
+	if (ops.access_log != NULL)
+		init_access_log (ops.access_log);
+
+	/* frame stage events are optional (trace.c) */
+	if (ops.trace_file != NULL)
+		init_trace (ops.trace_file);
+
+	/* uploads may be captured for a replay (capture.c) */
+	if (ops.capture_file != NULL)
+		init_capture (ops.capture_file);
+
+	/* local consumers read frames from shared memory (shmstore.c) */
+	if (ops.shm_name != NULL)
+		init_shm_store (ops.shm_name);
+
+	/* the main thread runs daemons & publishes frames (eventloop.c) */
+	if (ops.external)
+		init_eventloop (ops.connect_timeout);
+
+	/* uploads are converted & published by the pipeline (pipeline.c) */
+	init_pipeline (ops.pipeline_depth, ops.backpressure, publish_frame,
+		ops.external ? eventloop_notify : NULL);
+
 	/* we store suspended connections in special pool (suspend.c) */
-	init_suspend_pool ();
+	init_suspend_pool (ops.suspend_queue_size);
 	
-	daemon = start_httpd (&ops);
+	/* a running server hands its listener over (handoff.c) */
+	if (ops.handoff_path != NULL)
+		ops.listen_fd = handoff_receive (ops.handoff_path);
+
+	log_httpd_options (&ops);
+	daemon = start_httpd (&ops, ops.listen_fd);
 
 	if (daemon == NULL) {
 		fatal ("failed to start daemon\n");
+		vlogger_close ();
 		return 1;
 	}
 
-	while (sigflag == 0)
-		sigsuspend (&zeromask);
-	sigflag = 0;
+	/* co-located clients skip TCP (localsock.c) */
+	if (ops.local_path != NULL) {
+		local_fd = localsock_open (ops.local_path);
 
-	note ("* Shutting down the daemon...\n");
+		if (local_fd != MHD_INVALID_SOCKET)
+			local_daemon = start_httpd (&ops, local_fd);
 
-	resume_all_connections ();
-	/* we have to wait a bit, to get a chance MHD resume connections properly */
-	nanosleep (&ts_wait, NULL);
+		if (local_daemon == NULL) {
+			fatal ("failed to start daemon on %s\n", ops.local_path);
+			stop_httpd (daemon);
+			vlogger_close ();
+			return 1;
+		}
+	}
+
+	if (ops.external) {
+		eventloop_add (daemon);
+		if (local_daemon != NULL)
+			eventloop_add (local_daemon);
+	}
+
+	if (ops.handoff_path != NULL)
+		handoff_serve (ops.handoff_path, daemon);
+
+	if (ops.external)
+		eventloop_run ();
+	else {
+		while (sigflag == 0)
+			sigsuspend (&zeromask);
+		sigflag = 0;
+	}
+
+	note ("* Shutting down the daemon...\n");
 
-	/* FIXME: replace default callbacks to stubs */
+	handoff_stop ();
+	quiesce_httpd (daemon);
+	if (local_daemon != NULL)
+		quiesce_httpd (local_daemon);
+	drain_httpd (ops.shutdown_grace, ops.external);
+	if (local_daemon != NULL)
+		MHD_stop_daemon (local_daemon);
+	localsock_close ();
 	stop_httpd (daemon);
+	free_pipeline ();
+	free_eventloop ();
+	free_shm_store ();
 	free_mhd_responses ();
 	free_suspend_pool ();
+	free_hub ();
+	free_recorder ();
+	free_access_log ();
+	free_trace ();
+	free_capture ();
+	free_frames ();
+	free_bufpool ();
 	free_server_data ();
+	free_imagemagick ();
+	free_metrics ();
 
 	vlogger_close ();
 
@@ -0,0 +1,630 @@
+#include "metrics.h"
+#include "atomics.h"
+#include "budget.h"
+#include "bufpool.h"
+#include "common.h"
+#include "pipeline.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* threads with a shard of their own, the rest share them */
+#define METRICS_SHARDS 64
+
+/*
+ * Values below 2^METRICS_SUB_SHIFT have a bucket each, every larger
+ * power of two up to 2^METRICS_MAX_SHIFT is split into 2^METRICS_SUB_SHIFT
+ * buckets. Values of 2^(METRICS_MAX_SHIFT + 1) and more go to the last
+ * bucket, which is rendered as +Inf only.
+ */
+#define METRICS_SUB_SHIFT 3
+#define METRICS_SUB (1 << METRICS_SUB_SHIFT)
+#define METRICS_MAX_SHIFT 40
+#define METRICS_BUCKETS ((METRICS_MAX_SHIFT - METRICS_SUB_SHIFT + 2) * METRICS_SUB)
+
+/* the initial size of the /metrics text */
+#define METRICS_TEXT_SIZE (16 * 1024)
+
+typedef struct _metrics_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[METRICS_BUCKETS];
+} metrics_histogram;
+
+typedef struct _metrics_shard {
+	/* a thread is using the shard, see get_shard () */
+	unsigned int owned;
+
+	uint64_t counters[METRIC_COUNTERS];
+	int64_t gauges[METRIC_GAUGES];
+	metrics_histogram histograms[METRIC_HISTOGRAMS];
+} metrics_shard;
+
+/* a metric family may be split by a label, entries of a family go in a row */
+typedef struct _metric_desc {
+	const char *name;
+	const char *label;
+	const char *help;
+} metric_desc;
+
+static const metric_desc counters[METRIC_COUNTERS] = {
+	[METRIC_UPLOADS] = { "xms_uploads_total", NULL,
+		"Finished uploads" },
+	[METRIC_UPLOAD_BYTES] = { "xms_upload_bytes_total", NULL,
+		"Bytes received by uploads" },
+	[METRIC_PARKED] = { "xms_suspended_total", NULL,
+		"Uploaders parked until the upload slot is free" },
+	[METRIC_EXPIRED] = { "xms_suspend_expired_total", NULL,
+		"Parked uploaders rejected after waiting too long" },
+	[METRIC_GET_2XX] = { "xms_get_requests_total", "code=\"2xx\"",
+		"GET requests by status" },
+	[METRIC_GET_3XX] = { "xms_get_requests_total", "code=\"3xx\"", NULL },
+	[METRIC_GET_4XX] = { "xms_get_requests_total", "code=\"4xx\"", NULL },
+	[METRIC_GET_5XX] = { "xms_get_requests_total", "code=\"5xx\"", NULL },
+	[METRIC_GET_BYTES] = { "xms_get_bytes_total", NULL,
+		"Bytes of GET responses, streams excluded" }
+};
+
+static const metric_desc gauges[METRIC_GAUGES] = {
+	[METRIC_CONNECTIONS] = { "xms_connections", NULL,
+		"Open connections" },
+	[METRIC_SUSPENDED] = { "xms_suspended", NULL,
+		"Uploaders parked right now" }
+};
+
+static const metric_desc histograms[METRIC_HISTOGRAMS] = {
+	[METRIC_UPLOAD_TIME] = { "xms_upload_duration_seconds", NULL,
+		"Time to receive an upload" },
+	[METRIC_SUSPEND_WAIT] = { "xms_suspend_wait_seconds", NULL,
+		"Time an uploader has been parked" },
+	[METRIC_DECODE_TIME] = { "xms_pipeline_stage_seconds",
+		"stage=\"decode\"", "Time a frame spends in a pipeline stage" },
+	[METRIC_DETECT_TIME] = { "xms_pipeline_stage_seconds",
+		"stage=\"detect\"", NULL },
+	[METRIC_ENCODE_TIME] = { "xms_pipeline_stage_seconds",
+		"stage=\"encode\"", NULL },
+	[METRIC_PUBLISH_TIME] = { "xms_pipeline_stage_seconds",
+		"stage=\"publish\"", NULL },
+	[METRIC_FIRST_SERVE] = { "xms_first_serve_seconds", NULL,
+		"Time from publishing a frame to serving it the first time" },
+	[METRIC_CAPTURE_TO_SERVE] = { "xms_capture_to_serve_seconds", NULL,
+		"Time from capturing a frame by a client to serving it "
+		"the first time" },
+	[METRIC_UPLOAD_SIZE] = { "xms_upload_size_bytes", NULL,
+		"Sizes of uploads" }
+};
+
+static const char *stage_names[PIPELINE_STAGES] = {
+	"decode",
+	"detect",
+	"encode",
+	"publish"
+};
+
+static metrics_shard *shards[METRICS_SHARDS];
+static unsigned int next_shared;
+
+static pthread_key_t shard_key;
+static bool key_created;
+
+/* the /metrics text being rendered */
+typedef struct _metrics_text {
+	char *buf;
+	size_t len;
+	size_t size;
+	bool failed;
+} metrics_text;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static void
+shard_release (void *ptr)
+{
+	metrics_shard *shard = ptr;
+
+	/* the counts are kept, the next thread goes on with them */
+	xms_atomic_store (&shard->owned, 0);
+}
+
+
+static metrics_shard *
+claim_shard (void)
+{
+	metrics_shard *shard, *expected;
+	unsigned int i, free_owner;
+
+
+	for (i = 0; i < METRICS_SHARDS; i++) {
+		shard = xms_atomic_load (&shards[i]);
+
+		if (shard == NULL) {
+			shard = calloc (1, sizeof (*shard));
+
+			if (shard == NULL)
+				break;
+
+			shard->owned = 1;
+			expected = NULL;
+
+			if (__atomic_compare_exchange_n (&shards[i], &expected,
+				shard, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				return shard;
+			}
+
+			/* somebody else has been faster */
+			free (shard);
+			shard = expected;
+		}
+
+		free_owner = 0;
+
+		if (__atomic_compare_exchange_n (&shard->owned, &free_owner, 1,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			return shard;
+		}
+	}
+
+	return NULL;
+}
+
+
+static metrics_shard *
+get_shard (void)
+{
+	metrics_shard *shard;
+	unsigned int i;
+
+
+	if (!key_created)
+		return NULL;
+
+	shard = pthread_getspecific (shard_key);
+
+	if (shard != NULL)
+		return shard;
+
+	shard = claim_shard ();
+
+	if (shard != NULL) {
+		if (pthread_setspecific (shard_key, shard) != 0) {
+			shard_release (shard);
+			return NULL;
+		}
+
+		return shard;
+	}
+
+	/* too many threads: any existing shard, updates are atomic anyway */
+	for (i = 0; i < METRICS_SHARDS; i++) {
+		shard = xms_atomic_load (&shards[
+			xms_atomic_inc (&next_shared) % METRICS_SHARDS]);
+
+		if (shard != NULL)
+			return shard;
+	}
+
+	return NULL;
+}
+
+
+static unsigned int
+bucket_for (uint64_t value)
+{
+	unsigned int msb;
+
+
+	if (value < METRICS_SUB)
+		return value;
+
+	msb = 63 - __builtin_clzll (value);
+
+	if (msb > METRICS_MAX_SHIFT)
+		return METRICS_BUCKETS - 1;
+
+	return (msb - METRICS_SUB_SHIFT + 1) * METRICS_SUB +
+		((value >> (msb - METRICS_SUB_SHIFT)) & (METRICS_SUB - 1));
+}
+
+
+/* the largest value of the bucket */
+static uint64_t
+bucket_upper (unsigned int bucket)
+{
+	unsigned int shift;
+	uint64_t lower;
+
+
+	if (bucket < METRICS_SUB)
+		return bucket;
+
+	shift = bucket / METRICS_SUB - 1;
+	lower = (uint64_t) (METRICS_SUB + bucket % METRICS_SUB) << shift;
+
+	return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+
+extern void
+init_metrics (void)
+{
+	if (pthread_key_create (&shard_key, shard_release) != 0)
+		die ("failed to initialize metrics\n");
+
+	key_created = true;
+}
+
+
+extern void
+free_metrics (void)
+{
+	unsigned int i;
+
+
+	if (!key_created)
+		return;
+
+	key_created = false;
+	(void) pthread_key_delete (shard_key);
+
+	for (i = 0; i < METRICS_SHARDS; i++) {
+		free (shards[i]);
+		shards[i] = NULL;
+	}
+}
+
+
+extern void
+metrics_count (enum metrics_counter counter, uint64_t n)
+{
+	metrics_shard *shard = get_shard ();
+
+	if (shard != NULL)
+		xms_atomic_add (&shard->counters[counter], n);
+}
+
+
+extern void
+metrics_gauge (enum metrics_gauge gauge, int64_t delta)
+{
+	metrics_shard *shard = get_shard ();
+
+	if (shard != NULL)
+		xms_atomic_add (&shard->gauges[gauge], delta);
+}
+
+
+extern void
+metrics_observe (enum metrics_histogram histogram, uint64_t value)
+{
+	metrics_shard *shard = get_shard ();
+	metrics_histogram *h;
+
+
+	if (shard == NULL)
+		return;
+
+	h = &shard->histograms[histogram];
+
+	xms_atomic_inc (&h->buckets[bucket_for (value)]);
+	xms_atomic_add (&h->sum, value);
+	xms_atomic_inc (&h->count);
+}
+
+
+extern void
+metrics_get_status (unsigned int status)
+{
+	if (status >= 200 && status < 300)
+		metrics_count (METRIC_GET_2XX, 1);
+	else if (status >= 300 && status < 400)
+		metrics_count (METRIC_GET_3XX, 1);
+	else if (status >= 400 && status < 500)
+		metrics_count (METRIC_GET_4XX, 1);
+	else if (status >= 500)
+		metrics_count (METRIC_GET_5XX, 1);
+}
+
+
+/* ------------------------------------------------------------------ */
+
+
+static void
+text_printf (metrics_text *t, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *buf;
+	int n;
+
+
+	for (;;) {
+		if (t->failed)
+			return;
+
+		va_start (ap, fmt);
+		n = vsnprintf (t->buf + t->len, t->size - t->len, fmt, ap);
+		va_end (ap);
+
+		if (n < 0) {
+			t->failed = true;
+			return;
+		}
+
+		if ((size_t) n < t->size - t->len) {
+			t->len += n;
+			return;
+		}
+
+		size = t->size * 2;
+		buf = realloc (t->buf, size);
+
+		if (buf == NULL) {
+			t->failed = true;
+			return;
+		}
+
+		t->buf = buf;
+		t->size = size;
+	}
+}
+
+
+static void
+text_family (metrics_text *t, const metric_desc *desc, const char *type)
+{
+	/* the rest of the family has no help */
+	if (desc->help != NULL)
+		text_printf (t, "# HELP %s %s\n# TYPE %s %s\n",
+			desc->name, desc->help, desc->name, type);
+}
+
+
+static void
+text_sample (metrics_text *t, const char *name, const char *label,
+             const char *value_fmt, ...)
+{
+	va_list ap;
+	char value[32];
+
+
+	va_start (ap, value_fmt);
+	(void) vsnprintf (value, sizeof (value), value_fmt, ap);
+	va_end (ap);
+
+	if (label != NULL)
+		text_printf (t, "%s{%s} %s\n", name, label, value);
+	else
+		text_printf (t, "%s %s\n", name, value);
+}
+
+
+static void
+render_histogram (metrics_text *t, enum metrics_histogram id)
+{
+	const metric_desc *desc = &histograms[id];
+	bool usec = (id != METRIC_UPLOAD_SIZE);
+	uint64_t buckets[METRICS_BUCKETS];
+	uint64_t count = 0, sum = 0, total = 0;
+	metrics_shard *shard;
+	metrics_histogram *h;
+	unsigned int i, b;
+	char le[32];
+
+
+	memset (buckets, 0, sizeof (buckets));
+
+	for (i = 0; i < METRICS_SHARDS; i++) {
+		shard = xms_atomic_load (&shards[i]);
+
+		if (shard == NULL)
+			continue;
+
+		h = &shard->histograms[id];
+
+		for (b = 0; b < METRICS_BUCKETS; b++)
+			buckets[b] += xms_atomic_load (&h->buckets[b]);
+
+		sum += xms_atomic_load (&h->sum);
+		count += xms_atomic_load (&h->count);
+	}
+
+	text_family (t, desc, "histogram");
+
+	/* empty buckets are skipped, `le' is cumulative anyway */
+	for (b = 0; b < METRICS_BUCKETS; b++) {
+		if (buckets[b] == 0)
+			continue;
+
+		total += buckets[b];
+
+		if (b == METRICS_BUCKETS - 1)
+			break;
+
+		if (usec)
+			snprintf (le, sizeof (le), "%.6f",
+				bucket_upper (b) / 1000000.0);
+		else
+			snprintf (le, sizeof (le), "%llu",
+				(unsigned long long) bucket_upper (b));
+
+		text_printf (t, "%s_bucket{%s%sle=\"%s\"} %llu\n",
+			desc->name,
+			(desc->label != NULL) ? desc->label : "",
+			(desc->label != NULL) ? "," : "",
+			le, (unsigned long long) total);
+	}
+
+	/* a scrape may race with updates, the count must not go back */
+	if (count < total)
+		count = total;
+
+	text_printf (t, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+		desc->name,
+		(desc->label != NULL) ? desc->label : "",
+		(desc->label != NULL) ? "," : "",
+		(unsigned long long) count);
+
+	if (desc->label != NULL)
+		text_printf (t, "%s_sum{%s} ", desc->name, desc->label);
+	else
+		text_printf (t, "%s_sum ", desc->name);
+
+	if (usec)
+		text_printf (t, "%.6f\n", sum / 1000000.0);
+	else
+		text_printf (t, "%llu\n", (unsigned long long) sum);
+
+	if (desc->label != NULL)
+		text_printf (t, "%s_count{%s} %llu\n",
+			desc->name, desc->label, (unsigned long long) count);
+	else
+		text_printf (t, "%s_count %llu\n",
+			desc->name, (unsigned long long) count);
+}
+
+
+static void
+render_stats (metrics_text *t)
+{
+	xms_stage_stats stages[PIPELINE_STAGES];
+	xms_bufpool_stats pool;
+	xms_budget_usage usage[BUDGET_CACHES];
+	char label[32];
+	unsigned int i;
+
+
+	pipeline_stats (stages);
+
+	text_printf (t, "# HELP xms_pipeline_frames_total "
+		"Frames processed by a pipeline stage\n"
+		"# TYPE xms_pipeline_frames_total counter\n");
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		snprintf (label, sizeof (label), "stage=\"%s\"", stage_names[i]);
+		text_sample (t, "xms_pipeline_frames_total", label, "%llu",
+			(unsigned long long) stages[i].frames);
+	}
+
+	text_printf (t, "# HELP xms_pipeline_dropped_total "
+		"Frames dropped at the input queue of a stage\n"
+		"# TYPE xms_pipeline_dropped_total counter\n");
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		snprintf (label, sizeof (label), "stage=\"%s\"", stage_names[i]);
+		text_sample (t, "xms_pipeline_dropped_total", label, "%llu",
+			(unsigned long long) stages[i].dropped);
+	}
+
+	text_printf (t, "# HELP xms_pipeline_discarded_total "
+		"Frames failed or unchanged at a stage\n"
+		"# TYPE xms_pipeline_discarded_total counter\n");
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		snprintf (label, sizeof (label), "stage=\"%s\"", stage_names[i]);
+		text_sample (t, "xms_pipeline_discarded_total", label, "%llu",
+			(unsigned long long) stages[i].discarded);
+	}
+
+	bufpool_stats (&pool);
+
+	text_printf (t, "# HELP xms_bufpool_hits_total "
+		"Buffers reused from the pool\n"
+		"# TYPE xms_bufpool_hits_total counter\n");
+	text_sample (t, "xms_bufpool_hits_total", NULL, "%llu",
+		(unsigned long long) pool.hits);
+	text_printf (t, "# HELP xms_bufpool_misses_total "
+		"Buffers mapped anew\n"
+		"# TYPE xms_bufpool_misses_total counter\n");
+	text_sample (t, "xms_bufpool_misses_total", NULL, "%llu",
+		(unsigned long long) pool.misses);
+
+	budget_usage (usage);
+
+	text_printf (t, "# HELP xms_memory_limit_bytes "
+		"The memory budget, 0 if there is none\n"
+		"# TYPE xms_memory_limit_bytes gauge\n");
+	text_sample (t, "xms_memory_limit_bytes", NULL, "%zu", budget_limit ());
+
+	text_printf (t, "# HELP xms_cache_bytes "
+		"Memory kept by a frame cache\n"
+		"# TYPE xms_cache_bytes gauge\n");
+	for (i = 0; i < BUDGET_CACHES; i++) {
+		snprintf (label, sizeof (label), "cache=\"%s\"",
+			budget_cache_name (i));
+		text_sample (t, "xms_cache_bytes", label, "%llu",
+			(unsigned long long) usage[i].bytes);
+	}
+
+	text_printf (t, "# HELP xms_cache_evicted_bytes_total "
+		"Memory evicted from a frame cache to stay within the budget\n"
+		"# TYPE xms_cache_evicted_bytes_total counter\n");
+	for (i = 0; i < BUDGET_CACHES; i++) {
+		snprintf (label, sizeof (label), "cache=\"%s\"",
+			budget_cache_name (i));
+		text_sample (t, "xms_cache_evicted_bytes_total", label, "%llu",
+			(unsigned long long) usage[i].evicted);
+	}
+}
+
+
+extern char *
+metrics_render (size_t *len)
+{
+	metrics_text t;
+	metrics_shard *shard;
+	uint64_t counter;
+	int64_t gauge;
+	unsigned int i, s;
+
+
+	t.size = METRICS_TEXT_SIZE;
+	t.len = 0;
+	t.failed = false;
+	t.buf = malloc (t.size);
+
+	if (t.buf == NULL)
+		return NULL;
+
+	for (i = 0; i < METRIC_COUNTERS; i++) {
+		counter = 0;
+
+		for (s = 0; s < METRICS_SHARDS; s++)
+			if ((shard = xms_atomic_load (&shards[s])) != NULL)
+				counter += xms_atomic_load (&shard->counters[i]);
+
+		text_family (&t, &counters[i], "counter");
+		text_sample (&t, counters[i].name, counters[i].label,
+			"%llu", (unsigned long long) counter);
+	}
+
+	for (i = 0; i < METRIC_GAUGES; i++) {
+		gauge = 0;
+
+		for (s = 0; s < METRICS_SHARDS; s++)
+			if ((shard = xms_atomic_load (&shards[s])) != NULL)
+				gauge += xms_atomic_load (&shard->gauges[i]);
+
+		text_family (&t, &gauges[i], "gauge");
+		text_sample (&t, gauges[i].name, gauges[i].label,
+			"%lld", (long long) gauge);
+	}
+
+	for (i = 0; i < METRIC_HISTOGRAMS; i++)
+		render_histogram (&t, i);
+
+	render_stats (&t);
+
+	if (t.failed) {
+		free (t.buf);
+		return NULL;
+	}
+
+	*len = t.len;
+
+	return t.buf;
+}
@@ -0,0 +1,76 @@
+#ifndef XMS_METRICS_H
+#define XMS_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counters & histograms behind /metrics (Prometheus text format).
+ * Every thread updates its own shard, so the hot paths never contend;
+ * a scrape sums the shards up. Histograms are log-linear: 8 buckets per
+ * power of two, i.e. a value is off by 12.5% at most.
+ */
+
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+enum metrics_counter {
+	METRIC_UPLOADS = 0,	/* finished uploads */
+	METRIC_UPLOAD_BYTES,	/* bytes received by uploads */
+	METRIC_PARKED,		/* uploaders parked (suspend.c) */
+	METRIC_EXPIRED,		/* parked uploaders resumed as expired */
+	METRIC_GET_2XX,		/* GET requests by status */
+	METRIC_GET_3XX,
+	METRIC_GET_4XX,
+	METRIC_GET_5XX,
+	METRIC_GET_BYTES,	/* GET body bytes, streams are not counted */
+	METRIC_COUNTERS
+};
+
+enum metrics_gauge {
+	METRIC_CONNECTIONS = 0,	/* open connections */
+	METRIC_SUSPENDED,	/* uploaders parked right now */
+	METRIC_GAUGES
+};
+
+enum metrics_histogram {
+	METRIC_UPLOAD_TIME = 0,	/* receiving an upload (usec) */
+	METRIC_SUSPEND_WAIT,	/* parked until resumed (usec) */
+	METRIC_DECODE_TIME,	/* per enum pipeline_stage, in order (usec) */
+	METRIC_DETECT_TIME,
+	METRIC_ENCODE_TIME,
+	METRIC_PUBLISH_TIME,
+	METRIC_FIRST_SERVE,	/* published -> served for the first time */
+	METRIC_CAPTURE_TO_SERVE,	/* X-Capture-Time -> the first serve */
+	METRIC_UPLOAD_SIZE,	/* bytes */
+	METRIC_HISTOGRAMS
+};
+
+
+extern void
+init_metrics (void);
+
+extern void
+free_metrics (void);
+
+/* all of the below are lock-free & may be called by any thread */
+extern void
+metrics_count (enum metrics_counter counter, uint64_t n);
+
+extern void
+metrics_gauge (enum metrics_gauge gauge, int64_t delta);
+
+extern void
+metrics_observe (enum metrics_histogram histogram, uint64_t value);
+
+/* counts a GET response by its status class */
+extern void
+metrics_get_status (unsigned int status);
+
+/*
+ * Renders all metrics, pipeline.c, bufpool.c & budget.c stats included.
+ * Returns a malloc ()ed text or NULL.
+ */
+extern char *
+metrics_render (size_t *len);
+
+#endif /* XMS_METRICS_H */
@@ -1,36 +1,69 @@
-#include <assert.h>
 #include "mhd_log.h"
 #include "vlogger.h"
 
 
+extern const char *
+mhd_peer (const struct sockaddr *addr, char *buf, size_t size)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	if (addr == NULL) {
+		snprintf (buf, size, "<unknown>");
+		return buf;
+	}
+
+	switch (addr->sa_family) {
+	case AF_INET: {
+		const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+
+		if (inet_ntop (AF_INET, &in->sin_addr, ip, sizeof (ip)) == NULL)
+			break;
+
+		snprintf (buf, size, "%s:%u", ip, ntohs (in->sin_port));
+		return buf;
+	}
+	case AF_INET6: {
+		const struct sockaddr_in6 *in6 =
+			(const struct sockaddr_in6 *) addr;
+
+		if (inet_ntop (AF_INET6, &in6->sin6_addr, ip, sizeof (ip)) == NULL)
+			break;
+
+		snprintf (buf, size, "[%s]:%u", ip, ntohs (in6->sin6_port));
+		return buf;
+	}
+	case AF_UNIX:
+		/* clients are unnamed, sun_path is not even filled */
+		snprintf (buf, size, "unix");
+		return buf;
+	default:
+		break;
+	}
+
+	snprintf (buf, size, "<unknown>");
+	return buf;
+}
+
+
 static void
 mhd_vlog (vlogger_level_t level,
           struct MHD_Connection *conn,
           const char *fmt, va_list ap)
 {
 	const union MHD_ConnectionInfo *ci;
-	char *ip = NULL;
-	in_port_t port = 0;
+	char peer[MHD_PEER_SIZE];
+	char buf[VLOGGER_RECORD_SIZE];
 
 	ci = MHD_get_connection_info (
 		conn,
 		MHD_CONNECTION_INFO_CLIENT_ADDRESS);
 
-	if (ci != NULL) {
-		struct sockaddr_in *addr_in = *(struct sockaddr_in **) ci;
-		ip = inet_ntoa (addr_in->sin_addr);
-		port = addr_in->sin_port;
-	}
-	else {
-		ip = "<unknown>";
-	}
+	(void) mhd_peer (ci != NULL ? ci->client_addr : NULL,
+	                 peer, sizeof (peer));
 
-	ssize_t bufsz = vsnprintf (NULL, 0, fmt, ap);
-	char *buf = malloc (bufsz + 1);
-	assert (buf != NULL);
-	vsnprintf (buf, bufsz + 1, fmt, ap);
-	vlogger_log (level, "%s:%u: %s\n", ip, port, buf);
-	free (buf);
+	/* longer messages are truncated by vlogger anyway */
+	(void) vsnprintf (buf, sizeof (buf), fmt, ap);
+	vlogger_log (level, "%s: %s\n", peer, buf);
 }
 
 
@@ -3,6 +3,16 @@
 
 #include "mhd.h"
 
+/* enough for "[<IPv6>]:<port>" */
+#define MHD_PEER_SIZE (INET6_ADDRSTRLEN + 8)
+
+/*
+ * formats a peer address as "ip:port" (or "unix" for Unix domain
+ * sockets) into `buf', returns `buf'
+ */
+extern const char *
+mhd_peer (const struct sockaddr *addr, char *buf, size_t size);
+
 extern void
 mhd_warn (struct MHD_Connection *connection, const char *fmt, ...);
 
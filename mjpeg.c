@@ -0,0 +1,105 @@
+#include "mjpeg.h"
+#include <stdio.h>
+#include <string.h>
+
+
+const char *MJPEG_CONTENT_TYPE =
+	"multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY;
+
+static const char PART_TAIL[] = "\r\n";
+static const char STREAM_END[] = "--" MJPEG_BOUNDARY "--\r\n";
+
+
+/* ------------------------------------------------------------------ */
+
+
+extern void
+mjpeg_part_init (mjpeg_part *part)
+{
+	memset (part->chunk_len, 0, sizeof (part->chunk_len));
+	part->current = MJPEG_CHUNK_MAX;
+	part->offset = 0;
+}
+
+
+extern void
+mjpeg_part_frame (mjpeg_part *part,
+		const unsigned char *data, size_t size,
+		uint64_t timestamp, uint64_t seq, const char *extra)
+{
+	int len;
+
+
+	len = snprintf (part->head, sizeof (part->head),
+		"--" MJPEG_BOUNDARY "\r\n"
+		"Content-Type: image/jpeg\r\n"
+		"Content-Length: %zu\r\n"
+		"X-Frame-Timestamp: %llu.%06llu\r\n",
+		size,
+		(unsigned long long) timestamp / 1000000,
+		(unsigned long long) timestamp % 1000000);
+
+	if (seq != 0)
+		len += snprintf (part->head + len, sizeof (part->head) - len,
+			"X-Frame-Seq: %llu\r\n", (unsigned long long) seq);
+
+	if (extra != NULL)
+		len += snprintf (part->head + len, sizeof (part->head) - len,
+			"%s", extra);
+
+	len += snprintf (part->head + len, sizeof (part->head) - len, "\r\n");
+
+	part->chunk[MJPEG_CHUNK_HEAD] = part->head;
+	part->chunk_len[MJPEG_CHUNK_HEAD] = len;
+	part->chunk[MJPEG_CHUNK_DATA] = (const char *) data;
+	part->chunk_len[MJPEG_CHUNK_DATA] = size;
+	part->chunk[MJPEG_CHUNK_TAIL] = PART_TAIL;
+	part->chunk_len[MJPEG_CHUNK_TAIL] = sizeof (PART_TAIL) - 1;
+	part->current = MJPEG_CHUNK_HEAD;
+	part->offset = 0;
+}
+
+
+extern void
+mjpeg_part_end (mjpeg_part *part)
+{
+	part->chunk[MJPEG_CHUNK_HEAD] = STREAM_END;
+	part->chunk_len[MJPEG_CHUNK_HEAD] = sizeof (STREAM_END) - 1;
+	part->chunk_len[MJPEG_CHUNK_DATA] = 0;
+	part->chunk_len[MJPEG_CHUNK_TAIL] = 0;
+	part->current = MJPEG_CHUNK_HEAD;
+	part->offset = 0;
+}
+
+
+extern bool
+mjpeg_part_done (const mjpeg_part *part)
+{
+	return part->current == MJPEG_CHUNK_MAX;
+}
+
+
+extern size_t
+mjpeg_part_copy (mjpeg_part *part, char *buf, size_t max)
+{
+	size_t total = 0, n;
+
+
+	while (total < max && part->current < MJPEG_CHUNK_MAX) {
+		n = part->chunk_len[part->current] - part->offset;
+
+		if (n > max - total)
+			n = max - total;
+
+		memcpy (buf + total, part->chunk[part->current] + part->offset, n);
+		total += n;
+		part->offset += n;
+
+		if (part->offset == part->chunk_len[part->current]) {
+			part->current++;
+			part->offset = 0;
+		}
+	}
+
+	return total;
+}
@@ -0,0 +1,59 @@
+#ifndef XMS_MJPEG_H
+#define XMS_MJPEG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define MJPEG_BOUNDARY "xmsframe"
+
+/* multipart/x-mixed-replace with our boundary */
+extern const char *MJPEG_CONTENT_TYPE;
+
+/*
+ * A part of an MJPEG stream is sent as three chunks: part headers,
+ * JPEG data (not copied, must stay valid until the part is sent) and
+ * a trailing CRLF.
+ */
+enum {
+	MJPEG_CHUNK_HEAD = 0,
+	MJPEG_CHUNK_DATA,
+	MJPEG_CHUNK_TAIL,
+	MJPEG_CHUNK_MAX
+};
+
+typedef struct _mjpeg_part {
+	const char *chunk[MJPEG_CHUNK_MAX];
+	size_t chunk_len[MJPEG_CHUNK_MAX];
+	size_t current;
+	size_t offset;
+	char head[512];
+} mjpeg_part;
+
+
+/* an empty part, i.e. mjpeg_part_done () is true */
+extern void
+mjpeg_part_init (mjpeg_part *part);
+
+/*
+ * `seq' is optional, zero means no X-Frame-Seq header. `extra' is NULL
+ * or more headers, each one is terminated by CRLF.
+ */
+extern void
+mjpeg_part_frame (mjpeg_part *part,
+		const unsigned char *data, size_t size,
+		uint64_t timestamp, uint64_t seq, const char *extra);
+
+/* the closing boundary of the stream */
+extern void
+mjpeg_part_end (mjpeg_part *part);
+
+extern bool
+mjpeg_part_done (const mjpeg_part *part);
+
+/* copies up to `max' bytes of the part, returns an amount copied */
+extern size_t
+mjpeg_part_copy (mjpeg_part *part, char *buf, size_t max);
+
+#endif /* XMS_MJPEG_H */
@@ -0,0 +1,176 @@
+/* Bounded MPMC queue by Dmitry Vyukov
+ *     https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+#include "mpmc.h"
+#include "atomics.h"
+
+#include <stdlib.h>
+
+#define MPMC_CACHE_LINE 64
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _mpmc_cell {
+	size_t		seq;
+	void		*data;
+};
+
+struct _mpmc_queue {
+	struct _mpmc_cell *cells;
+	size_t		mask;
+	char		pad0[MPMC_CACHE_LINE];
+	size_t		enqueue_pos;
+	char		pad1[MPMC_CACHE_LINE];
+	size_t		dequeue_pos;
+	char		pad2[MPMC_CACHE_LINE];
+};
+
+
+MPMC_QUEUE *
+mpmc_new(size_t capacity)
+{
+	MPMC_QUEUE *q;
+	size_t size = 2, i;
+
+
+	while (size < capacity)
+		size <<= 1;
+
+	q = malloc(sizeof(*q));
+
+	if (q == NULL)
+		return NULL;
+
+	q->cells = malloc(sizeof(*q->cells) * size);
+
+	if (q->cells == NULL) {
+		free(q);
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++)
+		q->cells[i].seq = i;
+
+	q->mask = size - 1;
+	q->enqueue_pos = 0;
+	q->dequeue_pos = 0;
+
+	return q;
+}
+
+
+void
+mpmc_destroy(MPMC_QUEUE *q)
+{
+	if (q != NULL) {
+		free(q->cells);
+		free(q);
+	}
+}
+
+
+bool
+mpmc_push(MPMC_QUEUE *q, void *e)
+{
+	struct _mpmc_cell *cell;
+	size_t pos, seq;
+	long diff;
+
+
+	pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = xms_atomic_load(&cell->seq);
+		diff = (long) seq - (long) pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->enqueue_pos,
+				&pos, pos + 1, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0) {
+			/* full */
+			return false;
+		}
+		else {
+			pos = __atomic_load_n(&q->enqueue_pos,
+				__ATOMIC_RELAXED);
+		}
+	}
+
+	cell->data = e;
+	xms_atomic_store(&cell->seq, pos + 1);
+
+	return true;
+}
+
+
+bool
+mpmc_pop(MPMC_QUEUE *q, void **e)
+{
+	struct _mpmc_cell *cell;
+	size_t pos, seq;
+	long diff;
+
+
+	pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = xms_atomic_load(&cell->seq);
+		diff = (long) seq - (long) (pos + 1);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->dequeue_pos,
+				&pos, pos + 1, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0) {
+			/* empty */
+			return false;
+		}
+		else {
+			pos = __atomic_load_n(&q->dequeue_pos,
+				__ATOMIC_RELAXED);
+		}
+	}
+
+	*e = cell->data;
+	xms_atomic_store(&cell->seq, pos + q->mask + 1);
+
+	return true;
+}
+
+
+size_t
+mpmc_count(MPMC_QUEUE *q)
+{
+	size_t head, tail;
+
+
+	tail = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+	return (head > tail) ? head - tail : 0;
+}
+
+
+size_t
+mpmc_capacity(MPMC_QUEUE *q)
+{
+	return q->mask + 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef XMS_MPMC_H
+#define XMS_MPMC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A bounded lock-free multi-producer/multi-consumer FIFO queue of
+ * pointers (Dmitry Vyukov's algorithm). Both push and pop are O(1)
+ * and never take a lock.
+ */
+typedef struct _mpmc_queue MPMC_QUEUE;
+
+/* `capacity' is rounded up to a power of two */
+MPMC_QUEUE * mpmc_new(size_t capacity);
+
+void mpmc_destroy(MPMC_QUEUE *q);
+
+/* Returns false if the queue is full. */
+bool mpmc_push(MPMC_QUEUE *q, void *e);
+
+/* Returns false if the queue is empty. */
+bool mpmc_pop(MPMC_QUEUE *q, void **e);
+
+/* An approximate amount of elements. */
+size_t mpmc_count(MPMC_QUEUE *q);
+
+size_t mpmc_capacity(MPMC_QUEUE *q);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* XMS_MPMC_H */
@@ -0,0 +1,412 @@
+#include "pipeline.h"
+#include "affinity.h"
+#include "atomics.h"
+#include "bufpool.h"
+#include "clock.h"
+#include "common.h"
+#include "imagemagick.h"
+#include "metrics.h"
+#include "spsc.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* a frame on its way through the pipeline */
+typedef struct _xms_job {
+	/* STAGE_DECODE: the uploaded XWD */
+	unsigned char *data;
+	size_t size;
+
+	/* STAGE_DETECT .. STAGE_PUBLISH: the decoded frame */
+	xms_image *image;
+
+	/* STAGE_PUBLISH: the encoded frame */
+	xms_frame *frame;
+
+	/* stage stamps, copied to the frame by the encode stage */
+	xms_frame_trace trace;
+
+	/* the end of the previous stage, monotonic (usec) */
+	uint64_t stamp;
+
+	/* per stage: time in the input queue & in the stage (usec) */
+	uint32_t wait[PIPELINE_STAGES];
+	uint32_t busy[PIPELINE_STAGES];
+} xms_job;
+
+/* returns false if the job must not go further */
+typedef bool (*stage_cb) (xms_job *job);
+
+static bool decode_stage (xms_job *job);
+static bool detect_stage (xms_job *job);
+static bool encode_stage (xms_job *job);
+static bool publish_stage (xms_job *job);
+
+static struct {
+	const char *name;
+	stage_cb run;
+	SPSC_QUEUE *in;
+	pthread_t thread;
+	xms_stage_stats stats;
+} stages[PIPELINE_STAGES] = {
+	{ "decode", decode_stage, NULL, 0, { 0, 0, 0, 0, 0 } },
+	{ "detect", detect_stage, NULL, 0, { 0, 0, 0, 0, 0 } },
+	{ "encode", encode_stage, NULL, 0, { 0, 0, 0, 0, 0 } },
+	{ "publish", publish_stage, NULL, 0, { 0, 0, 0, 0, 0 } }
+};
+
+static struct {
+	enum pipeline_backpressure mode;
+	pipeline_publish_cb publish;
+	pipeline_notify_cb notify;
+	bool running;
+
+	/* STAGE_DETECT: a signature of the last passed frame */
+	char *signature;
+} pl;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static void
+job_free (xms_job *job)
+{
+	bufpool_free (job->data);
+	image_destroy (job->image);
+	frame_unref (job->frame);
+	free (job);
+}
+
+
+static bool
+decode_stage (xms_job *job)
+{
+	job->image = image_decode (job->data, job->size);
+	job->trace.decoded = clock_usec (CLOCK_REALTIME);
+
+	/* the upload is not needed anymore */
+	bufpool_free (job->data);
+	job->data = NULL;
+
+	return job->image != NULL;
+}
+
+
+static bool
+detect_stage (xms_job *job)
+{
+	char *signature = image_signature (job->image);
+
+	/* can't tell, let it go */
+	if (signature == NULL)
+		return true;
+
+	if (pl.signature != NULL && strcmp (pl.signature, signature) == 0) {
+		convert_free (signature);
+		return false;
+	}
+
+	if (pl.signature != NULL)
+		convert_free (pl.signature);
+	pl.signature = signature;
+
+	return true;
+}
+
+
+static bool
+encode_stage (xms_job *job)
+{
+	unsigned char *blob;
+	size_t size;
+
+
+	if (!image_encode (job->image, &blob, &size))
+		return false;
+
+	job->trace.encoded = clock_usec (CLOCK_REALTIME);
+	job->frame = frame_new (size);
+
+	if (job->frame != NULL) {
+		memcpy (job->frame->data, blob, size);
+		job->frame->trace = job->trace;
+	}
+	else
+		error ("pipeline: failed to allocate frame: %zu bytes\n", size);
+
+	convert_free (blob);
+
+	return job->frame != NULL;
+}
+
+
+static bool
+publish_stage (xms_job *job)
+{
+	pl.publish (job->frame, job->image);
+	trace_published (job->frame);
+
+	return true;
+}
+
+
+static void
+log_timings (const xms_job *job)
+{
+	debug ("pipeline: frame %llu: decode %u+%u, detect %u+%u, "
+		"encode %u+%u, publish %u+%u usec (queue+work)\n",
+		(unsigned long long) job->frame->seq,
+		job->wait[STAGE_DECODE], job->busy[STAGE_DECODE],
+		job->wait[STAGE_DETECT], job->busy[STAGE_DETECT],
+		job->wait[STAGE_ENCODE], job->busy[STAGE_ENCODE],
+		job->wait[STAGE_PUBLISH], job->busy[STAGE_PUBLISH]);
+}
+
+
+static bool
+push_job (unsigned int stage, xms_job *job)
+{
+	bool wait = pl.mode == BACKPRESSURE_THROTTLE;
+
+
+	/*
+	 * with an event loop the uploader is the loop itself: it would
+	 * stall every connection and the publish stage it has to run
+	 */
+	if (stage == STAGE_DECODE && pl.notify != NULL)
+		wait = false;
+
+	if (spsc_push (stages[stage].in, job, wait))
+		return true;
+
+	xms_atomic_inc (&stages[stage].stats.dropped);
+
+	return false;
+}
+
+
+/* the last stage run by the event loop, see init_pipeline () */
+static bool
+external_stage (unsigned int id)
+{
+	return id == STAGE_PUBLISH && pl.notify != NULL;
+}
+
+
+static void
+run_job (unsigned int id, xms_job *job)
+{
+	xms_stage_stats *stats = &stages[id].stats;
+	uint64_t start, end;
+	bool ok;
+
+
+	start = clock_usec (CLOCK_MONOTONIC);
+	ok = stages[id].run (job);
+	end = clock_usec (CLOCK_MONOTONIC);
+
+	job->wait[id] = start - job->stamp;
+	job->busy[id] = end - start;
+	job->stamp = end;
+
+	xms_atomic_inc (&stats->frames);
+	xms_atomic_add (&stats->wait_usec, job->wait[id]);
+	xms_atomic_add (&stats->busy_usec, job->busy[id]);
+	metrics_observe (METRIC_DECODE_TIME + id, job->busy[id]);
+
+	if (!ok) {
+		xms_atomic_inc (&stats->discarded);
+		job_free (job);
+	}
+	else if (id + 1 == PIPELINE_STAGES) {
+		log_timings (job);
+		job_free (job);
+	}
+	else if (!push_job (id + 1, job))
+		job_free (job);
+	else if (external_stage (id + 1))
+		pl.notify ();
+}
+
+
+static void *
+stage_main (void *arg)
+{
+	unsigned int id = (uintptr_t) arg;
+	xms_job *job;
+
+
+	(void) affinity_pin (AFFINITY_CONVERT);
+
+	for (;;) {
+		job = spsc_pop (stages[id].in);
+
+		/* stop: pass it down */
+		if (job == NULL) {
+			if (id + 1 < PIPELINE_STAGES)
+				(void) spsc_push (stages[id + 1].in, NULL, true);
+			break;
+		}
+
+		run_job (id, job);
+	}
+
+	return NULL;
+}
+
+
+extern void
+init_pipeline (size_t depth, enum pipeline_backpressure mode,
+               pipeline_publish_cb publish, pipeline_notify_cb notify)
+{
+	unsigned int i;
+
+
+	pl.mode = mode;
+	pl.publish = publish;
+	pl.notify = notify;
+	pl.signature = NULL;
+
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		stages[i].in = spsc_new (depth);
+
+		if (stages[i].in == NULL)
+			die ("failed to initialize pipeline\n");
+	}
+
+	for (i = 0; i < PIPELINE_STAGES; i++)
+		if (!external_stage (i) &&
+		    pthread_create (&stages[i].thread, NULL, stage_main,
+			(void *) (uintptr_t) i) != 0)
+		{
+			die ("failed to start pipeline: %s\n", stages[i].name);
+		}
+
+	pl.running = true;
+}
+
+
+extern void
+free_pipeline (void)
+{
+	unsigned int i;
+
+
+	if (!pl.running)
+		return;
+
+	pl.running = false;
+
+	/* queued frames are processed before the stop */
+	(void) spsc_push (stages[0].in, NULL, true);
+
+	/*
+	 * The event loop is gone, the rest is published here. Nobody else
+	 * reads the publish queue, so it is drained until the stop passed
+	 * down by the encode stage, otherwise that stage may block on
+	 * a full queue and never be joined.
+	 */
+	if (pl.notify != NULL) {
+		xms_job *job;
+
+		while ((job = spsc_pop (stages[STAGE_PUBLISH].in)) != NULL)
+			run_job (STAGE_PUBLISH, job);
+	}
+
+	for (i = 0; i < PIPELINE_STAGES; i++)
+		if (!external_stage (i))
+			(void) pthread_join (stages[i].thread, NULL);
+
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		spsc_destroy (stages[i].in);
+		stages[i].in = NULL;
+	}
+
+	if (pl.signature != NULL) {
+		convert_free (pl.signature);
+		pl.signature = NULL;
+	}
+}
+
+
+extern bool
+pipeline_submit (unsigned char *data, size_t size,
+                 const xms_frame_trace *trace)
+{
+	xms_job *job = calloc (1, sizeof (*job));
+
+
+	if (job == NULL) {
+		bufpool_free (data);
+		return false;
+	}
+
+	job->data = data;
+	job->size = size;
+	job->trace = *trace;
+	job->stamp = clock_usec (CLOCK_MONOTONIC);
+
+	if (!push_job (STAGE_DECODE, job)) {
+		job_free (job);
+		return false;
+	}
+
+	return true;
+}
+
+
+extern void
+pipeline_publish_pending (void)
+{
+	void *job;
+
+
+	if (!pl.running || pl.notify == NULL)
+		return;
+
+	while (spsc_trypop (stages[STAGE_PUBLISH].in, &job)) {
+		/* the stop is left for free_pipeline () */
+		if (job == NULL) {
+			(void) spsc_push (stages[STAGE_PUBLISH].in, NULL, true);
+			break;
+		}
+
+		run_job (STAGE_PUBLISH, (xms_job *) job);
+	}
+}
+
+
+extern bool
+pipeline_parse_backpressure (const char *name,
+                             enum pipeline_backpressure *mode)
+{
+	if (strcmp (name, "throttle") == 0)
+		*mode = BACKPRESSURE_THROTTLE;
+	else if (strcmp (name, "drop") == 0)
+		*mode = BACKPRESSURE_DROP;
+	else
+		return false;
+
+	return true;
+}
+
+
+extern void
+pipeline_stats (xms_stage_stats stats[PIPELINE_STAGES])
+{
+	unsigned int i;
+
+
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		stats[i].frames = xms_atomic_load (&stages[i].stats.frames);
+		stats[i].dropped = xms_atomic_load (&stages[i].stats.dropped);
+		stats[i].discarded = xms_atomic_load (&stages[i].stats.discarded);
+		stats[i].wait_usec = xms_atomic_load (&stages[i].stats.wait_usec);
+		stats[i].busy_usec = xms_atomic_load (&stages[i].stats.busy_usec);
+	}
+}
@@ -0,0 +1,93 @@
+#ifndef XMS_PIPELINE_H
+#define XMS_PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "frames.h"
+#include "imagemagick.h"
+
+/*
+ * An uploaded frame goes through the stages below, each one runs on its
+ * own thread (but see init_pipeline ()) and is fed by a bounded SPSC
+ * queue. The receive stage is the uploader itself, see pipeline_submit ().
+ */
+enum pipeline_stage {
+	STAGE_DECODE = 0,	/* XWD -> raster */
+	STAGE_DETECT,		/* drops frames equal to the previous one */
+	STAGE_ENCODE,		/* raster -> JPEG */
+	STAGE_PUBLISH,		/* see the callback of init_pipeline () */
+	PIPELINE_STAGES
+};
+
+/* what to do when the next stage is behind */
+enum pipeline_backpressure {
+	BACKPRESSURE_THROTTLE = 0,	/* wait for it */
+	BACKPRESSURE_DROP		/* drop the frame */
+};
+
+/* cumulative counters of a stage */
+typedef struct _xms_stage_stats {
+	/* frames processed by the stage */
+	uint64_t frames;
+
+	/* frames dropped at the input queue of the stage (drop mode) */
+	uint64_t dropped;
+
+	/* frames discarded by the stage: failed or unchanged */
+	uint64_t discarded;
+
+	/* microseconds spent in the input queue & in the stage itself */
+	uint64_t wait_usec;
+	uint64_t busy_usec;
+} xms_stage_stats;
+
+/*
+ * Publishes an encoded frame, the pipeline keeps its own reference.
+ * The decoded image is valid during the call only.
+ */
+typedef void (*pipeline_publish_cb) (xms_frame *frame, xms_image *image);
+
+/* tells an event loop that pipeline_publish_pending () has work */
+typedef void (*pipeline_notify_cb) (void);
+
+
+/*
+ * Without `notify', the publish stage runs on its own thread. Otherwise
+ * there is no such thread: `notify' is called by the encode stage for
+ * every queued frame and the frames are published by the event loop,
+ * see pipeline_publish_pending (). The event loop never waits for the
+ * pipeline, so pipeline_submit () drops a frame if the decode queue is
+ * full even with BACKPRESSURE_THROTTLE.
+ */
+extern void
+init_pipeline (size_t depth, enum pipeline_backpressure mode,
+               pipeline_publish_cb publish, pipeline_notify_cb notify);
+
+/* drains queued frames and stops stage threads */
+extern void
+free_pipeline (void);
+
+/*
+ * Hands an uploaded frame (bufpool.c) over to the pipeline, the data
+ * is released by the pipeline in any case. `trace' has the capture &
+ * receive stamps, the rest is stamped by the stages. Returns false if
+ * the frame has been dropped. Must not be called concurrently, i.e.
+ * only by the owner of the upload slot.
+ */
+extern bool
+pipeline_submit (unsigned char *data, size_t size,
+                 const xms_frame_trace *trace);
+
+/* publishes frames queued so far, never blocks */
+extern void
+pipeline_publish_pending (void);
+
+extern bool
+pipeline_parse_backpressure (const char *name,
+                             enum pipeline_backpressure *mode);
+
+extern void
+pipeline_stats (xms_stage_stats stats[PIPELINE_STAGES]);
+
+#endif /* XMS_PIPELINE_H */
@@ -0,0 +1,170 @@
+#include "playback.h"
+#include "common.h"
+#include "drain.h"
+#include "mjpeg.h"
+#include "record.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* see MHD_create_response_from_callback () */
+#define PLAYBACK_BLOCK_SIZE (32 * 1024)
+
+
+typedef struct _playback_ctx {
+	/* a position of the current frame, holds the segment */
+	xms_record_pos pos;
+
+	/* sampling: the next moment to show, the range and the step */
+	uint64_t target;
+	uint64_t from;
+	uint64_t to;
+	uint64_t step;
+
+	/* a timestamp of the last sent frame */
+	uint64_t last_ts;
+	bool sent;
+	bool done;
+
+	/* the current part, its data is mapped from a segment file */
+	mjpeg_part part;
+} playback_ctx;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static bool
+next_frame (playback_ctx *ctx)
+{
+	const xms_record_entry *entry;
+	const unsigned char *data;
+	uint64_t ts;
+
+
+	while (ctx->target <= ctx->to) {
+		record_pos_release (&ctx->pos);
+
+		if (! record_seek (ctx->target, &ctx->pos))
+			return false;
+
+		entry = record_entry (&ctx->pos);
+
+		if (entry->timestamp > ctx->to)
+			return false;
+
+		if (ctx->sent && entry->timestamp <= ctx->last_ts) {
+			/*
+			 * nothing new at this moment, jump straight to
+			 * the sample where the next recorded frame appears
+			 */
+			if (! record_next (&ctx->pos))
+				return false;
+
+			ts = record_entry (&ctx->pos)->timestamp;
+			ctx->target = ctx->from +
+				(ts - ctx->from + ctx->step - 1) /
+				ctx->step * ctx->step;
+			continue;
+		}
+
+		ctx->target += ctx->step;
+
+		if ((data = record_data (&ctx->pos)) == NULL)
+			return false;
+
+		ctx->last_ts = entry->timestamp;
+		ctx->sent = true;
+
+		mjpeg_part_frame (&ctx->part, data, entry->length,
+			entry->timestamp, 0, NULL);
+
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * Frames are copied straight from the page cache mappings into MHD
+ * buffers: there are no intermediate buffers and no re-encoding.
+ */
+static ssize_t
+playback_reader_cb (void *cls, uint64_t pos, char *buf, size_t max)
+{
+	playback_ctx *ctx = cls;
+	size_t total = 0;
+
+
+	(void) pos;
+
+	while (total < max) {
+		if (mjpeg_part_done (&ctx->part)) {
+			if (ctx->done)
+				break;
+
+			/* a shutdown ends the stream between frames */
+			if (drain_active () || ! next_frame (ctx)) {
+				record_pos_release (&ctx->pos);
+				mjpeg_part_end (&ctx->part);
+				ctx->done = true;
+			}
+		}
+
+		total += mjpeg_part_copy (&ctx->part, buf + total, max - total);
+	}
+
+	if (total == 0)
+		return MHD_CONTENT_READER_END_OF_STREAM;
+
+	return total;
+}
+
+
+static void
+playback_free_cb (void *cls)
+{
+	playback_ctx *ctx = cls;
+
+	record_pos_release (&ctx->pos);
+	free (ctx);
+}
+
+
+extern struct MHD_Response *
+playback_response (uint64_t from, uint64_t to, uint64_t step)
+{
+	playback_ctx *ctx;
+	struct MHD_Response *response;
+
+
+	ctx = calloc (1, sizeof (*ctx));
+
+	if (ctx == NULL)
+		return NULL;
+
+	ctx->from = from;
+	ctx->target = from;
+	ctx->to = to;
+	ctx->step = (step > 0) ? step : 1;
+	mjpeg_part_init (&ctx->part);
+
+	if (! next_frame (ctx)) {
+		playback_free_cb (ctx);
+		return NULL;
+	}
+
+	response = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN,
+		PLAYBACK_BLOCK_SIZE,
+		&playback_reader_cb,
+		ctx,
+		&playback_free_cb);
+
+	if (response == NULL)
+		playback_free_cb (ctx);
+
+	return response;
+}
@@ -0,0 +1,16 @@
+#ifndef XMS_PLAYBACK_H
+#define XMS_PLAYBACK_H
+
+#include "mhd.h"
+#include <stdint.h>
+
+
+/*
+ * Creates an MJPEG response of recorded frames between `from' and `to'
+ * (microseconds since the Epoch) sampled every `step' microseconds.
+ * Returns NULL if there are no frames in the range.
+ */
+extern struct MHD_Response *
+playback_response (uint64_t from, uint64_t to, uint64_t step);
+
+#endif /* XMS_PLAYBACK_H */
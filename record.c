@@ -0,0 +1,679 @@
+#include "record.h"
+#include "atomics.h"
+#include "common.h"
+#include "mutex.h"
+#include "vector.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+/* a segment is closed when its data file exceeds this size */
+#ifndef RECORD_SEGMENT_SIZE
+#define RECORD_SEGMENT_SIZE (256 * 1024 * 1024)
+#endif
+
+/* ... or when its index is full */
+#ifndef RECORD_SEGMENT_FRAMES
+#define RECORD_SEGMENT_FRAMES (64 * 1024)
+#endif
+
+#define SEGMENT_NAME_FMT "%s/xms-%020llu.%s"
+
+
+struct _xms_segment {
+	/* a timestamp of the first frame, a part of file names */
+	uint64_t start;
+
+	/* memory-mapped index, `capacity' entries are mapped */
+	xms_record_entry *index;
+	size_t capacity;
+
+	/* an amount of valid entries, grows while recording */
+	size_t count;
+
+	/* the writer side, -1 for closed segments */
+	int data_fd;
+	uint64_t data_size;
+
+	/*
+	 * Data file is preallocated for active segments, thus it could be
+	 * mapped once for the segment lifetime, see record_data ().
+	 */
+	uint64_t data_length;
+	void *data_map;
+
+	unsigned int refcount;
+};
+
+
+/* segments sorted by a start time, the last one may be active */
+static VECTOR *segments;
+static SIMPLE_MUTEX *segments_mutex;
+static xms_segment *active;
+static char *record_dir;
+
+/*
+ * The last recorded timestamp. Frames are stamped by the real-time
+ * clock, which may step back; recorded timestamps never do, so the
+ * segments and their indexes stay sorted for binary search.
+ */
+static uint64_t last_timestamp;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static void
+segment_path (char *path, const xms_segment *seg, const char *ext)
+{
+	snprintf (path, PATH_MAX, SEGMENT_NAME_FMT,
+		record_dir, (unsigned long long) seg->start, ext);
+}
+
+
+static xms_segment *
+segment_ref (xms_segment *seg)
+{
+	xms_atomic_inc (&seg->refcount);
+	return seg;
+}
+
+
+static void
+segment_unref (xms_segment *seg)
+{
+	if (xms_atomic_dec (&seg->refcount) != 0)
+		return;
+
+	if (seg->index != NULL)
+		(void) munmap (seg->index,
+			seg->capacity * sizeof (xms_record_entry));
+
+	if (seg->data_map != NULL)
+		(void) munmap (seg->data_map, seg->data_length);
+
+	if (seg->data_fd != -1)
+		(void) close (seg->data_fd);
+
+	free (seg);
+}
+
+
+static xms_segment *
+segment_alloc (uint64_t start)
+{
+	xms_segment *seg = malloc (sizeof (*seg));
+
+	if (seg == NULL)
+		return NULL;
+
+	seg->start = start;
+	seg->index = NULL;
+	seg->capacity = 0;
+	seg->count = 0;
+	seg->data_fd = -1;
+	seg->data_size = 0;
+	seg->data_length = 0;
+	seg->data_map = NULL;
+	seg->refcount = 1;
+
+	return seg;
+}
+
+
+/*
+ * The index of an active segment is preallocated, unused entries are
+ * zeroed. Timestamps are monotonic, so the amount of valid entries
+ * could be found by binary search.
+ */
+static size_t
+count_entries (const xms_record_entry *index, size_t capacity)
+{
+	size_t lo = 0, hi = capacity, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (index[mid].timestamp != 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+static xms_segment *
+segment_load (uint64_t start)
+{
+	xms_segment *seg;
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+	void *map;
+
+
+	seg = segment_alloc (start);
+
+	if (seg == NULL)
+		return NULL;
+
+	segment_path (path, seg, "idx");
+	fd = open (path, O_RDWR);
+
+	if (fd == -1 || fstat (fd, &st) != 0) {
+		error ("record: open `%s': %s\n", path, strerror (errno));
+		goto failed;
+	}
+
+	seg->capacity = st.st_size / sizeof (xms_record_entry);
+
+	if (seg->capacity == 0)
+		goto failed;
+
+	map = mmap (NULL, seg->capacity * sizeof (xms_record_entry),
+		PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		error ("record: mmap `%s': %s\n", path, strerror (errno));
+		goto failed;
+	}
+
+	seg->index = map;
+	seg->count = count_entries (seg->index, seg->capacity);
+
+	/* the segment was active when we have been stopped */
+	if (seg->count < seg->capacity)
+		(void) ftruncate (fd, seg->count * sizeof (xms_record_entry));
+
+	(void) close (fd);
+
+	if (seg->count == 0) {
+		segment_unref (seg);
+		return NULL;
+	}
+
+	/* the data file is also preallocated, cut it to the last frame */
+	seg->data_size = seg->index[seg->count - 1].offset +
+		seg->index[seg->count - 1].length;
+	seg->data_length = seg->data_size;
+
+	segment_path (path, seg, "dat");
+	if (stat (path, &st) != 0 || (uint64_t) st.st_size < seg->data_size) {
+		error ("record: `%s' is truncated or missing\n", path);
+		segment_unref (seg);
+		return NULL;
+	}
+
+	if ((uint64_t) st.st_size > seg->data_size)
+		(void) truncate (path, seg->data_size);
+
+	return seg;
+
+failed:
+	if (fd != -1)
+		(void) close (fd);
+	segment_unref (seg);
+	return NULL;
+}
+
+
+static xms_segment *
+segment_create (uint64_t start, size_t first_size)
+{
+	xms_segment *seg;
+	char path[PATH_MAX];
+	size_t mapsize;
+	int fd;
+	void *map;
+
+
+	seg = segment_alloc (start);
+
+	if (seg == NULL)
+		return NULL;
+
+	/* a huge frame gets its own segment */
+	seg->data_length = RECORD_SEGMENT_SIZE;
+	if (seg->data_length < first_size + sizeof (uint32_t))
+		seg->data_length = first_size + sizeof (uint32_t);
+
+	/* never truncate a segment, readers may have it mapped */
+	segment_path (path, seg, "dat");
+	seg->data_fd = open (path, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (seg->data_fd == -1 || ftruncate (seg->data_fd, seg->data_length)) {
+		error ("record: create `%s': %s\n", path, strerror (errno));
+		segment_unref (seg);
+		return NULL;
+	}
+
+	segment_path (path, seg, "idx");
+	fd = open (path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	mapsize = RECORD_SEGMENT_FRAMES * sizeof (xms_record_entry);
+
+	if (fd == -1 || ftruncate (fd, mapsize) != 0) {
+		error ("record: create `%s': %s\n", path, strerror (errno));
+		if (fd != -1)
+			(void) close (fd);
+		segment_unref (seg);
+		return NULL;
+	}
+
+	map = mmap (NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	(void) close (fd);
+
+	if (map == MAP_FAILED) {
+		error ("record: mmap `%s': %s\n", path, strerror (errno));
+		segment_unref (seg);
+		return NULL;
+	}
+
+	seg->index = map;
+	seg->capacity = RECORD_SEGMENT_FRAMES;
+
+	return seg;
+}
+
+
+static void
+segment_close (xms_segment *seg)
+{
+	char path[PATH_MAX];
+
+
+	/* the mapping (if any) is still valid up to data_size */
+	(void) ftruncate (seg->data_fd, seg->data_size);
+	(void) close (seg->data_fd);
+	seg->data_fd = -1;
+
+	/* drop the preallocated tail, the mapping is still valid */
+	segment_path (path, seg, "idx");
+	if (truncate (path, seg->count * sizeof (xms_record_entry)) != 0)
+		warn ("record: truncate `%s': %s\n", path, strerror (errno));
+}
+
+
+static int
+segment_cmp (const void *a, const void *b)
+{
+	const xms_segment *x = *(const xms_segment * const *) a;
+	const xms_segment *y = *(const xms_segment * const *) b;
+
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+
+static void
+load_segments (void)
+{
+	DIR *dir;
+	struct dirent *de;
+	unsigned long long start;
+	char ext[4];
+	xms_segment *seg;
+	void *entry;
+
+
+	last_timestamp = 0;
+	dir = opendir (record_dir);
+
+	if (dir == NULL)
+		die ("FATAL ERROR: open recording directory `%s': %s\n",
+			record_dir, strerror (errno));
+
+	while ((de = readdir (dir)) != NULL) {
+		if (sscanf (de->d_name, "xms-%llu.%3s", &start, ext) != 2)
+			continue;
+
+		if (strncmp (ext, "idx", 4) != 0)
+			continue;
+
+		if ((seg = segment_load (start)) != NULL)
+			if (! vector_add (segments, seg))
+				die ("FATAL ERROR: add segment: %s\n",
+					strerror (vector_get_errno (segments)));
+	}
+
+	(void) closedir (dir);
+
+	vector_qsort (segments, segment_cmp);
+
+	/* carry on after the recording, whatever the clock says now */
+	if (vector_get (segments, vector_count (segments) - 1, &entry)) {
+		seg = entry;
+		last_timestamp = seg->index[seg->count - 1].timestamp;
+	}
+}
+
+
+extern void
+init_recorder (const char *dirpath)
+{
+	record_dir = strdup (dirpath);
+	segments = vector_new ();
+
+	if (record_dir == NULL || segments == NULL)
+		die ("failed to initialize recorder\n");
+
+	segments_mutex = simple_mutex_create ();
+	simple_mutex_init (segments_mutex);
+
+	load_segments ();
+
+	info ("* Recording to `%s', %zu segments found\n",
+		record_dir, vector_count (segments));
+}
+
+
+extern void
+free_recorder (void)
+{
+	size_t i;
+	void *entry;
+
+
+	if (segments == NULL)
+		return;
+
+	if (active != NULL) {
+		segment_close (active);
+		active = NULL;
+	}
+
+	for (i = 0; i < vector_count (segments); i++)
+		if (vector_get (segments, i, &entry))
+			segment_unref ((xms_segment *) entry);
+
+	vector_reset (segments);
+	vector_destroy (segments);
+	segments = NULL;
+
+	simple_mutex_destroy (segments_mutex);
+	free (segments_mutex);
+	free (record_dir);
+	record_dir = NULL;
+}
+
+
+extern bool
+recorder_enabled (void)
+{
+	return segments != NULL;
+}
+
+
+extern void
+record_frame (const xms_frame *frame)
+{
+	uint32_t length = frame->size;
+	uint64_t timestamp = frame->timestamp;
+	struct iovec iov[2];
+	xms_record_entry *entry;
+	void *last;
+	ssize_t written;
+
+
+	if (segments == NULL)
+		return;
+
+	simple_mutex_lock (segments_mutex);
+
+	if (timestamp < last_timestamp)
+		timestamp = last_timestamp;
+
+	if (active != NULL &&
+		(active->count == active->capacity ||
+		 active->data_size + sizeof (length) + frame->size >
+			active->data_length))
+	{
+		segment_close (active);
+		active = NULL;
+	}
+
+	if (active == NULL) {
+		/* segment names (start times) must be unique */
+		if (vector_get (segments, vector_count (segments) - 1, &last) &&
+			((xms_segment *) last)->start >= timestamp)
+		{
+			timestamp = ((xms_segment *) last)->start + 1;
+		}
+
+		active = segment_create (timestamp, frame->size);
+
+		if (active == NULL || ! vector_add (segments, active)) {
+			simple_mutex_unlock (segments_mutex);
+			error ("record: failed to start a new segment\n");
+			if (active != NULL)
+				segment_unref (active);
+			active = NULL;
+			return;
+		}
+	}
+
+	iov[0].iov_base = &length;
+	iov[0].iov_len = sizeof (length);
+	iov[1].iov_base = frame->data;
+	iov[1].iov_len = frame->size;
+
+	written = writev (active->data_fd, iov, 2);
+
+	if (written != (ssize_t) (sizeof (length) + frame->size)) {
+		error ("record: write: %s\n",
+			(written < 0) ? strerror (errno) : "short write");
+		/* a partial record is not indexed, start over */
+		segment_close (active);
+		active = NULL;
+		simple_mutex_unlock (segments_mutex);
+		return;
+	}
+
+	entry = &active->index[active->count];
+	entry->timestamp = timestamp;
+	entry->offset = active->data_size + sizeof (length);
+	entry->length = frame->size;
+
+	active->data_size += written;
+	last_timestamp = timestamp;
+	/* publish the entry for readers */
+	xms_atomic_store (&active->count, active->count + 1);
+
+	simple_mutex_unlock (segments_mutex);
+}
+
+
+/* must be called with the segments mutex held */
+static size_t
+find_segment (uint64_t timestamp)
+{
+	size_t lo = 0, hi = vector_count (segments), mid;
+	void *entry;
+
+
+	/* the last segment started at or before `timestamp' */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		(void) vector_get (segments, mid, &entry);
+
+		if (((xms_segment *) entry)->start <= timestamp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo > 0) ? lo - 1 : 0;
+}
+
+
+static size_t
+find_entry (const xms_segment *seg, size_t count, uint64_t timestamp)
+{
+	size_t lo = 0, hi = count, mid;
+
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (seg->index[mid].timestamp <= timestamp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo > 0) ? lo - 1 : 0;
+}
+
+
+extern bool
+record_seek (uint64_t timestamp, xms_record_pos *pos)
+{
+	void *entry = NULL;
+	size_t count;
+
+
+	pos->segment = NULL;
+	pos->index = 0;
+
+	if (segments == NULL)
+		return false;
+
+	simple_mutex_lock (segments_mutex);
+
+	if (vector_count (segments) > 0 &&
+		vector_get (segments, find_segment (timestamp), &entry))
+	{
+		pos->segment = segment_ref ((xms_segment *) entry);
+	}
+
+	simple_mutex_unlock (segments_mutex);
+
+	if (pos->segment == NULL)
+		return false;
+
+	count = xms_atomic_load (&pos->segment->count);
+
+	if (count == 0) {
+		record_pos_release (pos);
+		return false;
+	}
+
+	pos->index = find_entry (pos->segment, count, timestamp);
+
+	return true;
+}
+
+
+extern bool
+record_next (xms_record_pos *pos)
+{
+	size_t i;
+	void *entry = NULL;
+	xms_segment *next = NULL;
+
+
+	if (pos->segment == NULL)
+		return false;
+
+	if (pos->index + 1 < xms_atomic_load (&pos->segment->count)) {
+		pos->index++;
+		return true;
+	}
+
+	simple_mutex_lock (segments_mutex);
+
+	i = find_segment (pos->segment->start);
+
+	if (i + 1 < vector_count (segments) &&
+		vector_get (segments, i + 1, &entry))
+	{
+		next = segment_ref ((xms_segment *) entry);
+	}
+
+	simple_mutex_unlock (segments_mutex);
+
+	if (next == NULL || xms_atomic_load (&next->count) == 0) {
+		if (next != NULL)
+			segment_unref (next);
+		return false;
+	}
+
+	segment_unref (pos->segment);
+	pos->segment = next;
+	pos->index = 0;
+
+	return true;
+}
+
+
+extern const xms_record_entry *
+record_entry (const xms_record_pos *pos)
+{
+	return &pos->segment->index[pos->index];
+}
+
+
+extern const unsigned char *
+record_data (const xms_record_pos *pos)
+{
+	xms_segment *seg = pos->segment;
+	void *map, *expected = NULL;
+	char path[PATH_MAX];
+	int fd;
+
+
+	map = xms_atomic_load (&seg->data_map);
+
+	if (map == NULL) {
+		segment_path (path, seg, "dat");
+		fd = open (path, O_RDONLY);
+
+		if (fd == -1) {
+			error ("record: open `%s': %s\n", path, strerror (errno));
+			return NULL;
+		}
+
+		map = mmap (NULL, seg->data_length, PROT_READ, MAP_SHARED,
+			fd, 0);
+		(void) close (fd);
+
+		if (map == MAP_FAILED) {
+			error ("record: mmap `%s': %s\n", path, strerror (errno));
+			return NULL;
+		}
+
+		/* somebody else could map the segment in the meantime */
+		if (! __atomic_compare_exchange_n (&seg->data_map, &expected,
+			map, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			(void) munmap (map, seg->data_length);
+			map = expected;
+		}
+	}
+
+	return (const unsigned char *) map + seg->index[pos->index].offset;
+}
+
+
+extern void
+record_pos_release (xms_record_pos *pos)
+{
+	if (pos->segment != NULL) {
+		segment_unref (pos->segment);
+		pos->segment = NULL;
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef XMS_RECORD_H
+#define XMS_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "frames.h"
+
+/*
+ * A recording consists of segments, each one is a pair of files:
+ *
+ *   xms-<start>.dat - length-prefixed JPEGs: uint32_t length + data
+ *   xms-<start>.idx - an array of fixed-width xms_record_entry
+ *
+ * where <start> is a timestamp of the first frame in microseconds.
+ * All numbers are stored in the host byte order.
+ */
+
+typedef struct _xms_record_entry {
+	/* microseconds since the Epoch */
+	uint64_t timestamp;
+
+	/* offset of the JPEG data within the data file */
+	uint64_t offset;
+
+	/* length of the JPEG data */
+	uint64_t length;
+} xms_record_entry;
+
+typedef struct _xms_segment xms_segment;
+
+/* a position within the recording, see record_seek () */
+typedef struct _xms_record_pos {
+	xms_segment *segment;
+	size_t index;
+} xms_record_pos;
+
+
+extern void
+init_recorder (const char *dirpath);
+
+extern void
+free_recorder (void);
+
+extern bool
+recorder_enabled (void);
+
+/* appends a published frame to the current segment */
+extern void
+record_frame (const xms_frame *frame);
+
+/*
+ * Finds the last frame recorded at or before `timestamp', or the very
+ * first one if there is no such a frame. On success `pos' holds
+ * a reference to a segment, release it by record_pos_release ().
+ */
+extern bool
+record_seek (uint64_t timestamp, xms_record_pos *pos);
+
+/* moves `pos' to the next frame, possibly within the next segment */
+extern bool
+record_next (xms_record_pos *pos);
+
+extern const xms_record_entry *
+record_entry (const xms_record_pos *pos);
+
+/* JPEG data of the frame, mapped directly from the data file */
+extern const unsigned char *
+record_data (const xms_record_pos *pos);
+
+extern void
+record_pos_release (xms_record_pos *pos);
+
+#endif /* XMS_RECORD_H */
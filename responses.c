@@ -46,6 +46,14 @@
 "<h1>File not found.</h1>"\
 "</body></html>\r\n"
 
+#define _BUSY "<html>" _HEAD_TITLE \
+"<body>"\
+"<h1>Server is busy, try again later.</h1>"\
+"</body></html>\r\n"
+
+/* seconds, see XMS_PAGE_BUSY */
+#define BUSY_RETRY_AFTER "1"
+
 
 /* global definition */
 struct MHD_Response *XMS_RESPONSES[XMS_PAGE_MAX];
@@ -65,6 +73,7 @@ init_mhd_responses (void)
 	XMS_PAGES[XMS_PAGE_BAD_REQUEST] = _BAD_REQUEST;
 	XMS_PAGES[XMS_PAGE_BAD_METHOD] = _BAD_METHOD;
 	XMS_PAGES[XMS_PAGE_NOT_FOUND] = _NOT_FOUND;
+	XMS_PAGES[XMS_PAGE_BUSY] = _BUSY;
 
 	for (i = 0; i < XMS_PAGE_MAX; i++) {
 		XMS_RESPONSES[i] = MHD_create_response_from_buffer (
@@ -83,6 +92,14 @@ init_mhd_responses (void)
 			die ("failed to add header to response #%d\n", i);
 		}
 	}
+
+	if (MHD_NO == MHD_add_response_header (
+		XMS_RESPONSES[XMS_PAGE_BUSY],
+		MHD_HTTP_HEADER_RETRY_AFTER,
+		BUSY_RETRY_AFTER))
+	{
+		die ("failed to add header to response #%d\n", XMS_PAGE_BUSY);
+	}
 }
 
 
@@ -3,13 +3,32 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <sys/stat.h>
-
+#include <time.h>
+
+#include "accesslog.h"
+#include "affinity.h"
+#include "arena.h"
+#include "budget.h"
+#include "bufpool.h"
+#include "capture.h"
+#include "clock.h"
 #include "common.h"
 #include "contexts.h"
-#include "imagemagick.h"
+#include "drain.h"
+#include "frames.h"
+#include "hub.h"
+#include "metrics.h"
 #include "mhd.h"
+#include "mjpeg.h"
+#include "pipeline.h"
+#include "playback.h"
+#include "record.h"
 #include "responses.h"
+#include "server.h"
+#include "shmstore.h"
+#include "slot.h"
 #include "suspend.h"
+#include "trace.h"
 #include "mhd_log.h"
 
 #ifndef _WIN32
@@ -34,31 +53,21 @@
 char *XMS_STORAGE_DIR = NULL;
 
 /*
- * temporary & target filepaths, see init_server_data () 
+ * a temporary filepath, see init_server_data () & publish_frame ()
  */
 #ifndef TEMP_FILENAME
 #define TEMP_FILENAME "xms-temp"
 #endif
 static char *XMS_TEMP_FILE;
 
-#ifndef DEST_FILENAME
-#define DEST_FILENAME "xms-dest"
-#endif
-static char *XMS_DEST_FILE;
-
 /*
- * a converted file (imagemagick.c) 
+ * the latest published frame, see publish_frame ()
  */
 #ifndef CONV_FILENAME
 #define CONV_FILENAME "xms.jpg"
 #endif
 static char *XMS_CONV_FILE;
 
-/*
- * we allow only one uploader per a moment 
- */
-volatile bool busy = false;
-
 /*
  * From libmicrohttpd manual: maximum number of bytes to use for internal
  * buffering (used only for the parsing, specifically the parsing of the
@@ -67,6 +76,29 @@ volatile bool busy = false;
  */
 #define POST_BUFFER_SIZE (64 * 1024)
 
+/*
+ * an upload is received into memory: the initial buffer size & a limit,
+ * see upload_post_chunk ()
+ */
+#define UPLOAD_BUFFER_SIZE (256 * 1024)
+
+#ifndef UPLOAD_MAX_SIZE
+#define UPLOAD_MAX_SIZE (64 * 1024 * 1024)
+#endif
+
+/*
+ * /playback: fps is clamped to this range, so a step between frames
+ * fits into microseconds
+ */
+#define PLAYBACK_MIN_FPS 0.01
+#define PLAYBACK_MAX_FPS 1000.0
+
+/*
+ * timestamps in seconds are less than this, so they fit into uint64_t
+ * microseconds (UINT64_MAX / 10^6 is about 1.8e13)
+ */
+#define TIMESTAMP_MAX_SEC 1.8e13
+
 /*
  * From MHD manual, MHD_create_response_from_callback (): block size
  * preferred block size for querying crc (advisory only, MHD may still
@@ -81,6 +113,35 @@ volatile bool busy = false;
  */
 #define XMS_FILE_CONTENT_TYPE "image/jpeg"
 
+/*
+ * the frames index (/frames) content type
+ */
+#define XMS_INDEX_CONTENT_TYPE "application/json"
+
+/*
+ * a size of an entry in the frames index, see process_frames_request ()
+ */
+#define INDEX_ENTRY_SIZE 96
+
+/*
+ * a size of the memory report (/memory), see process_memory_request ()
+ */
+#define MEMORY_REPORT_SIZE 512
+
+/*
+ * max. size of an upload head in the capture, see capture_upload ()
+ */
+#define CAPTURE_HEAD_SIZE (8 * 1024)
+
+/*
+ * a request head being built for the capture
+ */
+typedef struct _capture_head {
+    char *buf;
+    size_t len;
+    size_t size;
+} capture_head;
+
 
 static MHD_RESULT
 upload_post_chunk (void *coninfo_cls,
@@ -93,21 +154,80 @@ upload_post_chunk (void *coninfo_cls,
                    uint64_t off,
                    size_t size);
 
-static FILE *open_file (struct MHD_Response **response,
-                        unsigned int *status);
+static bool
+upload_reserve (request_ctx *req, size_t size);
+
+static MHD_RESULT
+queue_response (struct MHD_Connection *connection, request_ctx *req,
+                unsigned int status, struct MHD_Response *response);
+
+static void
+stage_mark (request_ctx *req, enum access_stage stage);
+
+static void
+log_access (struct MHD_Connection *connection, request_ctx *req,
+            enum MHD_RequestTerminationCode toe);
 
 static void
 destroy_request_ctx (request_ctx *req);
 
+static void
+capture_upload (struct MHD_Connection *connection, request_ctx *req,
+                const char *url, const char *method, const char *version);
+
+static void
+capture_finish (request_ctx *req, bool complete);
+
+static bool
+parse_frame_url (const char *url, uint64_t *seq);
+
+static bool
+parse_timestamp (const char *value, uint64_t *usec);
+
+static bool
+parse_capture_headers (struct MHD_Connection *connection,
+                       xms_frame_trace *trace);
+
+static MHD_RESULT
+add_frame_headers (struct MHD_Response *response, const xms_frame *frame);
+
 static int
 process_get_request (struct MHD_Connection *connection, request_ctx *req);
 
+static int
+queue_frame (struct MHD_Connection *connection, request_ctx *req,
+             xms_frame *frame);
+
+static int
+process_frame_request (struct MHD_Connection *connection, request_ctx *req);
+
+static int
+process_frames_request (struct MHD_Connection *connection, request_ctx *req);
+
+static int
+process_playback_request (struct MHD_Connection *connection, request_ctx *req);
+
+static int
+process_memory_request (struct MHD_Connection *connection, request_ctx *req);
+
+static int
+process_metrics_request (struct MHD_Connection *connection, request_ctx *req);
+
+static int
+process_stream_request (struct MHD_Connection *connection, request_ctx *req);
+
 static ssize_t
 file_reader_cb (void *cls, uint64_t pos, char *buf, size_t max);
 
 static void
 file_reader_free_cb (void *cls);
 
+static ssize_t
+frame_reader_cb (void *cls, uint64_t pos, char *buf, size_t max);
+
+static void
+frame_reader_free_cb (void *cls);
+
 
 /* ------------------------------------------------------------------ */
 
@@ -117,18 +237,16 @@ accept_policy_cb (void *cls,
                   const struct sockaddr *addr,
                   socklen_t addrlen)
 {
+    affinity_pin_once (AFFINITY_MHD);
+
 #if defined(_DEBUG)
-    struct sockaddr_in *addr_in = (struct sockaddr_in *) addr;
+    char peer[MHD_PEER_SIZE];
 
     (void) cls;
     (void) addrlen;
 
-    /*
-     * ???: inet_ntop/WSAAddressToString
-     */
-    debug ("* Connection from %s port %d\n",
-           inet_ntoa (addr_in->sin_addr),
-           addr_in->sin_port);
+    debug ("* Connection from %s\n",
+           mhd_peer (addr, peer, sizeof (peer)));
 #else
     (void) cls;
     (void) addr;
@@ -151,24 +269,44 @@ answer_cb (void *cls,
     request_ctx *req = *con_cls;
 
     (void) cls;
-    (void) version;
+
+    affinity_pin_once (AFFINITY_MHD);
 
     if (req == NULL) {
         /*
          * initialize our request information
          */
-        req = malloc (sizeof (*req));
+        xms_arena *arena = arena_new ();
 
-        if (req == NULL) {
-            mhd_error (connection, "malloc (req) failed");
+        if (arena == NULL ||
+            (req = arena_alloc (arena, sizeof (*req))) == NULL)
+        {
+            arena_release (arena);
+            mhd_error (connection, "arena (req) failed");
             return MHD_NO;
         }
 
+        req->arena = arena;
         req->status = 0;        /* we are not finished yet */
         req->pp = NULL;
-        req->fh = NULL;
+        req->upload = NULL;
+        req->upload_size = 0;
+        req->upload_alloc = 0;
         req->uploader = false;
-        req->getfile = false;
+        req->token = slot_token ();
+        req->park = NULL;
+        memset (&req->trace, 0, sizeof (req->trace));
+        req->capture_id = 0;
+        req->resource = RES_DEFAULT;
+        req->frame_seq = 0;
+        req->method = ACCESS_METHOD_OTHER;
+        req->started = clock_usec (CLOCK_REALTIME);
+        req->mark = clock_usec (CLOCK_MONOTONIC);
+        req->begin = req->mark;
+        req->bytes_in = 0;
+        req->bytes_out = 0;
+        req->sent_status = 0;
+        memset (req->stage, 0, sizeof (req->stage));
 
         /*
          * initialize post processor
@@ -187,14 +325,36 @@ answer_cb (void *cls,
             }
 
             req->type = POST;
+            req->method = ACCESS_METHOD_POST;
+
+            if (capture_enabled ())
+                capture_upload (connection, req, url, method, version);
+
+            if (!parse_capture_headers (connection, &req->trace)) {
+                req->response = XMS_RESPONSES[XMS_PAGE_BAD_REQUEST];
+                req->status = MHD_HTTP_BAD_REQUEST;
+            }
         }
         else if (0 == strcasecmp (method, MHD_HTTP_METHOD_GET)) {
             req->type = GET;
+            req->method = ACCESS_METHOD_GET;
 
             mhd_note (connection, "GET %s", url);
 
             if (strncmp (url, "/get.jpg", 9) == 0)
-                req->getfile = true;
+                req->resource = RES_FILE;
+            else if (strncmp (url, "/frames", 8) == 0)
+                req->resource = RES_FRAMES;
+            else if (strncmp (url, "/playback", 10) == 0)
+                req->resource = RES_PLAYBACK;
+            else if (strncmp (url, "/stream", 8) == 0)
+                req->resource = RES_STREAM;
+            else if (strncmp (url, "/memory", 8) == 0)
+                req->resource = RES_MEMORY;
+            else if (strncmp (url, "/metrics", 9) == 0)
+                req->resource = RES_METRICS;
+            else if (parse_frame_url (url, &req->frame_seq))
+                req->resource = RES_FRAME;
 
             if (strncmp (url, "/favicon.ico", 13) == 0) {
                 req->response = XMS_RESPONSES[XMS_PAGE_NOT_FOUND];
@@ -207,6 +367,7 @@ answer_cb (void *cls,
         }
 
         *con_cls = (void *) req;
+        drain_enter ();
 
         return MHD_YES;
     }
@@ -215,13 +376,11 @@ answer_cb (void *cls,
         /*
          * something went wrong...
          */
-        if (req->uploader && busy) {
+        if (req->uploader && slot_release (req->token)) {
             /*
              * we've failed in the middle of upload
              */
-            busy = false;
             req->uploader = false;
-            (void) remove (XMS_TEMP_FILE);
             resume_next ();
         }
 
@@ -230,13 +389,16 @@ answer_cb (void *cls,
              * we can send a response only after reading all
              * headers & data.
              */
-            return MHD_queue_response (connection, req->status,
+            capture_finish (req, true);
+
+            return queue_response (connection, req, req->status,
                                        req->response);
         }
         else {
             /*
              * do nothing and wait until all headers & data
              */
+            capture_data (req->capture_id, upload_data, *upload_data_size);
             *upload_data_size = 0;
 
             return MHD_YES;
@@ -244,42 +406,90 @@ answer_cb (void *cls,
     }
 
     if (req->type == POST) {
-        if (busy && !req->uploader) {
+        if (req->park != NULL) {
             /*
-             * no need to update upload_data_size, because
-             * overwise we have to store the first data chunk
-             * somewhere and if we don't we will lost
-             * the filename header & data too.
+             * we have been resumed
              */
-            suspend_connection (connection);
+            bool expired = suspend_expired (req->park);
 
-            return MHD_YES;
+            suspend_release (req->park);
+            req->park = NULL;
+
+            if (expired) {
+                /*
+                 * waited too long for the slot (eventloop.c)
+                 */
+                req->response = XMS_RESPONSES[XMS_PAGE_BUSY];
+                req->status = MHD_HTTP_SERVICE_UNAVAILABLE;
+
+                return MHD_YES;
+            }
         }
 
-        if (*upload_data_size > 0) {
-            /*
-             * uploading data
-             */
-            if (MHD_YES ==
-                MHD_post_process (req->pp, upload_data,
-                                  *upload_data_size))
-            {
-                busy = true;
+        if (!req->uploader) {
+            if (drain_active ()) {
+                /*
+                 * shutting down, don't start new uploads
+                 */
+                req->response = XMS_RESPONSES[XMS_PAGE_BUSY];
+                req->status = MHD_HTTP_SERVICE_UNAVAILABLE;
 
+                return MHD_YES;
+            }
+
+            if (!slot_acquire (req->token)) {
                 /*
-                 * we do this only once to prevent a spam
-                 * "uploading..."
+                 * no need to update upload_data_size, because
+                 * overwise we have to store the first data chunk
+                 * somewhere and if we don't we will lost
+                 * the filename header & data too.
                  */
-                if (!req->uploader) {
+                req->park = suspend_connection (connection);
+
+                if (req->park == NULL) {
+                    /*
+                     * too many waiting uploaders
+                     */
+                    req->response = XMS_RESPONSES[XMS_PAGE_BUSY];
+                    req->status = MHD_HTTP_SERVICE_UNAVAILABLE;
+                }
+                else if (drain_active ()) {
+                    /*
+                     * we were queued after resume_all_connections ()
+                     */
+                    resume_all_connections ();
+                }
+                else if (slot_state () == SLOT_IDLE) {
                     /*
-                     * seems to be everything is good
+                     * the slot has been released before we were
+                     * queued, nobody else would wake us up
                      */
-                    req->uploader = true;
-                    mhd_debug (connection, "uploading...");
+                    resume_next ();
                 }
+
+                return MHD_YES;
             }
-            else {
-                (void) remove (XMS_TEMP_FILE);
+
+            /*
+             * we own the slot until slot_release ()
+             */
+            req->uploader = true;
+            stage_mark (req, ACCESS_STAGE_WAIT);
+            mhd_debug (connection, "uploading...");
+        }
+
+        if (*upload_data_size > 0) {
+            /*
+             * uploading data
+             */
+            req->bytes_in += *upload_data_size;
+            metrics_count (METRIC_UPLOAD_BYTES, *upload_data_size);
+            capture_data (req->capture_id, upload_data, *upload_data_size);
+
+            if (MHD_NO ==
+                MHD_post_process (req->pp, upload_data,
+                                  *upload_data_size))
+            {
                 mhd_error (connection, "upload has been failed");
             }
 
@@ -294,14 +504,7 @@ answer_cb (void *cls,
         /*
          * there is no more data
          */
-
-        if (req->fh != NULL) {
-            /*
-             * close the file ASAP
-             */
-            (void) fclose (req->fh);
-            req->fh = NULL;
-        }
+        capture_finish (req, true);
 
         if (req->status == 0) {
             /*
@@ -309,26 +512,45 @@ answer_cb (void *cls,
              */
             req->response = XMS_RESPONSES[XMS_PAGE_COMPLETED];
             req->status = MHD_HTTP_OK;
-
-            errno = 0;
-            if (rename (XMS_TEMP_FILE, XMS_DEST_FILE) == 0) {
-                mhd_debug (connection, "converting...");
-
-                if (convert (XMS_DEST_FILE, XMS_CONV_FILE))
-                    mhd_debug (connection, "uploaded!");
-                else
-                    mhd_debug (connection, "uploaded with error: convert");
+            stage_mark (req, ACCESS_STAGE_RECEIVE);
+            req->trace.received = clock_usec (CLOCK_REALTIME);
+            metrics_observe (METRIC_UPLOAD_TIME,
+                             req->stage[ACCESS_STAGE_RECEIVE]);
+
+            if (req->upload_size == 0) {
+                req->response = XMS_RESPONSES[XMS_PAGE_BAD_REQUEST];
+                req->status = MHD_HTTP_BAD_REQUEST;
+            }
+            else if (!slot_advance (req->token,
+                                    SLOT_RECEIVING, SLOT_SUBMITTING))
+            {
+                mhd_error (connection, "uploaded with error: lost slot");
             }
             else {
                 /*
-                 * XXX: fatal error??
-                 */
-                /*
-                 * delete the temp file, it is not needed anymore
+                 * the pipeline owns the data from now on, the next
+                 * upload may be received while this one is converted
                  */
-                (void) remove (XMS_TEMP_FILE);
-                mhd_error (connection,
-                      "uploaded with error: rename: %s", strerror (errno));
+                bool queued;
+
+                metrics_count (METRIC_UPLOADS, 1);
+                metrics_observe (METRIC_UPLOAD_SIZE, req->upload_size);
+
+                queued = pipeline_submit (req->upload, req->upload_size,
+                                          &req->trace);
+
+                req->upload = NULL;
+                req->upload_size = 0;
+                req->upload_alloc = 0;
+                stage_mark (req, ACCESS_STAGE_SUBMIT);
+
+                if (queued)
+                    mhd_debug (connection, "uploaded!");
+                else {
+                    mhd_debug (connection, "uploaded, but dropped");
+                    req->response = XMS_RESPONSES[XMS_PAGE_BUSY];
+                    req->status = MHD_HTTP_SERVICE_UNAVAILABLE;
+                }
             }
         }
 
@@ -336,12 +558,12 @@ answer_cb (void *cls,
          * Job done:
          * process a new request ASAP, e.g. before conn. closing
          */
-        if (busy) {
-            busy = false;
+        if (req->uploader && slot_release (req->token)) {
+            req->uploader = false;
             resume_next ();
         }
 
-        return MHD_queue_response (connection, req->status, req->response);
+        return queue_response (connection, req, req->status, req->response);
     }
 
     /*
@@ -361,8 +583,6 @@ upload_post_chunk (void *con_cls,
                    const char *data, uint64_t off, size_t size)
 {
     request_ctx *req = con_cls; /* we expect that it is OK */
-    struct MHD_Response *response;
-    unsigned int status;
 
     (void) kind;
     (void) content_type;
@@ -378,90 +598,99 @@ upload_post_chunk (void *con_cls,
     }
 
     /*
-     * open file
-     */
-    if (req->fh == NULL) {
-        req->fh = open_file (&response, &status);
-
-        if (req->fh == NULL) {
-            /*
-             * we failed to open a file
-             */
-            req->response = response;
-            req->status = status;
-
-            return MHD_NO;
-        }
-    }
-
-    /*
-     * write the data
+     * store the data
      */
     if (size > 0) {
-        if (!fwrite (data, sizeof (char), size, req->fh)) {
+        if (!upload_reserve (req, size)) {
             req->response = XMS_RESPONSES[XMS_PAGE_IO_ERROR];
             req->status = MHD_HTTP_INTERNAL_SERVER_ERROR;
 
             return MHD_NO;
         }
+
+        memcpy (req->upload + req->upload_size, data, size);
+        req->upload_size += size;
     }
 
     return MHD_YES;
 }
 
 
-static FILE *
-open_file (struct MHD_Response **response, unsigned int *status)
+static bool
+upload_reserve (request_ctx *req, size_t size)
 {
-    static FILE *fh;
+    size_t need = req->upload_size + size;
+    unsigned char *upload;
+
+    if (need <= req->upload_alloc)
+        return true;
+
+    if (need > UPLOAD_MAX_SIZE) {
+        error ("upload is too large: more than %zu bytes\n",
+               (size_t) UPLOAD_MAX_SIZE);
+        return false;
+    }
+
+    if (need < UPLOAD_BUFFER_SIZE)
+        need = UPLOAD_BUFFER_SIZE;
 
     /*
-     * check if the file exists
+     * size classes of the pool are powers of two,
+     * so the buffer grows geometrically
      */
-    fh = fopen (XMS_TEMP_FILE, "rb");
+    upload = bufpool_realloc (req->upload, need);
 
-    if (fh == NULL) {
-        /*
-         * try to create a new file
-         */
-        fh = fopen (XMS_TEMP_FILE, "ab");
-
-        if (fh == NULL) {
-            fprintf (stderr,
-                     "failed to open file `%s': %s\n",
-                     XMS_TEMP_FILE, strerror (errno));
-            *response = XMS_RESPONSES[XMS_PAGE_IO_ERROR];
-            *status = MHD_HTTP_INTERNAL_SERVER_ERROR;
-        }
-    }
-    else {
-        /*
-         * file exists
-         */
-        (void) fclose (fh);
-        fh = NULL;
-        *response = XMS_RESPONSES[XMS_PAGE_FILE_EXISTS];
-        *status = MHD_HTTP_FORBIDDEN;
+    if (upload == NULL) {
+        error ("failed to allocate upload buffer: %zu bytes\n", need);
+        return false;
     }
 
-    return fh;
+    req->upload = upload;
+    req->upload_alloc = bufpool_capacity (upload);
+
+    return true;
 }
 
 
 static int
 process_get_request (struct MHD_Connection *connection, request_ctx * req)
 {
+    xms_frame *frame;
     FILE *fh;
     int fd;
     struct stat st;
     struct MHD_Response *response;
     int ret;
 
-    if (!req->getfile) {
-        return MHD_queue_response (connection, MHD_HTTP_OK,
+    switch (req->resource) {
+    case RES_FILE:
+        break;
+    case RES_FRAME:
+        return process_frame_request (connection, req);
+    case RES_FRAMES:
+        return process_frames_request (connection, req);
+    case RES_PLAYBACK:
+        return process_playback_request (connection, req);
+    case RES_STREAM:
+        return process_stream_request (connection, req);
+    case RES_MEMORY:
+        return process_memory_request (connection, req);
+    case RES_METRICS:
+        return process_metrics_request (connection, req);
+    default:
+        return queue_response (connection, req, MHD_HTTP_OK,
                                    XMS_RESPONSES[XMS_PAGE_DEFAULT]);
     }
 
+    /*
+     * the newest frame with the headers of /frame/<seq>.jpg, the file
+     * is left by a previous run until a frame is published
+     */
+    frame = frames_latest ();
+
+    if (frame != NULL)
+        return queue_frame (connection, req, frame);
+
     fh = fopen (XMS_CONV_FILE, "rb");
 
     if (fh != NULL) {
@@ -483,10 +712,11 @@ process_get_request (struct MHD_Connection *connection, request_ctx * req)
     }
 
     if (fh == NULL)
-        return MHD_queue_response (connection,
+        return queue_response (connection, req,
                                    MHD_HTTP_NOT_FOUND,
                                    XMS_RESPONSES[XMS_PAGE_NOT_FOUND]);
 
+    req->bytes_out = st.st_size;
     response =
         MHD_create_response_from_callback (st.st_size, READ_BUFFER_SIZE,
                                            &file_reader_cb,
@@ -503,116 +733,818 @@ process_get_request (struct MHD_Connection *connection, request_ctx * req)
         return MHD_NO;
     }
 
-    ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+    ret = queue_response (connection, req, MHD_HTTP_OK, response);
     MHD_destroy_response (response);
 
     return ret;
 }
 
 
-static ssize_t
-file_reader_cb (void *cls, uint64_t pos, char *buf, size_t max)
+/* sends a frame of the ring, the reference is taken over */
+static int
+queue_frame (struct MHD_Connection *connection, request_ctx *req,
+             xms_frame *frame)
 {
-    FILE *fh = (FILE *) cls;
+    struct MHD_Response *response;
+    int ret;
 
-    (void) fseek (fh, pos, SEEK_SET);
+    frame_served (frame);
+    req->bytes_out = frame->size;
+    response =
+        MHD_create_response_from_callback (frame->size, READ_BUFFER_SIZE,
+                                           &frame_reader_cb,
+                                           frame,
+                                           &frame_reader_free_cb);
 
-    return fread (buf, 1, max, fh);
+    if (response == NULL) {
+        frame_unref (frame);
+
+        return MHD_NO;
+    }
+
+    ret = MHD_add_response_header (response,
+                                   MHD_HTTP_HEADER_CONTENT_TYPE,
+                                   XMS_FILE_CONTENT_TYPE);
+
+    if (ret != MHD_NO)
+        ret = add_frame_headers (response, frame);
+
+    if (ret == MHD_NO) {
+        /* the frame is released by frame_reader_free_cb () */
+        MHD_destroy_response (response);
+
+        return MHD_NO;
+    }
+
+    ret = queue_response (connection, req, MHD_HTTP_OK, response);
+    MHD_destroy_response (response);
+
+    return ret;
 }
 
 
-static void
-file_reader_free_cb (void *cls)
+static int
+process_frame_request (struct MHD_Connection *connection, request_ctx *req)
 {
-    FILE *fh = (FILE *) cls;
+    xms_frame *frame;
 
-    (void) fclose (fh);
+    frame = frames_get (req->frame_seq);
+
+    if (frame == NULL)
+        return queue_response (connection, req,
+                                   MHD_HTTP_NOT_FOUND,
+                                   XMS_RESPONSES[XMS_PAGE_NOT_FOUND]);
+
+    return queue_frame (connection, req, frame);
 }
 
 
-extern void
-request_completed_cb (void *cls,
-                      struct MHD_Connection *connection,
-                      void **con_cls, enum MHD_RequestTerminationCode toe)
+static int
+process_frames_request (struct MHD_Connection *connection, request_ctx *req)
 {
-    request_ctx *req = *con_cls;
+    xms_frame_info *list;
+    size_t count, i, len, bufsize;
+    char *buf;
+    struct MHD_Response *response;
+    int ret;
 
-    (void) cls;
-#if defined(_DEBUG)
-    char *tdesc;
-    const union MHD_ConnectionInfo *ci;
-    char *ip_addr;
-    in_port_t port;
-#else
-    (void) connection;
-    (void) toe;
-#endif
+    /* the snapshot is gone with the request */
+    list = arena_alloc (req->arena, sizeof (*list) * frames_capacity ());
 
-#if defined(_DEBUG)
-    ci = MHD_get_connection_info (connection,
-                                  MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+    if (list == NULL)
+        return MHD_NO;
 
-    if (ci != NULL) {
-        struct sockaddr_in *addr_in = *(struct sockaddr_in **) ci;
+    count = frames_list (list, frames_capacity ());
+    bufsize = (count + 1) * INDEX_ENTRY_SIZE;
+    buf = malloc (bufsize);
+
+    if (buf == NULL)
+        return MHD_NO;
 
-        ip_addr = inet_ntoa (addr_in->sin_addr);
-        port = addr_in->sin_port;
-    } else {
-        ip_addr = "<unknown>";
-        port = 0;
+    len = snprintf (buf, bufsize, "{\"frames\":[");
+
+    for (i = 0; i < count; i++) {
+        len += snprintf (buf + len, bufsize - len,
+                         "%s{\"seq\":%llu,\"timestamp\":%llu.%06llu,"
+                         "\"size\":%zu}",
+                         (i > 0) ? "," : "",
+                         (unsigned long long) list[i].seq,
+                         (unsigned long long) list[i].timestamp / 1000000,
+                         (unsigned long long) list[i].timestamp % 1000000,
+                         list[i].size);
     }
 
-    switch (toe) {
-    case MHD_REQUEST_TERMINATED_COMPLETED_OK:
-        tdesc = "OK";
-        break;
-    case MHD_REQUEST_TERMINATED_WITH_ERROR:
-        tdesc = "ERROR";
-        break;
-    case MHD_REQUEST_TERMINATED_TIMEOUT_REACHED:
-        tdesc = "TIMED OUT";
-        break;
-    case MHD_REQUEST_TERMINATED_DAEMON_SHUTDOWN:
-        tdesc = "SHUTDOWN";
-        break;
-    case MHD_REQUEST_TERMINATED_READ_ERROR:
-        tdesc = "READ ERROR";
-        break;
-    case MHD_REQUEST_TERMINATED_CLIENT_ABORT:
-        tdesc = "CLIENT ABORT";
-        break;
-    default:
-        tdesc = "UNKNOWN";
-        break;
-    }                           /* switch (toe) { */
+    len += snprintf (buf + len, bufsize - len, "]}\r\n");
 
-    debug ("* Connection %s port %d closed: %s\n", ip_addr, port, tdesc);
-#endif
+    req->bytes_out = len;
+    response = MHD_create_response_from_buffer (len, buf,
+                                                MHD_RESPMEM_MUST_FREE);
 
-    if (busy && req->uploader) {
-        busy = false;
-        req->uploader = false;
-        (void) remove (XMS_TEMP_FILE);
-        resume_next ();
-    }
+    if (response == NULL) {
+        free (buf);
 
-    if (req != NULL) {
-        destroy_request_ctx (req);
-        *con_cls = NULL;
+        return MHD_NO;
     }
-}
 
+    ret = MHD_add_response_header (response,
+                                   MHD_HTTP_HEADER_CONTENT_TYPE,
+                                   XMS_INDEX_CONTENT_TYPE);
 
-static void
-destroy_request_ctx (request_ctx * req)
-{
-    if (req->pp != NULL)
-        MHD_destroy_post_processor (req->pp);
+    if (ret == MHD_NO) {
+        MHD_destroy_response (response);
+
+        return MHD_NO;
+    }
+
+    ret = queue_response (connection, req, MHD_HTTP_OK, response);
+    MHD_destroy_response (response);
+
+    return ret;
+}
+
+
+static int
+process_memory_request (struct MHD_Connection *connection, request_ctx *req)
+{
+    xms_budget_usage usage[BUDGET_CACHES];
+    char buf[MEMORY_REPORT_SIZE];
+    uint64_t total = 0;
+    size_t len;
+    unsigned int i;
+    struct MHD_Response *response;
+    int ret;
+
+    budget_usage (usage);
+
+    for (i = 0; i < BUDGET_CACHES; i++)
+        total += usage[i].bytes;
+
+    len = snprintf (buf, sizeof (buf),
+                    "{\"limit\":%zu,\"total\":%llu,\"caches\":{",
+                    budget_limit (), (unsigned long long) total);
+
+    for (i = 0; i < BUDGET_CACHES; i++) {
+        len += snprintf (buf + len, sizeof (buf) - len,
+                         "%s\"%s\":{\"bytes\":%llu,\"evicted\":%llu}",
+                         (i > 0) ? "," : "",
+                         budget_cache_name (i),
+                         (unsigned long long) usage[i].bytes,
+                         (unsigned long long) usage[i].evicted);
+    }
+
+    len += snprintf (buf + len, sizeof (buf) - len, "}}\r\n");
+
+    req->bytes_out = len;
+    response = MHD_create_response_from_buffer (len, buf,
+                                                MHD_RESPMEM_MUST_COPY);
+
+    if (response == NULL)
+        return MHD_NO;
+
+    ret = MHD_add_response_header (response,
+                                   MHD_HTTP_HEADER_CONTENT_TYPE,
+                                   XMS_INDEX_CONTENT_TYPE);
+
+    if (ret == MHD_NO) {
+        MHD_destroy_response (response);
+
+        return MHD_NO;
+    }
+
+    ret = queue_response (connection, req, MHD_HTTP_OK, response);
+    MHD_destroy_response (response);
+
+    return ret;
+}
+
+
+static int
+process_metrics_request (struct MHD_Connection *connection, request_ctx *req)
+{
+    char *buf;
+    size_t len;
+    struct MHD_Response *response;
+    int ret;
+
+    buf = metrics_render (&len);
+
+    if (buf == NULL)
+        return MHD_NO;
+
+    req->bytes_out = len;
+    response = MHD_create_response_from_buffer (len, buf,
+                                                MHD_RESPMEM_MUST_FREE);
+
+    if (response == NULL) {
+        free (buf);
+
+        return MHD_NO;
+    }
+
+    ret = MHD_add_response_header (response,
+                                   MHD_HTTP_HEADER_CONTENT_TYPE,
+                                   METRICS_CONTENT_TYPE);
+
+    if (ret == MHD_NO) {
+        MHD_destroy_response (response);
+
+        return MHD_NO;
+    }
+
+    ret = queue_response (connection, req, MHD_HTTP_OK, response);
+    MHD_destroy_response (response);
+
+    return ret;
+}
+
+
+/*
+ * a timestamp in seconds (with an optional fraction) to microseconds
+ */
+static bool
+parse_timestamp (const char *value, uint64_t *usec)
+{
+    double sec;
+    char *end;
+
+    errno = 0;
+    sec = strtod (value, &end);
+
+    /* NaN fails the range check as well */
+    if (errno != 0 || end == value || *end != '\0' ||
+        !(sec >= 0 && sec < TIMESTAMP_MAX_SEC))
+        return false;
+
+    *usec = (uint64_t) (sec * 1000000.0);
+
+    return true;
+}
+
+
+static MHD_RESULT
+capture_header_cb (void *cls, enum MHD_ValueKind kind,
+                   const char *key, const char *value)
+{
+    capture_head *head = cls;
+    size_t room = head->size - head->len - 2; /* the last CRLF */
+    int n;
+
+    (void) kind;
+
+    n = snprintf (head->buf + head->len, room, "%s: %s\r\n",
+                  key, (value != NULL) ? value : "");
+
+    /*
+     * a header which doesn't fit is omitted
+     */
+    if (n > 0 && (size_t) n < room)
+        head->len += n;
+    else
+        head->buf[head->len] = '\0';
+
+    return MHD_YES;
+}
+
+
+/*
+ * starts an upload in the capture: the request line & headers
+ */
+static void
+capture_upload (struct MHD_Connection *connection, request_ctx *req,
+                const char *url, const char *method, const char *version)
+{
+    capture_head head;
+    int n;
+
+    head.size = CAPTURE_HEAD_SIZE;
+    head.buf = arena_alloc (req->arena, head.size);
+
+    if (head.buf == NULL) {
+        mhd_error (connection, "arena (capture) failed");
+        return;
+    }
+
+    n = snprintf (head.buf, head.size - 2, "%s %s %s\r\n",
+                  method, url, version);
+
+    if (n < 0 || (size_t) n >= head.size - 2)
+        return;
+
+    head.len = n;
+    (void) MHD_get_connection_values (connection, MHD_HEADER_KIND,
+                                      &capture_header_cb, &head);
+
+    memcpy (head.buf + head.len, "\r\n", 2);
+    head.len += 2;
+
+    req->capture_id = capture_begin (req->started, head.buf, head.len);
+}
+
+
+static void
+capture_finish (request_ctx *req, bool complete)
+{
+    if (req->capture_id == 0)
+        return;
+
+    capture_end (req->capture_id, complete);
+    req->capture_id = 0;
+}
+
+
+/*
+ * X-Capture-Time & X-Capture-Seq of an upload, both are optional
+ */
+static bool
+parse_capture_headers (struct MHD_Connection *connection,
+                       xms_frame_trace *trace)
+{
+    const char *value;
+    unsigned long long seq;
+    char *end;
+
+    value = MHD_lookup_connection_value (connection, MHD_HEADER_KIND,
+                                         TRACE_CAPTURE_TIME_HEADER);
+
+    if (value != NULL && !parse_timestamp (value, &trace->capture))
+        return false;
+
+    value = MHD_lookup_connection_value (connection, MHD_HEADER_KIND,
+                                         TRACE_CAPTURE_SEQ_HEADER);
+
+    if (value != NULL) {
+        errno = 0;
+        seq = strtoull (value, &end, 10);
+
+        if (errno != 0 || end == value || *end != '\0')
+            return false;
+
+        trace->capture_seq = seq;
+        trace->has_seq = true;
+    }
+
+    return true;
+}
+
+
+/*
+ * X-Frame-* & trace headers of a single frame, see trace.h
+ */
+static MHD_RESULT
+add_frame_headers (struct MHD_Response *response, const xms_frame *frame)
+{
+    char values[TRACE_HEADERS][TRACE_VALUE_SIZE];
+    char value[32];
+    unsigned int i;
+
+    snprintf (value, sizeof (value), "%llu",
+              (unsigned long long) frame->seq);
+
+    if (MHD_NO == MHD_add_response_header (response, "X-Frame-Seq", value))
+        return MHD_NO;
+
+    snprintf (value, sizeof (value), "%llu.%06llu",
+              (unsigned long long) frame->timestamp / 1000000,
+              (unsigned long long) frame->timestamp % 1000000);
+
+    if (MHD_NO == MHD_add_response_header (response,
+                                           "X-Frame-Timestamp", value))
+        return MHD_NO;
+
+    trace_headers (frame, values);
+
+    for (i = 0; i < TRACE_HEADERS; i++)
+        if (values[i][0] != '\0' &&
+            MHD_NO == MHD_add_response_header (response,
+                                               TRACE_HEADER_NAMES[i],
+                                               values[i]))
+        {
+            return MHD_NO;
+        }
+
+    return MHD_YES;
+}
+
+
+static int
+process_playback_request (struct MHD_Connection *connection, request_ctx *req)
+{
+    const char *value;
+    uint64_t from = 0, to = UINT64_MAX, step;
+    double fps = 1.0;
+    struct MHD_Response *response;
+    int ret;
+
+    if (!recorder_enabled ())
+        return queue_response (connection, req,
+                                   MHD_HTTP_NOT_FOUND,
+                                   XMS_RESPONSES[XMS_PAGE_NOT_FOUND]);
+
+    /*
+     * from & to: seconds since the Epoch, fps: frames per second
+     * of recorded time, i.e. fps=0.1 shows a frame per 10 seconds
+     */
+    value = MHD_lookup_connection_value (connection,
+                                         MHD_GET_ARGUMENT_KIND, "from");
+    if (value != NULL && !parse_timestamp (value, &from))
+        goto bad_request;
+
+    value = MHD_lookup_connection_value (connection,
+                                         MHD_GET_ARGUMENT_KIND, "to");
+    if (value != NULL && !parse_timestamp (value, &to))
+        goto bad_request;
+
+    value = MHD_lookup_connection_value (connection,
+                                         MHD_GET_ARGUMENT_KIND, "fps");
+    if (value != NULL) {
+        char *end;
+
+        errno = 0;
+        fps = strtod (value, &end);
+
+        if (errno != 0 || end == value || *end != '\0' || !(fps > 0))
+            goto bad_request;
+
+        if (fps < PLAYBACK_MIN_FPS)
+            fps = PLAYBACK_MIN_FPS;
+        else if (fps > PLAYBACK_MAX_FPS)
+            fps = PLAYBACK_MAX_FPS;
+    }
+
+    if (from > to)
+        goto bad_request;
+
+    step = (uint64_t) (1000000.0 / fps);
+    response = playback_response (from, to, step);
+
+    if (response == NULL)
+        return queue_response (connection, req,
+                                   MHD_HTTP_NOT_FOUND,
+                                   XMS_RESPONSES[XMS_PAGE_NOT_FOUND]);
+
+    ret = MHD_add_response_header (response,
+                                   MHD_HTTP_HEADER_CONTENT_TYPE,
+                                   MJPEG_CONTENT_TYPE);
+
+    if (ret == MHD_NO) {
+        MHD_destroy_response (response);
+
+        return MHD_NO;
+    }
+
+    ret = queue_response (connection, req, MHD_HTTP_OK, response);
+    MHD_destroy_response (response);
+
+    return ret;
+
+bad_request:
+    return queue_response (connection, req,
+                               MHD_HTTP_BAD_REQUEST,
+                               XMS_RESPONSES[XMS_PAGE_BAD_REQUEST]);
+}
+
+
+static int
+process_stream_request (struct MHD_Connection *connection, request_ctx *req)
+{
+    struct MHD_Response *response;
+    int ret;
+
+    /*
+     * all viewers share encoded frames, see hub.c
+     */
+    response = hub_viewer_response (connection);
+
+    if (response == NULL)
+        return MHD_NO;
+
+    if (MHD_NO == MHD_add_response_header (response,
+                                           MHD_HTTP_HEADER_CONTENT_TYPE,
+                                           MJPEG_CONTENT_TYPE) ||
+        MHD_NO == MHD_add_response_header (response,
+                                           MHD_HTTP_HEADER_CACHE_CONTROL,
+                                           "no-cache"))
+    {
+        MHD_destroy_response (response);
+
+        return MHD_NO;
+    }
+
+    ret = queue_response (connection, req, MHD_HTTP_OK, response);
+    MHD_destroy_response (response);
+
+    return ret;
+}
 
-    if (req->fh != NULL)
-        (void) fclose (req->fh);
 
-    free (req);
+static ssize_t
+file_reader_cb (void *cls, uint64_t pos, char *buf, size_t max)
+{
+    FILE *fh = (FILE *) cls;
+
+    (void) fseek (fh, pos, SEEK_SET);
+
+    return fread (buf, 1, max, fh);
+}
+
+
+static void
+file_reader_free_cb (void *cls)
+{
+    FILE *fh = (FILE *) cls;
+
+    (void) fclose (fh);
+}
+
+
+static ssize_t
+frame_reader_cb (void *cls, uint64_t pos, char *buf, size_t max)
+{
+    xms_frame *frame = (xms_frame *) cls;
+
+    if (pos >= frame->size)
+        return MHD_CONTENT_READER_END_OF_STREAM;
+
+    if (pos == 0)
+        trace_sent (frame, "frame", 0);
+
+    if (max > frame->size - pos)
+        max = frame->size - pos;
+
+    memcpy (buf, frame->data + pos, max);
+
+    return max;
+}
+
+
+static void
+frame_reader_free_cb (void *cls)
+{
+    frame_unref ((xms_frame *) cls);
+}
+
+
+static bool
+parse_frame_url (const char *url, uint64_t *seq)
+{
+    unsigned long long value;
+    char *end;
+
+    /*
+     * /frame/<seq>.jpg
+     */
+    if (strncmp (url, "/frame/", 7) != 0)
+        return false;
+
+    if (url[7] < '0' || url[7] > '9')
+        return false;
+
+    errno = 0;
+    value = strtoull (url + 7, &end, 10);
+
+    if (errno != 0 || strncmp (end, ".jpg", 5) != 0)
+        return false;
+
+    *seq = value;
+
+    return true;
+}
+
+
+extern void
+publish_frame (xms_frame *frame, xms_image *image)
+{
+    FILE *fh;
+
+    frames_publish (frame);
+    record_frame (frame);
+    hub_publish (frame->seq);
+
+    if (shm_store_enabled ())
+        shm_store_publish (frame, image);
+
+    /*
+     * /get.jpg: replace the file atomically, it may be being read
+     */
+    fh = fopen (XMS_TEMP_FILE, "wb");
+
+    if (fh == NULL) {
+        error ("failed to open file `%s': %s\n",
+               XMS_TEMP_FILE, strerror (errno));
+        return;
+    }
+
+    if (fwrite (frame->data, 1, frame->size, fh) != frame->size) {
+        error ("failed to write file `%s'\n", XMS_TEMP_FILE);
+        (void) fclose (fh);
+        (void) remove (XMS_TEMP_FILE);
+        return;
+    }
+
+    if (fclose (fh) != 0 || rename (XMS_TEMP_FILE, XMS_CONV_FILE) != 0) {
+        error ("failed to replace file `%s': %s\n",
+               XMS_CONV_FILE, strerror (errno));
+        (void) remove (XMS_TEMP_FILE);
+    }
+}
+
+
+extern void
+request_completed_cb (void *cls,
+                      struct MHD_Connection *connection,
+                      void **con_cls, enum MHD_RequestTerminationCode toe)
+{
+    request_ctx *req = *con_cls;
+
+    (void) cls;
+#if defined(_DEBUG)
+    char *tdesc;
+    const union MHD_ConnectionInfo *ci;
+    char peer[MHD_PEER_SIZE];
+#endif
+
+#if defined(_DEBUG)
+    ci = MHD_get_connection_info (connection,
+                                  MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+
+    (void) mhd_peer (ci != NULL ? ci->client_addr : NULL,
+                     peer, sizeof (peer));
+
+    switch (toe) {
+    case MHD_REQUEST_TERMINATED_COMPLETED_OK:
+        tdesc = "OK";
+        break;
+    case MHD_REQUEST_TERMINATED_WITH_ERROR:
+        tdesc = "ERROR";
+        break;
+    case MHD_REQUEST_TERMINATED_TIMEOUT_REACHED:
+        tdesc = "TIMED OUT";
+        break;
+    case MHD_REQUEST_TERMINATED_DAEMON_SHUTDOWN:
+        tdesc = "SHUTDOWN";
+        break;
+    case MHD_REQUEST_TERMINATED_READ_ERROR:
+        tdesc = "READ ERROR";
+        break;
+    case MHD_REQUEST_TERMINATED_CLIENT_ABORT:
+        tdesc = "CLIENT ABORT";
+        break;
+    default:
+        tdesc = "UNKNOWN";
+        break;
+    }                           /* switch (toe) { */
+
+    debug ("* Connection %s closed: %s\n", peer, tdesc);
+#endif
+
+    if (req != NULL && req->uploader && slot_release (req->token)) {
+        req->uploader = false;
+        resume_next ();
+    }
+
+    if (req != NULL) {
+        if (req->method == ACCESS_METHOD_GET) {
+            metrics_get_status (req->sent_status);
+
+            if (toe == MHD_REQUEST_TERMINATED_COMPLETED_OK)
+                metrics_count (METRIC_GET_BYTES, req->bytes_out);
+        }
+
+        if (access_log_enabled ())
+            log_access (connection, req, toe);
+
+        destroy_request_ctx (req);
+        *con_cls = NULL;
+        drain_leave ();
+    }
+}
+
+
+extern void
+connection_cb (void *cls,
+               struct MHD_Connection *connection,
+               void **socket_context,
+               enum MHD_ConnectionNotificationCode toe)
+{
+    (void) cls;
+    (void) connection;
+    (void) socket_context;
+
+    if (toe == MHD_CONNECTION_NOTIFY_STARTED)
+        metrics_gauge (METRIC_CONNECTIONS, 1);
+    else if (toe == MHD_CONNECTION_NOTIFY_CLOSED)
+        metrics_gauge (METRIC_CONNECTIONS, -1);
+}
+
+
+static MHD_RESULT
+queue_response (struct MHD_Connection *connection, request_ctx *req,
+                unsigned int status, struct MHD_Response *response)
+{
+    /*
+     * remember what we have answered for the access log
+     */
+    req->sent_status = status;
+
+    return MHD_queue_response (connection, status, response);
+}
+
+
+static void
+stage_mark (request_ctx *req, enum access_stage stage)
+{
+    uint64_t now = clock_usec (CLOCK_MONOTONIC);
+
+    req->stage[stage] = now - req->mark;
+    req->mark = now;
+}
+
+
+static void
+log_access (struct MHD_Connection *connection, request_ctx *req,
+            enum MHD_RequestTerminationCode toe)
+{
+    static const uint8_t urls[] = {
+        [RES_DEFAULT] = ACCESS_URL_INDEX,
+        [RES_FILE] = ACCESS_URL_FILE,
+        [RES_FRAME] = ACCESS_URL_FRAME,
+        [RES_FRAMES] = ACCESS_URL_FRAMES,
+        [RES_PLAYBACK] = ACCESS_URL_PLAYBACK,
+        [RES_STREAM] = ACCESS_URL_STREAM,
+        [RES_MEMORY] = ACCESS_URL_MEMORY,
+        [RES_METRICS] = ACCESS_URL_METRICS
+    };
+    const union MHD_ConnectionInfo *ci;
+    xms_access_record rec;
+    unsigned int i;
+
+    memset (&rec, 0, sizeof (rec));
+
+    rec.timestamp = req->started;
+    rec.duration = clock_usec (CLOCK_MONOTONIC) - req->begin;
+    rec.bytes_in = req->bytes_in;
+    rec.bytes_out = req->bytes_out;
+    rec.status = req->sent_status;
+    rec.termination = toe;
+    rec.method = req->method;
+
+    for (i = 0; i < ACCESS_STAGES; i++)
+        rec.stage[i] = req->stage[i];
+
+    if (req->method == ACCESS_METHOD_POST)
+        rec.url = ACCESS_URL_UPLOAD;
+    else if (req->method == ACCESS_METHOD_GET)
+        rec.url = urls[req->resource];
+
+    if (rec.url == ACCESS_URL_FRAME)
+        rec.frame_seq = req->frame_seq;
+
+    ci = MHD_get_connection_info (connection,
+                                  MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+
+    if (ci != NULL && ci->client_addr != NULL) {
+        if (ci->client_addr->sa_family == AF_INET) {
+            const struct sockaddr_in *in =
+                (const struct sockaddr_in *) ci->client_addr;
+
+            rec.family = 4;
+            rec.port = ntohs (in->sin_port);
+            memcpy (rec.addr, &in->sin_addr, sizeof (in->sin_addr));
+        }
+        else if (ci->client_addr->sa_family == AF_INET6) {
+            const struct sockaddr_in6 *in6 =
+                (const struct sockaddr_in6 *) ci->client_addr;
+
+            rec.family = 6;
+            rec.port = ntohs (in6->sin6_port);
+            memcpy (rec.addr, &in6->sin6_addr, sizeof (in6->sin6_addr));
+        }
+    }
+
+    access_log_write (&rec);
+}
+
+
+static void
+destroy_request_ctx (request_ctx * req)
+{
+    /*
+     * the connection may still be in the queue
+     */
+    suspend_release (req->park);
+
+    /*
+     * the body has not been received completely
+     */
+    capture_finish (req, false);
+
+    if (req->pp != NULL)
+        MHD_destroy_post_processor (req->pp);
+
+    bufpool_free (req->upload);
+
+    /* the context is gone too */
+    arena_release (req->arena);
 }
 
 
@@ -629,9 +1561,6 @@ init_server_data (void)
     snprintf (path, PATH_MAX - 1, "%s/" TEMP_FILENAME, XMS_STORAGE_DIR);
     XMS_TEMP_FILE = strdup (path);
 
-    snprintf (path, PATH_MAX - 1, "%s/" DEST_FILENAME, XMS_STORAGE_DIR);
-    XMS_DEST_FILE = strdup (path);
-
     snprintf (path, PATH_MAX - 1, "%s/" CONV_FILENAME, XMS_STORAGE_DIR);
     XMS_CONV_FILE = strdup (path);
 #endif
@@ -647,6 +1576,11 @@ init_server_data (void)
     if (remove (XMS_TEMP_FILE) != 0 && errno != ENOENT)
         die ("FATAL ERROR: remove temporary file `%s': %s\n",
              XMS_TEMP_FILE, strerror (errno));
+
+    /*
+     * request contexts are allocated from arenas (arena.c)
+     */
+    init_arenas ();
 }
 
 
@@ -656,9 +1590,8 @@ free_server_data (void)
     if (XMS_TEMP_FILE != NULL)
         free (XMS_TEMP_FILE);
 
-    if (XMS_DEST_FILE != NULL)
-        free (XMS_DEST_FILE);
-
     if (XMS_CONV_FILE != NULL)
         free (XMS_CONV_FILE);
+
+    free_arenas ();
 }
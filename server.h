@@ -1,6 +1,8 @@
 #ifndef XMS_SERVER_H
 #define XMS_SERVER_H
 
+#include "frames.h"
+#include "imagemagick.h"
 #include "mhd.h"
 #include "server.h"
 
@@ -28,6 +30,16 @@ request_completed_cb (	void *cls,
 			void **con_cls,
 			enum MHD_RequestTerminationCode toe);
 
+extern void
+connection_cb (	void *cls,
+		struct MHD_Connection *connection,
+		void **socket_context,
+		enum MHD_ConnectionNotificationCode toe);
+
+/* publishes a converted frame, see init_pipeline () */
+extern void
+publish_frame (xms_frame *frame, xms_image *image);
+
 
 extern void
 init_server_data (void);
@@ -0,0 +1,149 @@
+#include "shmstore.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/* slots start at a page boundary, a raster at a cache line one */
+#define SHM_DATA_OFFSET 4096
+#define SHM_ALIGN(n) (((n) + 63) & ~(uint64_t) 63)
+
+/* "/name" for shm_open () */
+#define SHM_NAME_SIZE 256
+
+
+static struct {
+	char name[SHM_NAME_SIZE];
+	unsigned char *map;
+	size_t size;
+	xms_shm_header *hdr;
+} shm;
+
+
+/* ------------------------------------------------------------------ */
+
+
+extern void
+init_shm_store (const char *name)
+{
+	int fd;
+
+
+	snprintf (shm.name, sizeof (shm.name), "%s%s",
+		(name[0] == '/') ? "" : "/", name);
+	shm.size = SHM_DATA_OFFSET + 2 * (size_t) SHM_STORE_SLOT_SIZE;
+
+	/* readers of a previous instance keep their mappings */
+	(void) shm_unlink (shm.name);
+
+	fd = shm_open (shm.name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (fd == -1)
+		die ("failed to create shared memory `%s': %s\n",
+			shm.name, strerror (errno));
+
+	/* tmpfs is sparse, untouched pages cost nothing */
+	if (ftruncate (fd, shm.size) != 0)
+		die ("failed to resize shared memory `%s': %s\n",
+			shm.name, strerror (errno));
+
+	shm.map = mmap (NULL, shm.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	(void) close (fd);
+
+	if (shm.map == MAP_FAILED)
+		die ("failed to map shared memory `%s': %s\n",
+			shm.name, strerror (errno));
+
+	shm.hdr = (xms_shm_header *) shm.map;
+	shm.hdr->version = SHM_STORE_VERSION;
+	shm.hdr->header_size = sizeof (xms_shm_header);
+	shm.hdr->size = shm.size;
+	shm.hdr->slot_size = SHM_STORE_SLOT_SIZE;
+	shm.hdr->slots[0].jpeg_offset = SHM_DATA_OFFSET;
+	shm.hdr->slots[1].jpeg_offset = SHM_DATA_OFFSET + SHM_STORE_SLOT_SIZE;
+
+	/* the magic goes the last, readers check it first */
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	memcpy (shm.hdr->magic, SHM_STORE_MAGIC, sizeof (SHM_STORE_MAGIC));
+
+	info ("* Shared memory frame store: %s\n", shm.name);
+}
+
+
+extern void
+free_shm_store (void)
+{
+	if (shm.map == NULL)
+		return;
+
+	(void) munmap (shm.map, shm.size);
+	(void) shm_unlink (shm.name);
+	shm.map = NULL;
+	shm.hdr = NULL;
+}
+
+
+extern bool
+shm_store_enabled (void)
+{
+	return shm.map != NULL;
+}
+
+
+extern void
+shm_store_publish (const xms_frame *frame, xms_image *image)
+{
+	uint32_t idx = 1 - shm.hdr->current;
+	xms_shm_slot *slot = &shm.hdr->slots[idx];
+	uint64_t offset = SHM_DATA_OFFSET + (uint64_t) idx * SHM_STORE_SLOT_SIZE;
+	uint64_t rgb_offset, rgb_size = 0;
+	size_t width = 0, height = 0;
+	uint64_t lock;
+
+
+	if (frame->size > SHM_STORE_SLOT_SIZE) {
+		__atomic_add_fetch (&shm.hdr->skipped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rgb_offset = offset + SHM_ALIGN (frame->size);
+
+	if (image != NULL) {
+		image_size (image, &width, &height);
+		rgb_size = (uint64_t) width * height * 3;
+
+		/* the JPEG alone is still useful */
+		if (rgb_offset + rgb_size > offset + SHM_STORE_SLOT_SIZE)
+			rgb_size = 0;
+	}
+
+	/* the slot is not current, but a slow reader may still be there */
+	lock = slot->lock;
+	__atomic_store_n (&slot->lock, lock + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	memcpy (shm.map + offset, frame->data, frame->size);
+
+	if (rgb_size > 0 && !image_export_rgb (image, shm.map + rgb_offset))
+		rgb_size = 0;
+
+	slot->seq = frame->seq;
+	slot->timestamp = frame->timestamp;
+	slot->jpeg_offset = offset;
+	slot->jpeg_size = frame->size;
+	slot->rgb_offset = rgb_offset;
+	slot->rgb_size = rgb_size;
+	slot->width = (rgb_size > 0) ? width : 0;
+	slot->height = (rgb_size > 0) ? height : 0;
+
+	__atomic_store_n (&slot->lock, lock + 2, __ATOMIC_RELEASE);
+	__atomic_store_n (&shm.hdr->current, idx, __ATOMIC_RELEASE);
+	__atomic_store_n (&shm.hdr->seq, frame->seq, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,82 @@
+#ifndef XMS_SHMSTORE_H
+#define XMS_SHMSTORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "frames.h"
+#include "imagemagick.h"
+
+/*
+ * The latest frame in POSIX shared memory, for local consumers: the JPEG
+ * and the decoded raster (packed 8-bit RGB). The region is a header and
+ * two slots; the server writes the slot which is not current and then
+ * flips `current', so a reader has a whole frame interval to use the
+ * current one in place. Each slot is guarded by a seqlock: `lock' is odd
+ * while the slot is being written. See tools/xms-shm.c for a client.
+ */
+
+#define SHM_STORE_MAGIC		"XMSSHM"
+#define SHM_STORE_VERSION	1
+
+/* data bytes per slot (JPEG + raster), larger frames are skipped */
+#ifndef SHM_STORE_SLOT_SIZE
+#define SHM_STORE_SLOT_SIZE (32 * 1024 * 1024)
+#endif
+
+typedef struct _xms_shm_slot {
+	/* odd while the slot is being written */
+	uint64_t lock;
+
+	/* the frame sequence number & timestamp (usec since the Epoch) */
+	uint64_t seq;
+	uint64_t timestamp;
+
+	/* offsets are relative to the start of the region */
+	uint64_t jpeg_offset;
+	uint64_t jpeg_size;
+	uint64_t rgb_offset;
+	uint64_t rgb_size;	/* 0 if there is no raster */
+
+	uint32_t width;
+	uint32_t height;
+} xms_shm_slot;
+
+typedef struct _xms_shm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+
+	/* the whole region & data bytes per slot */
+	uint64_t size;
+	uint64_t slot_size;
+
+	/* the latest complete slot, 0 or 1 */
+	uint32_t current;
+	uint32_t reserved;
+
+	/* the latest sequence number, changes after `current' */
+	uint64_t seq;
+
+	/* frames which didn't fit into a slot */
+	uint64_t skipped;
+
+	xms_shm_slot slots[2];
+} xms_shm_header;
+
+
+/* creates (or re-creates) the shared memory object `/name' */
+extern void
+init_shm_store (const char *name);
+
+/* unlinks the object, readers may keep using their mappings */
+extern void
+free_shm_store (void);
+
+extern bool
+shm_store_enabled (void);
+
+/* must not be called concurrently, i.e. only by the publisher */
+extern void
+shm_store_publish (const xms_frame *frame, xms_image *image);
+
+#endif /* XMS_SHMSTORE_H */
@@ -0,0 +1,77 @@
+#include "slot.h"
+#include "atomics.h"
+
+
+/* the owner token in the high half, the state in the low one */
+#define SLOT_WORD(token, state) (((uint64_t) (token) << 32) | (state))
+#define SLOT_TOKEN(word) ((uint32_t) ((word) >> 32))
+#define SLOT_STATE(word) ((enum slot_state) ((word) & 0xffffffff))
+
+
+static uint64_t slot = SLOT_WORD (0, SLOT_IDLE);
+static uint32_t last_token;
+
+
+/* ------------------------------------------------------------------ */
+
+
+static bool
+slot_cas (uint64_t expected, uint64_t desired)
+{
+	return __atomic_compare_exchange_n (&slot, &expected, desired,
+		false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+
+extern uint32_t
+slot_token (void)
+{
+	uint32_t token;
+
+	/* skip zero on wrap around */
+	while ((token = xms_atomic_inc (&last_token)) == 0)
+		;
+
+	return token;
+}
+
+
+extern bool
+slot_acquire (uint32_t token)
+{
+	return slot_cas (SLOT_WORD (0, SLOT_IDLE),
+		SLOT_WORD (token, SLOT_RECEIVING));
+}
+
+
+extern bool
+slot_advance (uint32_t token, enum slot_state from, enum slot_state to)
+{
+	return slot_cas (SLOT_WORD (token, from), SLOT_WORD (token, to));
+}
+
+
+extern bool
+slot_release (uint32_t token)
+{
+	uint64_t word = xms_atomic_load (&slot);
+
+	/* the owner is the only one who changes an owned slot */
+	while (SLOT_TOKEN (word) == token && SLOT_STATE (word) != SLOT_IDLE) {
+		if (__atomic_compare_exchange_n (&slot, &word,
+			SLOT_WORD (0, SLOT_IDLE), false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+extern enum slot_state
+slot_state (void)
+{
+	return SLOT_STATE (xms_atomic_load (&slot));
+}
@@ -0,0 +1,44 @@
+#ifndef XMS_SLOT_H
+#define XMS_SLOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/*
+ * We allow only one uploader per a moment. The upload slot goes
+ * through IDLE -> RECEIVING -> SUBMITTING -> IDLE,
+ * every transition is a single compare-and-swap of the state and
+ * an owner token, so only the owner may move the slot forward.
+ *
+ * The slot guards receiving only: it is released once the frame has
+ * been queued to the pipeline (pipeline.c), which converts & publishes
+ * frames in order, so the next upload overlaps with the conversion.
+ */
+enum slot_state {
+	SLOT_IDLE = 0,
+	SLOT_RECEIVING,
+	SLOT_SUBMITTING		/* handing the frame over to the pipeline */
+};
+
+
+/* a new owner token, never zero */
+extern uint32_t
+slot_token (void);
+
+/* IDLE -> RECEIVING */
+extern bool
+slot_acquire (uint32_t token);
+
+/* `from' -> `to', fails if the slot is not owned by `token' */
+extern bool
+slot_advance (uint32_t token, enum slot_state from, enum slot_state to);
+
+/* any state -> IDLE, fails if the slot is not owned by `token' */
+extern bool
+slot_release (uint32_t token);
+
+extern enum slot_state
+slot_state (void);
+
+#endif /* XMS_SLOT_H */
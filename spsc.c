@@ -0,0 +1,156 @@
+#include "spsc.h"
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdlib.h>
+
+#define SPSC_CACHE_LINE 64
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _spsc_queue {
+	void		**slots;
+	size_t		capacity;
+	sem_t		free;
+	sem_t		used;
+	char		pad0[SPSC_CACHE_LINE];
+	size_t		head;	/* the producer side */
+	char		pad1[SPSC_CACHE_LINE];
+	size_t		tail;	/* the consumer side */
+	char		pad2[SPSC_CACHE_LINE];
+};
+
+
+SPSC_QUEUE *
+spsc_new(size_t capacity)
+{
+	SPSC_QUEUE *q;
+
+
+	if (capacity == 0)
+		capacity = 1;
+
+	q = malloc(sizeof(*q));
+
+	if (q == NULL)
+		return NULL;
+
+	q->slots = malloc(sizeof(*q->slots) * capacity);
+
+	if (q->slots == NULL) {
+		free(q);
+		return NULL;
+	}
+
+	if (sem_init(&q->free, 0, capacity) != 0) {
+		free(q->slots);
+		free(q);
+		return NULL;
+	}
+
+	if (sem_init(&q->used, 0, 0) != 0) {
+		sem_destroy(&q->free);
+		free(q->slots);
+		free(q);
+		return NULL;
+	}
+
+	q->capacity = capacity;
+	q->head = 0;
+	q->tail = 0;
+
+	return q;
+}
+
+
+void
+spsc_destroy(SPSC_QUEUE *q)
+{
+	if (q != NULL) {
+		sem_destroy(&q->free);
+		sem_destroy(&q->used);
+		free(q->slots);
+		free(q);
+	}
+}
+
+
+/* semaphores order the slot accesses between the sides */
+bool
+spsc_push(SPSC_QUEUE *q, void *e, bool wait)
+{
+	if (wait) {
+		while (sem_wait(&q->free) != 0)
+			if (errno != EINTR)
+				return false;
+	}
+	else if (sem_trywait(&q->free) != 0)
+		return false;
+
+	q->slots[q->head] = e;
+	q->head = (q->head + 1) % q->capacity;
+
+	sem_post(&q->used);
+
+	return true;
+}
+
+
+void *
+spsc_pop(SPSC_QUEUE *q)
+{
+	void *e;
+
+
+	while (sem_wait(&q->used) != 0)
+		if (errno != EINTR)
+			return NULL;
+
+	e = q->slots[q->tail];
+	q->tail = (q->tail + 1) % q->capacity;
+
+	sem_post(&q->free);
+
+	return e;
+}
+
+
+bool
+spsc_trypop(SPSC_QUEUE *q, void **e)
+{
+	if (sem_trywait(&q->used) != 0)
+		return false;
+
+	*e = q->slots[q->tail];
+	q->tail = (q->tail + 1) % q->capacity;
+
+	sem_post(&q->free);
+
+	return true;
+}
+
+
+size_t
+spsc_count(SPSC_QUEUE *q)
+{
+	int value;
+
+	if (sem_getvalue(&q->used, &value) != 0 || value < 0)
+		return 0;
+
+	return value;
+}
+
+
+size_t
+spsc_capacity(SPSC_QUEUE *q)
+{
+	return q->capacity;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,41 @@
+#ifndef XMS_SPSC_H
+#define XMS_SPSC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A bounded single-producer/single-consumer FIFO queue of pointers.
+ * Free and used slots are counted by semaphores, so a blocked side
+ * sleeps in the kernel, while an uncontended push or pop is a couple
+ * of atomic operations.
+ */
+typedef struct _spsc_queue SPSC_QUEUE;
+
+SPSC_QUEUE * spsc_new(size_t capacity);
+
+void spsc_destroy(SPSC_QUEUE *q);
+
+/* Waits for a free slot if `wait', otherwise returns false if full. */
+bool spsc_push(SPSC_QUEUE *q, void *e, bool wait);
+
+/* Waits for an element. */
+void * spsc_pop(SPSC_QUEUE *q);
+
+/* Returns false if empty, never waits. */
+bool spsc_trypop(SPSC_QUEUE *q, void **e);
+
+/* An approximate amount of elements. */
+size_t spsc_count(SPSC_QUEUE *q);
+
+size_t spsc_capacity(SPSC_QUEUE *q);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* XMS_SPSC_H */
@@ -1,25 +1,82 @@
 #include "mhd.h"
 #include "suspend.h"
-#include "vector.h"
+#include "atomics.h"
+#include "clock.h"
+#include "mpmc.h"
 #include "common.h"
 #include "mhd_log.h"
-#include <sys/select.h>
-#include <time.h>
+#include "metrics.h"
+#include <stdbool.h>
 #include <errno.h>
 #include <limits.h>
 
 
-/* we have one global pool, mutex support implemented in vector.c */
-static VECTOR *pool;
+enum {
+	ENTRY_PARKED = 0,
+	ENTRY_RESUMED,
+	ENTRY_CANCELLED,
+	ENTRY_EXPIRED
+};
+
+/*
+ * An entry is shared by the queue and the request context, each side
+ * holds a reference. An owner may cancel the entry at any moment,
+ * it stays in the queue until somebody pops and skips it.
+ */
+struct _suspend_entry {
+	struct MHD_Connection *connection;
+	unsigned int state;
+	unsigned int refcount;
+
+	/* when the connection has been parked, monotonic (usec) */
+	uint64_t parked;
+};
+
+
+/* we have one global pool, see mpmc.c */
+static MPMC_QUEUE *pool;
 
 
 /* ------------------------------------------------------------------ */
 
 
+static void
+entry_unref (suspend_entry *entry)
+{
+	if (xms_atomic_dec (&entry->refcount) == 0)
+		free (entry);
+}
+
+
+/* PARKED -> `state', only one side wins */
+static bool
+entry_switch (suspend_entry *entry, unsigned int state)
+{
+	unsigned int expected = ENTRY_PARKED;
+
+	if (! __atomic_compare_exchange_n (&entry->state, &expected, state,
+		false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		return false;
+	}
+
+	metrics_gauge (METRIC_SUSPENDED, -1);
+
+	if (state != ENTRY_CANCELLED)
+		metrics_observe (METRIC_SUSPEND_WAIT,
+			clock_usec (CLOCK_MONOTONIC) - entry->parked);
+
+	if (state == ENTRY_EXPIRED)
+		metrics_count (METRIC_EXPIRED, 1);
+
+	return true;
+}
+
+
 extern void
-init_suspend_pool (void)
+init_suspend_pool (size_t capacity)
 {
-	pool = vector_new ();
+	pool = mpmc_new (capacity);
 
 	if (pool == NULL)
 		die ("failed to initialize suspend pool\n");
@@ -29,11 +86,15 @@ init_suspend_pool (void)
 extern void
 free_suspend_pool (void)
 {
+	void *entry;
+
+
 	if (pool != NULL) {
-		/* don't free entries, just set to NULL */
-		vector_reset (pool);
-		/* completely destroy the pool */
-		vector_destroy (pool);
+		/* drop references of the queue */
+		while (mpmc_pop (pool, &entry))
+			entry_unref ((suspend_entry *) entry);
+
+		mpmc_destroy (pool);
 		pool = NULL;
 	}
 }
@@ -42,88 +103,144 @@ free_suspend_pool (void)
 extern void
 resume_all_connections (void)
 {
-	size_t total, i;
-	void *entry;	
-	struct MHD_Connection *connection;
-
-
-	total = vector_count (pool);
+	void *entry;
+	suspend_entry *e;
+	size_t total = 0;
 
-	if (total == 0)
-		return;
 
-	debug ("* Resuming all %zu connections\n", total);
+	while (mpmc_pop (pool, &entry)) {
+		e = (suspend_entry *) entry;
 
-	/* TODO: vector_get + vector_reset in one call */
-	for (i = 0, entry = NULL; i < total; i++) {
-		if (vector_get (pool, i, &entry)) {
-			if (entry == NULL)
-				continue;
-			connection = (struct MHD_Connection *)entry;
-			MHD_resume_connection (connection);
+		if (entry_switch (e, ENTRY_RESUMED)) {
+			MHD_resume_connection (e->connection);
+			total++;
 #if defined(_DEBUG)
-			warn (connection, "resumed");
+			mhd_warn (e->connection, "resumed");
 #endif
 		}
-		else {
-			fatal ("! FATAL ERROR: get connection entry");
-		}
+
+		entry_unref (e);
 	}
 
-	/* purge the pool */
-	if (vector_count (pool) == total) {
-		if (! vector_reset (pool)) {
-			fatal ("! FATAL ERROR: reset pool");
+	if (total > 0)
+		debug ("* Resumed all %zu connections\n", total);
+}
+
+
+extern void
+resume_next (void)
+{
+	void *entry;
+	suspend_entry *e;
+
+
+	/* skip cancelled entries */
+	while (mpmc_pop (pool, &entry)) {
+		e = (suspend_entry *) entry;
+
+		if (entry_switch (e, ENTRY_RESUMED)) {
+			MHD_resume_connection (e->connection);
+#if defined(_DEBUG)
+			mhd_warn (e->connection, "resumed");
+#endif
+			entry_unref (e);
+			return;
 		}
+
+		entry_unref (e);
 	}
 }
 
 
 extern void
-resume_next (void)
+resume_expired (unsigned int max_age)
 {
-	size_t total;
 	void *entry;
-	struct MHD_Connection *connection;
+	suspend_entry *e;
+	size_t n = mpmc_count (pool);
+	size_t total = 0;
+	uint64_t now = clock_usec (CLOCK_MONOTONIC);
+
+
+	/* one pass over the queue, the order of the rest is kept */
+	while (n-- > 0 && mpmc_pop (pool, &entry)) {
+		e = (suspend_entry *) entry;
+
+		/* cancelled or resumed: the queue reference is dropped */
+		if (xms_atomic_load (&e->state) != ENTRY_PARKED)
+			;
+		else if (now - e->parked < (uint64_t) max_age * 1000000 &&
+		         mpmc_push (pool, e))
+			continue;
+		else if (entry_switch (e, ENTRY_EXPIRED)) {
+			MHD_resume_connection (e->connection);
+			total++;
+		}
 
+		entry_unref (e);
+	}
 
-	total = vector_count (pool);
+	if (total > 0)
+		debug ("* Resumed %zu expired connections\n", total);
+}
 
-	if (total == 0)
-		return;
 
-	if (! vector_delete (pool, 0, &entry)) {
-		/* XXX: thread-safe die() */
-		fatal ("! FATAL ERROR: resume next connection: "
-			"vector_delete: %s\n",
-			strerror (vector_get_errno (pool)));
-		return;
+extern bool
+suspend_expired (const suspend_entry *entry)
+{
+	return xms_atomic_load (&entry->state) == ENTRY_EXPIRED;
+}
+
+
+extern suspend_entry *
+suspend_connection (struct MHD_Connection *connection)
+{
+	suspend_entry *entry;
+
+
+	entry = malloc (sizeof (*entry));
+
+	if (entry == NULL) {
+		mhd_error (connection, "suspend: malloc failed");
+		return NULL;
 	}
 
-	if (entry != NULL) {
-		connection = (struct MHD_Connection *)entry;
+	entry->connection = connection;
+	entry->state = ENTRY_PARKED;
+	entry->refcount = 2;	/* the queue and the owner */
+	entry->parked = clock_usec (CLOCK_MONOTONIC);
+
+	/*
+	 * suspend first: once the entry is in the queue, any thread
+	 * may pop it and resume the connection
+	 */
+	MHD_suspend_connection (connection);
+
+	if (! mpmc_push (pool, entry)) {
 		MHD_resume_connection (connection);
+		free (entry);
+		mhd_warn (connection, "suspend: the queue is full");
+		return NULL;
+	}
+
+	metrics_count (METRIC_PARKED, 1);
+	metrics_gauge (METRIC_SUSPENDED, 1);
+
 #if defined(_DEBUG)
-		warn (connection, "resumed");
+	mhd_warn (connection, "suspend");
 #endif
-	}
-	else {
-		debug ("! ERROR: resume next connection: invalid entry\n");
-	}
+
+	return entry;
 }
 
 
 extern void
-suspend_connection (struct MHD_Connection *connection)
+suspend_release (suspend_entry *entry)
 {
-	if (vector_add (pool, (void *) connection)) {
-		MHD_suspend_connection (connection);
-#if defined(_DEBUG)
-		warn (connection, "suspend");
-#endif
-	}
-	else {
-		fatal ("! FATAL ERROR: add connection to pool: %s\n",
-			strerror (vector_get_errno (pool)));
-	}
+	if (entry == NULL)
+		return;
+
+	/* no-op if the entry has been resumed already */
+	(void) entry_switch (entry, ENTRY_CANCELLED);
+	entry_unref (entry);
 }
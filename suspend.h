@@ -5,8 +5,12 @@
 #include "contexts.h"
 
 
+/* a handle of a parked connection, see suspend_connection () */
+typedef struct _suspend_entry suspend_entry;
+
+
 extern void
-init_suspend_pool (void);
+init_suspend_pool (size_t capacity);
 
 extern void
 free_suspend_pool (void);
@@ -14,10 +18,34 @@ free_suspend_pool (void);
 extern void
 resume_all_connections (void);
 
-extern void
+/*
+ * Suspends the connection and puts it at the end of the queue.
+ * Returns NULL if the queue is full, the connection is not suspended
+ * in that case. The handle must be released by suspend_release ().
+ */
+extern suspend_entry *
 suspend_connection (struct MHD_Connection *connection);
 
+/*
+ * Releases the handle. If the connection is still in the queue,
+ * it will be skipped by resume_next ().
+ */
+extern void
+suspend_release (suspend_entry *entry);
+
 extern void
 resume_next (void);
 
+/*
+ * Resumes connections parked for `max_age' seconds or longer, see
+ * suspend_expired (). The queue is rotated, so it must be called by
+ * the only thread which parks & resumes connections (eventloop.c).
+ */
+extern void
+resume_expired (unsigned int max_age);
+
+/* true if the connection has been resumed by resume_expired () */
+extern bool
+suspend_expired (const suspend_entry *entry);
+
 #endif /* XMS_SUSPEND_H */
@@ -0,0 +1,185 @@
+/*
+ * Renders binary access logs of x11mirror-server (-A FILE) as text
+ * or CSV:
+ *
+ *   xms-logdump [-c] FILE...
+ */
+#include "accesslog.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static const char *methods[] = {
+	"-", "GET", "POST"
+};
+
+static const char *urls[] = {
+	"-", "/", "upload", "/get.jpg", "/frame", "/frames",
+	"/playback", "/stream", "/memory", "/metrics"
+};
+
+/* enum MHD_RequestTerminationCode */
+static const char *terminations[] = {
+	"OK", "ERROR", "TIMEOUT", "SHUTDOWN", "READ_ERROR", "CLIENT_ABORT"
+};
+
+#define NAME(table, i) \
+	((i) < sizeof (table) / sizeof (table[0]) ? table[i] : "?")
+
+
+static void
+format_peer (const xms_access_record *rec, char *buf, size_t size)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	if (rec->family == 4 && inet_ntop (AF_INET, rec->addr, ip, sizeof (ip)))
+		snprintf (buf, size, "%s:%u", ip, rec->port);
+	else if (rec->family == 6 &&
+		inet_ntop (AF_INET6, rec->addr, ip, sizeof (ip)))
+		snprintf (buf, size, "[%s]:%u", ip, rec->port);
+	else
+		snprintf (buf, size, "-");
+}
+
+
+static void
+format_time (uint64_t timestamp, char *buf, size_t size)
+{
+	time_t sec = timestamp / 1000000;
+	struct tm tm;
+	size_t len;
+
+	len = strftime (buf, size, "%F %T", localtime_r (&sec, &tm));
+	snprintf (buf + len, size - len, ".%06llu",
+		(unsigned long long) (timestamp % 1000000));
+}
+
+
+static void
+print_text (const xms_access_record *rec)
+{
+	char date[64], peer[INET6_ADDRSTRLEN + 8], url[64];
+
+	format_time (rec->timestamp, date, sizeof (date));
+	format_peer (rec, peer, sizeof (peer));
+
+	if (rec->url == ACCESS_URL_FRAME)
+		snprintf (url, sizeof (url), "/frame/%llu.jpg",
+			(unsigned long long) rec->frame_seq);
+	else
+		snprintf (url, sizeof (url), "%s", NAME (urls, rec->url));
+
+	printf ("%s %s %s %s %u in=%llu out=%llu %.3fms",
+		date, peer, NAME (methods, rec->method), url, rec->status,
+		(unsigned long long) rec->bytes_in,
+		(unsigned long long) rec->bytes_out,
+		rec->duration / 1000.0);
+
+	if (rec->url == ACCESS_URL_UPLOAD)
+		printf (" (wait %.3f receive %.3f submit %.3f)",
+			rec->stage[ACCESS_STAGE_WAIT] / 1000.0,
+			rec->stage[ACCESS_STAGE_RECEIVE] / 1000.0,
+			rec->stage[ACCESS_STAGE_SUBMIT] / 1000.0);
+
+	printf (" %s\n", NAME (terminations, rec->termination));
+}
+
+
+static void
+print_csv (const xms_access_record *rec)
+{
+	char peer[INET6_ADDRSTRLEN + 8];
+
+	format_peer (rec, peer, sizeof (peer));
+
+	printf ("%llu.%06llu,%s,%s,%s,%llu,%u,%llu,%llu,%u,%u,%u,%u,%s\n",
+		(unsigned long long) (rec->timestamp / 1000000),
+		(unsigned long long) (rec->timestamp % 1000000),
+		peer, NAME (methods, rec->method), NAME (urls, rec->url),
+		(unsigned long long) rec->frame_seq, rec->status,
+		(unsigned long long) rec->bytes_in,
+		(unsigned long long) rec->bytes_out,
+		rec->duration,
+		rec->stage[ACCESS_STAGE_WAIT],
+		rec->stage[ACCESS_STAGE_RECEIVE],
+		rec->stage[ACCESS_STAGE_SUBMIT],
+		NAME (terminations, rec->termination));
+}
+
+
+static int
+dump (const char *path, void (*print) (const xms_access_record *))
+{
+	xms_access_header hdr;
+	xms_access_record rec;
+	FILE *fh;
+
+	fh = fopen (path, "rb");
+
+	if (fh == NULL) {
+		perror (path);
+		return -1;
+	}
+
+	if (fread (&hdr, sizeof (hdr), 1, fh) != 1 ||
+		memcmp (hdr.magic, ACCESS_LOG_MAGIC, sizeof (hdr.magic)) != 0 ||
+		hdr.version != ACCESS_LOG_VERSION ||
+		hdr.record_size != sizeof (rec))
+	{
+		fprintf (stderr, "%s: not an access log or a wrong version\n",
+			path);
+		fclose (fh);
+		return -1;
+	}
+
+	/* incomplete records of a crashed server are skipped */
+	while (fread (&rec, sizeof (rec), 1, fh) == 1)
+		if (rec.flags & ACCESS_RECORD_VALID)
+			print (&rec);
+
+	fclose (fh);
+
+	return 0;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	void (*print) (const xms_access_record *) = print_text;
+	int opt, i, rc = EXIT_SUCCESS;
+
+	while ((opt = getopt (argc, argv, "ch")) != -1) {
+		switch (opt) {
+		case 'c':
+			print = print_csv;
+			break;
+		default:
+			fprintf (stderr, "Usage: %s [-c] FILE...\n", argv[0]);
+			fprintf (stderr, "  -c  print CSV instead of text\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind == argc) {
+		fprintf (stderr, "Usage: %s [-c] FILE...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (print == print_csv)
+		printf ("timestamp,peer,method,url,frame_seq,status,"
+			"bytes_in,bytes_out,duration_us,wait_us,receive_us,"
+			"submit_us,termination\n");
+
+	for (i = optind; i < argc; i++)
+		if (dump (argv[i], print) != 0)
+			rc = EXIT_FAILURE;
+
+	return rc;
+}
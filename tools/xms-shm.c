@@ -0,0 +1,166 @@
+#include "xms-shm.h"
+#include "shmstore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/* a writer is never slower than this, it copies a single frame */
+#define LATEST_ATTEMPTS 1000
+
+
+struct _xms_shm {
+	const unsigned char *map;
+	size_t size;
+	const xms_shm_header *hdr;
+};
+
+
+/* ------------------------------------------------------------------ */
+
+
+extern xms_shm *
+xms_shm_open (const char *name)
+{
+	char path[256];
+	struct stat st;
+	xms_shm *shm;
+	int fd;
+
+
+	snprintf (path, sizeof (path), "%s%s",
+		(name[0] == '/') ? "" : "/", name);
+
+	fd = shm_open (path, O_RDONLY, 0);
+
+	if (fd == -1)
+		return NULL;
+
+	if (fstat (fd, &st) != 0 ||
+		(size_t) st.st_size < sizeof (xms_shm_header))
+	{
+		(void) close (fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	shm = malloc (sizeof (*shm));
+
+	if (shm == NULL) {
+		(void) close (fd);
+		return NULL;
+	}
+
+	shm->size = st.st_size;
+	shm->map = mmap (NULL, shm->size, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close (fd);
+
+	if (shm->map == MAP_FAILED) {
+		free (shm);
+		return NULL;
+	}
+
+	shm->hdr = (const xms_shm_header *) shm->map;
+
+	if (memcmp (shm->hdr->magic, SHM_STORE_MAGIC,
+			sizeof (SHM_STORE_MAGIC)) != 0 ||
+		shm->hdr->version != SHM_STORE_VERSION ||
+		shm->hdr->size != shm->size)
+	{
+		xms_shm_close (shm);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return shm;
+}
+
+
+extern void
+xms_shm_close (xms_shm *shm)
+{
+	if (shm != NULL) {
+		(void) munmap ((void *) shm->map, shm->size);
+		free (shm);
+	}
+}
+
+
+extern uint64_t
+xms_shm_seq (const xms_shm *shm)
+{
+	return __atomic_load_n (&shm->hdr->seq, __ATOMIC_ACQUIRE);
+}
+
+
+static bool
+in_map (const xms_shm *shm, uint64_t offset, uint64_t size)
+{
+	return offset <= shm->size && size <= shm->size - offset;
+}
+
+
+extern bool
+xms_shm_latest (const xms_shm *shm, xms_shm_frame *frame)
+{
+	const xms_shm_slot *slot;
+	xms_shm_slot copy;
+	unsigned int i;
+
+
+	for (i = 0; i < LATEST_ATTEMPTS; i++) {
+		frame->slot = __atomic_load_n (&shm->hdr->current,
+			__ATOMIC_ACQUIRE) & 1;
+		slot = &shm->hdr->slots[frame->slot];
+
+		frame->lock = __atomic_load_n (&slot->lock, __ATOMIC_ACQUIRE);
+
+		/* being written, the writer has just flipped twice */
+		if (frame->lock & 1)
+			continue;
+
+		memcpy (&copy, slot, sizeof (copy));
+
+		if (!xms_shm_valid (shm, frame))
+			continue;
+
+		if (copy.seq == 0)
+			return false;
+
+		if (!in_map (shm, copy.jpeg_offset, copy.jpeg_size) ||
+			!in_map (shm, copy.rgb_offset, copy.rgb_size))
+		{
+			return false;
+		}
+
+		frame->seq = copy.seq;
+		frame->timestamp = copy.timestamp;
+		frame->jpeg = shm->map + copy.jpeg_offset;
+		frame->jpeg_size = copy.jpeg_size;
+		frame->rgb = (copy.rgb_size > 0) ?
+			shm->map + copy.rgb_offset : NULL;
+		frame->rgb_size = copy.rgb_size;
+		frame->width = copy.width;
+		frame->height = copy.height;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+extern bool
+xms_shm_valid (const xms_shm *shm, const xms_shm_frame *frame)
+{
+	/* reads of the frame data must not pass the lock check */
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n (&shm->hdr->slots[frame->slot].lock,
+		__ATOMIC_RELAXED) == frame->lock;
+}
@@ -0,0 +1,62 @@
+#ifndef XMS_SHM_CLIENT_H
+#define XMS_SHM_CLIENT_H
+
+/*
+ * A client of the shared memory frame store of x11mirror-server
+ * (-s NAME), see shmstore.h for the layout. Frames are read in place:
+ * take the latest one, use it and check that it is still valid.
+ *
+ *   xms_shm_frame f;
+ *
+ *   if (xms_shm_latest (shm, &f)) {
+ *       consume (f.jpeg, f.jpeg_size);
+ *       if (!xms_shm_valid (shm, &f))
+ *           ... overwritten meanwhile, drop the result & retry
+ *   }
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _xms_shm xms_shm;
+
+typedef struct _xms_shm_frame {
+	uint64_t seq;
+	uint64_t timestamp;	/* usec since the Epoch */
+
+	const unsigned char *jpeg;
+	size_t jpeg_size;
+
+	/* packed 8-bit RGB, NULL if the server has no raster */
+	const unsigned char *rgb;
+	size_t rgb_size;
+	uint32_t width;
+	uint32_t height;
+
+	/* see xms_shm_valid () */
+	unsigned int slot;
+	uint64_t lock;
+} xms_shm_frame;
+
+
+/* `name' as given to the server, NULL & errno on failure */
+extern xms_shm *
+xms_shm_open (const char *name);
+
+extern void
+xms_shm_close (xms_shm *shm);
+
+/* the latest sequence number, 0 if nothing has been published yet */
+extern uint64_t
+xms_shm_seq (const xms_shm *shm);
+
+/* false if nothing has been published yet */
+extern bool
+xms_shm_latest (const xms_shm *shm, xms_shm_frame *frame);
+
+/* false if the frame has been overwritten since xms_shm_latest () */
+extern bool
+xms_shm_valid (const xms_shm *shm, const xms_shm_frame *frame);
+
+#endif /* XMS_SHM_CLIENT_H */
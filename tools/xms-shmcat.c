@@ -0,0 +1,100 @@
+/*
+ * Writes the latest frame from the shared memory frame store of
+ * x11mirror-server (-s NAME) to stdout, as JPEG or as PPM (-r):
+ *
+ *   xms-shmcat [-r] NAME > frame.jpg
+ */
+#include "xms-shm.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define ATTEMPTS 10
+
+
+int
+main (int argc, char *argv[])
+{
+	bool raster = false;
+	xms_shm_frame frame;
+	unsigned char *copy = NULL;
+	size_t size = 0;
+	char ppm[64];
+	int ppm_size = 0;
+	xms_shm *shm;
+	int opt, i;
+
+
+	while ((opt = getopt (argc, argv, "rh")) != -1) {
+		switch (opt) {
+		case 'r':
+			raster = true;
+			break;
+		default:
+			fprintf (stderr, "Usage: %s [-r] NAME\n", argv[0]);
+			fprintf (stderr, "  -r  write the raster as PPM\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf (stderr, "Usage: %s [-r] NAME\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	shm = xms_shm_open (argv[optind]);
+
+	if (shm == NULL) {
+		fprintf (stderr, "%s: %s\n", argv[optind], strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	/* copy out, stdout may be slower than the server */
+	for (i = 0; i < ATTEMPTS; i++) {
+		if (!xms_shm_latest (shm, &frame))
+			break;
+
+		size = raster ? frame.rgb_size : frame.jpeg_size;
+		free (copy);
+		copy = malloc (size);
+
+		if (copy == NULL || (raster && frame.rgb == NULL)) {
+			size = 0;
+			break;
+		}
+
+		memcpy (copy, raster ? frame.rgb : frame.jpeg, size);
+
+		if (raster)
+			ppm_size = snprintf (ppm, sizeof (ppm), "P6\n%u %u\n255\n",
+				frame.width, frame.height);
+
+		if (xms_shm_valid (shm, &frame))
+			break;
+
+		size = 0;
+	}
+
+	xms_shm_close (shm);
+
+	if (size == 0) {
+		fprintf (stderr, "%s: no frame\n", argv[optind]);
+		free (copy);
+		return EXIT_FAILURE;
+	}
+
+	if ((raster && fwrite (ppm, 1, ppm_size, stdout) != (size_t) ppm_size)
+		|| fwrite (copy, 1, size, stdout) != size)
+	{
+		perror ("stdout");
+		free (copy);
+		return EXIT_FAILURE;
+	}
+
+	free (copy);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,257 @@
+#include "trace.h"
+#include "atomics.h"
+#include "clock.h"
+#include "common.h"
+#include "mutex.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* tracks (tid) of the trace file */
+enum trace_track {
+	TRACK_UPLOAD = 1,
+	TRACK_DECODE,
+	TRACK_ENCODE,
+	TRACK_PUBLISH,
+	TRACK_SERVE
+};
+
+const char *TRACE_HEADER_NAMES[TRACE_HEADERS] = {
+	TRACE_CAPTURE_TIME_HEADER,
+	TRACE_CAPTURE_SEQ_HEADER,
+	"Server-Timing"
+};
+
+/*
+ * Events are appended to a JSON array which is closed by free_trace (),
+ * trace viewers accept an unterminated one as well (e.g. after a crash).
+ */
+static struct {
+	FILE *fh;
+	SIMPLE_MUTEX *mutex;
+} tr;
+
+
+/* ------------------------------------------------------------------ */
+
+
+/* the stamps are taken by different threads, the clock may step back */
+static bool
+stage_known (uint64_t start, uint64_t end)
+{
+	return start != 0 && end != 0 && end >= start;
+}
+
+
+/* appends `name;dur=<msec>' to a Server-Timing value */
+static size_t
+timing_append (char *buf, size_t size, size_t len, const char *name,
+               uint64_t start, uint64_t end)
+{
+	int n;
+
+
+	if (!stage_known (start, end) || len >= size)
+		return len;
+
+	n = snprintf (buf + len, size - len, "%s%s;dur=%llu.%03llu",
+		(len > 0) ? ", " : "", name,
+		(unsigned long long) (end - start) / 1000,
+		(unsigned long long) (end - start) % 1000);
+
+	if (n < 0 || (size_t) n >= size - len)
+		return len;
+
+	return len + n;
+}
+
+
+static void
+write_stage (const xms_frame *frame, const char *name,
+             enum trace_track track, uint64_t start, uint64_t end)
+{
+	if (!stage_known (start, end))
+		return;
+
+	fprintf (tr.fh, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\","
+		"\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,"
+		"\"args\":{\"seq\":%llu", name, track,
+		(unsigned long long) start, (unsigned long long) (end - start),
+		(unsigned long long) frame->seq);
+
+	if (frame->trace.has_seq)
+		fprintf (tr.fh, ",\"capture_seq\":%llu",
+			(unsigned long long) frame->trace.capture_seq);
+
+	fputs ("}}", tr.fh);
+}
+
+
+extern void
+init_trace (const char *path)
+{
+	static const char *tracks[] = {
+		[TRACK_UPLOAD] = "upload",
+		[TRACK_DECODE] = "decode",
+		[TRACK_ENCODE] = "encode",
+		[TRACK_PUBLISH] = "publish",
+		[TRACK_SERVE] = "serve"
+	};
+	unsigned int i;
+
+
+	tr.mutex = simple_mutex_create ();
+
+	if (tr.mutex == NULL)
+		die ("failed to initialize trace\n");
+
+	simple_mutex_init (tr.mutex);
+
+	tr.fh = fopen (path, "w");
+
+	if (tr.fh == NULL)
+		die ("failed to open trace `%s': %s\n", path, strerror (errno));
+
+	fputs ("[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"args\":{\"name\":\"xms\"}}", tr.fh);
+
+	for (i = TRACK_UPLOAD; i <= TRACK_SERVE; i++)
+		fprintf (tr.fh, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			i, tracks[i]);
+
+	(void) fflush (tr.fh);
+}
+
+
+extern void
+free_trace (void)
+{
+	if (tr.fh == NULL)
+		return;
+
+	simple_mutex_lock (tr.mutex);
+
+	fputs ("\n]\n", tr.fh);
+
+	if (fclose (tr.fh) != 0)
+		warn ("trace: close: %s\n", strerror (errno));
+
+	xms_atomic_store (&tr.fh, NULL);
+	simple_mutex_unlock (tr.mutex);
+
+	simple_mutex_destroy (tr.mutex);
+	free (tr.mutex);
+	tr.mutex = NULL;
+}
+
+
+extern bool
+trace_enabled (void)
+{
+	return xms_atomic_load (&tr.fh) != NULL;
+}
+
+
+extern void
+trace_headers (const xms_frame *frame,
+               char values[TRACE_HEADERS][TRACE_VALUE_SIZE])
+{
+	const xms_frame_trace *t = &frame->trace;
+	size_t len = 0;
+
+
+	values[TRACE_HEADER_CAPTURE_TIME][0] = '\0';
+	values[TRACE_HEADER_CAPTURE_SEQ][0] = '\0';
+
+	if (t->capture != 0)
+		snprintf (values[TRACE_HEADER_CAPTURE_TIME], TRACE_VALUE_SIZE,
+			"%llu.%06llu",
+			(unsigned long long) t->capture / 1000000,
+			(unsigned long long) t->capture % 1000000);
+
+	if (t->has_seq)
+		snprintf (values[TRACE_HEADER_CAPTURE_SEQ], TRACE_VALUE_SIZE,
+			"%llu", (unsigned long long) t->capture_seq);
+
+	values[TRACE_HEADER_SERVER_TIMING][0] = '\0';
+
+	len = timing_append (values[TRACE_HEADER_SERVER_TIMING],
+		TRACE_VALUE_SIZE, len, "upload", t->capture, t->received);
+	len = timing_append (values[TRACE_HEADER_SERVER_TIMING],
+		TRACE_VALUE_SIZE, len, "decode", t->received, t->decoded);
+	len = timing_append (values[TRACE_HEADER_SERVER_TIMING],
+		TRACE_VALUE_SIZE, len, "encode", t->decoded, t->encoded);
+	len = timing_append (values[TRACE_HEADER_SERVER_TIMING],
+		TRACE_VALUE_SIZE, len, "publish", t->encoded, frame->timestamp);
+	(void) timing_append (values[TRACE_HEADER_SERVER_TIMING],
+		TRACE_VALUE_SIZE, len, "age", frame->timestamp, clock_usec (CLOCK_REALTIME));
+}
+
+
+extern void
+trace_published (const xms_frame *frame)
+{
+	const xms_frame_trace *t = &frame->trace;
+
+
+	if (!trace_enabled ())
+		return;
+
+	simple_mutex_lock (tr.mutex);
+
+	if (tr.fh != NULL) {
+		write_stage (frame, "upload", TRACK_UPLOAD,
+			t->capture, t->received);
+		write_stage (frame, "decode", TRACK_DECODE,
+			t->received, t->decoded);
+		write_stage (frame, "encode", TRACK_ENCODE,
+			t->decoded, t->encoded);
+		write_stage (frame, "publish", TRACK_PUBLISH,
+			t->encoded, frame->timestamp);
+
+		/* once per frame, serve events are flushed here too */
+		(void) fflush (tr.fh);
+	}
+
+	simple_mutex_unlock (tr.mutex);
+}
+
+
+extern void
+trace_sent (const xms_frame *frame, const char *via, uint64_t viewer)
+{
+	uint64_t now;
+
+
+	if (!trace_enabled ())
+		return;
+
+	now = clock_usec (CLOCK_REALTIME);
+
+	simple_mutex_lock (tr.mutex);
+
+	if (tr.fh != NULL) {
+		fprintf (tr.fh, ",\n{\"name\":\"sent\",\"cat\":\"viewer\","
+			"\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%llu,\"args\":{\"seq\":%llu,\"via\":\"%s\","
+			"\"viewer\":%llu", TRACK_SERVE,
+			(unsigned long long) now,
+			(unsigned long long) frame->seq, via,
+			(unsigned long long) viewer);
+
+		if (stage_known (frame->timestamp, now))
+			fprintf (tr.fh, ",\"age\":%llu",
+				(unsigned long long) (now - frame->timestamp));
+
+		if (stage_known (frame->trace.capture, now))
+			fprintf (tr.fh, ",\"capture_age\":%llu",
+				(unsigned long long) (now - frame->trace.capture));
+
+		fputs ("}}", tr.fh);
+	}
+
+	simple_mutex_unlock (tr.mutex);
+}
@@ -0,0 +1,64 @@
+#ifndef XMS_TRACE_H
+#define XMS_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "frames.h"
+
+/*
+ * End-to-end timing of frames. An uploader may send the capture time
+ * of a frame (X-Capture-Time, seconds since the Epoch with an optional
+ * fraction) and its own sequence number (X-Capture-Seq), the server
+ * stamps every stage of the frame (xms_frame_trace). The stamps are
+ * sent to viewers as response headers and, optionally, written to
+ * a trace file: Chrome trace event format (JSON), one track per stage.
+ */
+
+#define TRACE_CAPTURE_TIME_HEADER "X-Capture-Time"
+#define TRACE_CAPTURE_SEQ_HEADER "X-Capture-Seq"
+
+/* response headers of a frame, see trace_headers () */
+enum trace_header {
+	TRACE_HEADER_CAPTURE_TIME = 0,
+	TRACE_HEADER_CAPTURE_SEQ,
+	TRACE_HEADER_SERVER_TIMING,
+	TRACE_HEADERS
+};
+
+#define TRACE_VALUE_SIZE 192
+
+extern const char *TRACE_HEADER_NAMES[TRACE_HEADERS];
+
+
+extern void
+init_trace (const char *path);
+
+extern void
+free_trace (void);
+
+extern bool
+trace_enabled (void);
+
+/*
+ * Fills values of the headers for a frame being served, an empty value
+ * means no header. Server-Timing durations are: upload (capture to
+ * received), decode, encode (detection included), publish and age
+ * (published to now).
+ */
+extern void
+trace_headers (const xms_frame *frame,
+               char values[TRACE_HEADERS][TRACE_VALUE_SIZE]);
+
+/* writes stage events of a published frame */
+extern void
+trace_published (const xms_frame *frame);
+
+/*
+ * Writes an event: the first byte of a frame has been handed over to
+ * a viewer, `via' is a resource name, `viewer' is 0 if unknown.
+ */
+extern void
+trace_sent (const xms_frame *frame, const char *via, uint64_t viewer);
+
+#endif /* XMS_TRACE_H */
@@ -2,11 +2,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <time.h>
 #include <errno.h>
-#ifndef VLOOGER_NO_PTHREAD
+#include <unistd.h>
+#include <sys/uio.h>
+#ifndef VLOGGER_NO_PTHREAD
     #include <pthread.h>
+    #include <sched.h>
 #endif
 #ifndef VLOGGER_NO_SYSLOG
     #include <syslog.h>
@@ -27,8 +31,62 @@ static char *vlogger_syslog_ident;
 static int  vlogger_syslog_facility;
 
 
+/* a formatted record, `msg' is an offset of the message after the date */
+typedef struct vlogger_record_s {
+    int level;
+    size_t len;
+    size_t msg;
+    char text[VLOGGER_RECORD_SIZE];
+} vlogger_record_t;
+
+
+/* the date prefix is formatted once per second */
+typedef struct vlogger_date_s {
+    time_t sec;
+    size_t len;
+    char text[VLOGGER_DATE_SIZE];
+} vlogger_date_t;
+
+
 #ifndef VLOGGER_NO_PTHREAD
-pthread_mutex_t lock;
+/*
+ * Every thread formats records into its own single-producer ring,
+ * the writer thread drains all of the rings using writev (2), so
+ * a logging thread never waits for I/O nor for other threads.
+ * Rings are never freed: another thread may be writing into its ring
+ * while vlogger_close () runs. A ring of an exited thread is taken over
+ * by the next new thread, a reopened writer drains the same rings.
+ */
+typedef struct vlogger_ring_s {
+    vlogger_record_t records[VLOGGER_RING_SIZE];
+    size_t head;    /* written by the owner */
+    size_t tail;    /* written by the writer */
+    int owned;
+    vlogger_date_t date;
+    struct vlogger_ring_s *next;
+} vlogger_ring_t;
+
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_key_t key;
+    bool key_created;
+    int running;
+    int sleeping;
+    bool stopping;
+    size_t dropped;
+    void (*init) (void);
+} writer = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static vlogger_ring_t *rings;
+
+/* guards files against vlogger_reload () & the synchronous path */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 
@@ -82,51 +140,109 @@ get_syslog_facility (const char* facility)
 }
 
 
-static int
-vlogger_get_time_string (char **out, size_t out_len)
+/* writes the date with VLOGGER_NSEC_DIGITS of nanoseconds to 'out' */
+static size_t
+vlogger_get_time_string (vlogger_date_t *date, char *out, size_t out_len)
 {
     struct timespec tp;
-    struct tm *tmp;
+    struct tm tm;
     size_t len;
-    char nsec[VLOGGER_NSEC_SIZE + 1];
     long x;
+    int i;
 
 
-    assert(clock_gettime (CLOCK_REALTIME, &tp) != -1);
-    NULL_CHECK(tmp = localtime (&tp.tv_sec));
-    /* fill in a date to 'out' first */
-    ZERO_CHECK(strftime (*out, out_len, VLOGGER_DATE_FMT, tmp));
+    (void) clock_gettime (CLOCK_REALTIME, &tp);
 
-    /* prepend zeros */
-    memset (nsec, '0', VLOGGER_NSEC_SIZE - 1);
-    for (len = 0, x = tp.tv_nsec;
-         x != 0 && len < VLOGGER_NSEC_SIZE;
-         len++, x /= 10L);
-    snprintf (nsec + VLOGGER_NSEC_SIZE - len, len + 1, "%li", tp.tv_nsec);
+    /* localtime & strftime are expensive, do it once per second */
+    if (date->len == 0 || date->sec != tp.tv_sec) {
+        NULL_CHECK(localtime_r (&tp.tv_sec, &tm));
+        date->len = strftime (date->text, sizeof (date->text),
+                              VLOGGER_DATE_FMT, &tm);
+        ZERO_CHECK(date->len);
+        date->sec = tp.tv_sec;
+    }
 
-    /* cut last digits and append the result */
-    len = strlen (*out);
-    assert (out_len > len + VLOGGER_NSEC_DIGITS + 2);
-    /* NSEC_DIGITS + '.' + '\0' */
-    snprintf (*out + len, VLOGGER_NSEC_DIGITS + 2, ".%s", nsec);
-    len += VLOGGER_NSEC_DIGITS + 1;
+    /* date + '.' + NSEC_DIGITS + '\0' */
+    assert (out_len > date->len + VLOGGER_NSEC_DIGITS + 1);
+    memcpy (out, date->text, date->len);
+    len = date->len;
+    out[len++] = '.';
+
+    /* cut last digits, keep leading zeros */
+    for (x = tp.tv_nsec, i = VLOGGER_NSEC_SIZE - VLOGGER_NSEC_DIGITS;
+         i > 0; i--, x /= 10L);
+    for (i = VLOGGER_NSEC_DIGITS - 1; i >= 0; i--, x /= 10L)
+        out[len + i] = '0' + x % 10L;
+    len += VLOGGER_NSEC_DIGITS;
+    out[len] = '\0';
 
     return len;
 }
 
 
+/* formats a whole record: "<date> <level>message" */
+static void
+format_record (vlogger_record_t *rec, vlogger_date_t *date,
+               int level, const char *fmt, va_list ap)
+{
+    size_t len = 0;
+    int n;
+
+
+    rec->level = level;
+
+    /* syslog has own timestamps */
+    if (vlogger_mode != VLOGGER_MODE_SYSLOG) {
+        len = vlogger_get_time_string (date, rec->text, sizeof (rec->text));
+        rec->text[len++] = ' ';
+        n = strlen (vlogger_level_names[level]);
+        memcpy (rec->text + len, vlogger_level_names[level], n);
+        len += n;
+    }
+
+    rec->msg = len;
+    n = vsnprintf (rec->text + len, sizeof (rec->text) - len, fmt, ap);
+
+    if (n < 0)
+        n = 0;
+
+    if ((size_t) n >= sizeof (rec->text) - len) {
+        /* truncated, but still a whole line */
+        len = sizeof (rec->text) - 1;
+        rec->text[len - 1] = '\n';
+    }
+    else
+        len += n;
+
+    rec->len = len;
+}
+
+
+static void
+format_recordf (vlogger_record_t *rec, vlogger_date_t *date,
+                int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start (ap, fmt);
+    format_record (rec, date, level, fmt, ap);
+    va_end (ap);
+}
+
+
 static void
 close_files ()
 {
-    if (vlogger_out_fh) {
+    if (vlogger_out_fh && vlogger_out_fh != stdout) {
+        if (vlogger_err_fh == vlogger_out_fh)
+            vlogger_err_fh = NULL;
         fclose (vlogger_out_fh);
-        vlogger_err_fh = NULL;
     }
+    vlogger_out_fh = NULL;
 
-    if (vlogger_err_fh) {
+    if (vlogger_err_fh && vlogger_err_fh != stderr)
         fclose (vlogger_err_fh);
-        vlogger_err_fh = NULL;
-    }
+    vlogger_err_fh = NULL;
 }
 
 
@@ -157,6 +273,344 @@ reopen_files ()
 }
 
 
+static int
+get_fd (int level)
+{
+    FILE *fh;
+
+    switch (level) {
+    case VLOGGER_FATAL:
+    case VLOGGER_ALERT:
+    case VLOGGER_CRIT:
+    case VLOGGER_ERROR:
+        fh = vlogger_err_fh;
+        break;
+    default:
+        fh = vlogger_out_fh;
+        break;
+    }
+
+    return fh ? fileno (fh) : -1;
+}
+
+
+static void
+writev_all (int fd, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+
+    while (cnt > 0) {
+        n = writev (fd, iov, cnt);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        /* skip what has been written */
+        for (; cnt > 0 && (size_t) n >= iov->iov_len; iov++, cnt--)
+            n -= iov->iov_len;
+
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+
+/* writes `cnt' records, the caller holds the lock if there is one */
+static void
+write_records (vlogger_record_t **recs, size_t cnt)
+{
+    struct iovec iov[VLOGGER_BATCH_SIZE];
+    size_t i, n;
+    int fd;
+
+
+    assert (cnt <= VLOGGER_BATCH_SIZE);
+
+    if (vlogger_mode == VLOGGER_MODE_SYSLOG) {
+#ifndef VLOGGER_NO_SYSLOG
+        for (i = 0; i < cnt; i++)
+            syslog (vlogger_syslog_levels[recs[i]->level] |
+                    vlogger_syslog_facility, "%.*s",
+                    (int) (recs[i]->len - recs[i]->msg),
+                    recs[i]->text + recs[i]->msg);
+#endif
+        return;
+    }
+
+    /* adjacent records of the same stream go by a single call */
+    for (i = 0; i < cnt; i += n) {
+        fd = get_fd (recs[i]->level);
+
+        for (n = 0; i + n < cnt && get_fd (recs[i + n]->level) == fd; n++) {
+            iov[n].iov_base = recs[i + n]->text;
+            iov[n].iov_len = recs[i + n]->len;
+        }
+
+        if (fd != -1)
+            writev_all (fd, iov, n);
+    }
+}
+
+
+#ifndef VLOGGER_NO_PTHREAD
+static void
+release_ring (void *ptr)
+{
+    vlogger_ring_t *ring = ptr;
+
+    __atomic_store_n (&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+
+static vlogger_ring_t *
+get_ring (void)
+{
+    vlogger_ring_t *ring = pthread_getspecific (writer.key);
+    int expected;
+
+
+    if (ring != NULL)
+        return ring;
+
+    /* take over a ring of an exited thread first */
+    for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next)
+    {
+        expected = 0;
+        if (__atomic_compare_exchange_n (&ring->owned, &expected, 1,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    if (ring == NULL) {
+        ring = calloc (1, sizeof (*ring));
+
+        if (ring == NULL)
+            return NULL;
+
+        ring->owned = 1;
+        ring->next = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+
+        while (!__atomic_compare_exchange_n (&rings, &ring->next, ring,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    }
+
+    pthread_setspecific (writer.key, ring);
+
+    return ring;
+}
+
+
+static void
+wake_writer (void)
+{
+    /* pairs with the check of rings in writer_main () */
+    if (__atomic_load_n (&writer.sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock (&writer.mutex);
+        pthread_cond_signal (&writer.cond);
+        pthread_mutex_unlock (&writer.mutex);
+    }
+}
+
+
+/* returns false if the record has to be written synchronously */
+static bool
+push_record (int level, const char *fmt, va_list ap, size_t *len)
+{
+    vlogger_ring_t *ring;
+    vlogger_record_t *rec;
+    size_t head;
+    int tries;
+
+
+    if (!__atomic_load_n (&writer.running, __ATOMIC_ACQUIRE))
+        return false;
+
+    if ((ring = get_ring ()) == NULL)
+        return false;
+
+    head = ring->head;
+
+    /* give the writer a chance, then drop */
+    for (tries = 0;
+         head - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) ==
+         VLOGGER_RING_SIZE; tries++)
+    {
+        if (tries == 3) {
+            __atomic_add_fetch (&writer.dropped, 1, __ATOMIC_RELAXED);
+            *len = 0;
+            return true;
+        }
+
+        wake_writer ();
+        sched_yield ();
+    }
+
+    rec = &ring->records[head & (VLOGGER_RING_SIZE - 1)];
+    format_record (rec, &ring->date, level, fmt, ap);
+    *len = rec->len;
+
+    __atomic_store_n (&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    wake_writer ();
+
+    return true;
+}
+
+
+static size_t
+drain_rings (void)
+{
+    vlogger_record_t *batch[VLOGGER_BATCH_SIZE];
+    vlogger_ring_t *ring;
+    size_t head, tail, n, total = 0;
+
+
+    for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next)
+    {
+        head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+        tail = ring->tail;
+
+        while (tail != head) {
+            for (n = 0; tail + n != head && n < VLOGGER_BATCH_SIZE; n++)
+                batch[n] =
+                    &ring->records[(tail + n) & (VLOGGER_RING_SIZE - 1)];
+
+            pthread_mutex_lock (&lock);
+            write_records (batch, n);
+            pthread_mutex_unlock (&lock);
+
+            tail += n;
+            total += n;
+            __atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+
+    return total;
+}
+
+
+static bool
+rings_pending (void)
+{
+    vlogger_ring_t *ring;
+
+    for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next)
+    {
+        if (__atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) != ring->tail)
+            return true;
+    }
+
+    return false;
+}
+
+
+static void
+report_dropped (void)
+{
+    size_t dropped = __atomic_exchange_n (&writer.dropped, 0,
+                                          __ATOMIC_RELAXED);
+    vlogger_record_t rec, *recs = &rec;
+    vlogger_date_t date = { 0, 0, "" };
+
+    if (dropped > 0) {
+        format_recordf (&rec, &date, VLOGGER_WARN,
+                        "vlogger: %zu records dropped\n", dropped);
+        pthread_mutex_lock (&lock);
+        write_records (&recs, 1);
+        pthread_mutex_unlock (&lock);
+    }
+}
+
+
+static void *
+writer_main (void *arg)
+{
+    struct timespec ts;
+
+    (void) arg;
+
+    if (writer.init != NULL)
+        writer.init ();
+
+    for (;;) {
+        report_dropped ();
+
+        if (drain_rings () > 0)
+            continue;
+
+        pthread_mutex_lock (&writer.mutex);
+
+        if (writer.stopping) {
+            pthread_mutex_unlock (&writer.mutex);
+            break;
+        }
+
+        __atomic_store_n (&writer.sleeping, 1, __ATOMIC_SEQ_CST);
+
+        if (!rings_pending ()) {
+            /* a timeout is just a safety net */
+            (void) clock_gettime (CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait (&writer.cond, &writer.mutex, &ts);
+        }
+
+        __atomic_store_n (&writer.sleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock (&writer.mutex);
+    }
+
+    return NULL;
+}
+
+
+static void
+start_writer (void)
+{
+    if (writer.running || vlogger_mode == VLOGGER_MODE_SILENT)
+        return;
+
+    if (!writer.key_created) {
+        if (pthread_key_create (&writer.key, release_ring) != 0)
+            return;
+        writer.key_created = true;
+    }
+
+    writer.stopping = false;
+
+    /* logging stays synchronous if there is no writer */
+    if (pthread_create (&writer.thread, NULL, writer_main, NULL) == 0)
+        __atomic_store_n (&writer.running, 1, __ATOMIC_RELEASE);
+}
+
+
+static void
+stop_writer (void)
+{
+    if (!writer.running)
+        return;
+
+    __atomic_store_n (&writer.running, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock (&writer.mutex);
+    writer.stopping = true;
+    pthread_cond_signal (&writer.cond);
+    pthread_mutex_unlock (&writer.mutex);
+
+    pthread_join (writer.thread, NULL);
+
+    /* whatever came after the last drain */
+    (void) drain_rings ();
+    report_dropped ();
+}
+#endif
+
+
 extern void
 vlogger_open (vlogger_t *vlogger)
 {
@@ -185,104 +639,87 @@ vlogger_open (vlogger_t *vlogger)
         vlogger_err_fh = NULL;
         break;
     }
+
+#ifndef VLOGGER_NO_PTHREAD
+    writer.init = vlogger->writer_init;
+    start_writer ();
+#endif
 }
 
 
 extern void
 vlogger_reload ()
 {
-    reopen_files ();
+#ifndef VLOGGER_NO_PTHREAD
+    pthread_mutex_lock (&lock);
+#endif
+
+    if (vlogger_mode == VLOGGER_MODE_FILE)
+        reopen_files ();
     reopen_syslog ();
+
+#ifndef VLOGGER_NO_PTHREAD
+    pthread_mutex_unlock (&lock);
+#endif
 }
 
 
 extern void
 vlogger_close ()
 {
-    close_files ();
+#ifndef VLOGGER_NO_PTHREAD
+    stop_writer ();
+#endif
+
+    if (vlogger_mode == VLOGGER_MODE_FILE)
+        close_files ();
 #ifndef VLOGGER_NO_SYSLOG
     closelog ();
 #endif
 }
 
 
-static int
-vprintf_file (int level, const char *fmt, va_list ap)
-{
-    FILE *fh;
-
-    switch (level) {
-    case VLOGGER_FATAL:
-    case VLOGGER_ALERT:
-    case VLOGGER_CRIT:
-    case VLOGGER_ERROR:
-        fh = vlogger_err_fh;
-        break;
-    default:
-        fh = vlogger_out_fh;
-        break;
-    }
-
-    if (fh)
-        return vfprintf (fh, fmt, ap);
-    else
-        return 0;
-}
-
-
-static int
-fprintf_file (int level, const char *fmt, ...)
+extern int
+vlogger_log (int level, const char *fmt, ...)
 {
-    int len;
+    vlogger_record_t rec, *recs = &rec;
+    vlogger_date_t date = { 0, 0, "" };
     va_list ap;
-
-    va_start(ap, fmt);
-    len = vprintf_file (level, fmt, ap);
-    va_end(ap);
-
-    return len;
-}
+    size_t len;
+    bool queued;
 
 
-extern int
-vlogger_log (int level, const char *fmt, ...)
-{
     if (vlogger_mode == VLOGGER_MODE_SILENT)
         return 0;
 
+    /*
+     * Errors are written right away: the process may be about to exit
+     * (e.g. die () or an early return from main ()) before the writer
+     * gets to the ring. They may overtake records queued before them.
+     */
+    va_start (ap, fmt);
 #ifndef VLOGGER_NO_PTHREAD
-    pthread_mutex_lock(&lock);
+    queued = level > VLOGGER_ERROR && push_record (level, fmt, ap, &len);
+#else
+    queued = false;
 #endif
+    va_end (ap);
 
-    va_list ap;
-    int len = 0;
+    if (queued)
+        return len;
 
+    /* an error or no writer (before vlogger_open (), after vlogger_close ()) */
     va_start (ap, fmt);
-
-    if (vlogger_mode == VLOGGER_MODE_SYSLOG) {
-#ifndef VLOGGER_NO_SYSLOG
-        ssize_t bufsz = vsnprintf (NULL, 0, fmt, ap);
-        char *buf = malloc (bufsz + 1);
-        NULL_CHECK(buf);
-        vsnprintf (buf, bufsz + 1, fmt, ap);
-        int priority = vlogger_syslog_levels[level] | vlogger_syslog_facility;
-        syslog (priority, buf);
-        free (buf);
-#endif
-    }
-    else {
-        char date[VLOGGER_DATE_SIZE] = "";
-        char *datep = date;
-        (void) vlogger_get_time_string (&datep, sizeof(date));
-        len += fprintf_file (level, "%s %s", date, vlogger_level_names[level]);
-        len += vprintf_file (level, fmt, ap);
-    }
-
+    format_record (&rec, &date, level, fmt, ap);
     va_end (ap);
 
 #ifndef VLOGGER_NO_PTHREAD
-    pthread_mutex_unlock(&lock);
+    pthread_mutex_lock (&lock);
+#endif
+    write_records (&recs, 1);
+#ifndef VLOGGER_NO_PTHREAD
+    pthread_mutex_unlock (&lock);
 #endif
 
-    return len;
+    return rec.len;
 }
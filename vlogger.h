@@ -17,6 +17,18 @@
 #ifndef VLOGGER_NSEC_SIZE
 #define VLOGGER_NSEC_SIZE 9
 #endif
+/* max. size of a formatted record, longer ones are truncated */
+#ifndef VLOGGER_RECORD_SIZE
+#define VLOGGER_RECORD_SIZE 512
+#endif
+/* records in a per-thread ring, must be a power of two */
+#ifndef VLOGGER_RING_SIZE
+#define VLOGGER_RING_SIZE 256
+#endif
+/* max. records written by a single writev () */
+#ifndef VLOGGER_BATCH_SIZE
+#define VLOGGER_BATCH_SIZE 64
+#endif
 
 
 typedef enum {
@@ -51,6 +63,8 @@ typedef struct vlogger_s {
     char *errfile;
     char *syslog_ident;
     char *syslog_facility;
+    /* called by the writer thread at start, may be NULL */
+    void (*writer_init) (void);
 } vlogger_t;
 
 